@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Bump allocator: hands out memory from large blocks and frees all of it at once, when it's
+// released or destroyed. Nothing in it is destroyed, so it only holds trivially destructible
+// types. Blocks double in size up to MAX_BLOCK, so a unit takes few of them whatever its size.
+class Arena {
+private:
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    Block* _blocks;
+    uint8_t* _current;
+    uint8_t* _end;
+    size_t _next_size;
+    size_t _used;
+    size_t _reserved;
+    size_t _allocations;
+
+    void _grow(size_t size, size_t align);
+
+public:
+    static constexpr size_t FIRST_BLOCK = 16 << 10;
+    static constexpr size_t MAX_BLOCK = 1 << 20;
+
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+
+    void* allocate(size_t size, size_t align);
+
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "Nothing in an Arena is destroyed.");
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Frees every block.
+    void release();
+
+    size_t used() const; // Bytes handed out.
+    size_t reserved() const; // Bytes of the blocks.
+    size_t allocations() const; // Blocks allocated, ever.
+};
\ No newline at end of file
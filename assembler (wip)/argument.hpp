@@ -2,41 +2,49 @@
 
 #include "common.hpp"
 #include <cstdint>
-#include <memory>
-#include <string>
-#include <typeinfo>
-#include <typeindex>
+#include <optional>
+#include <string_view>
+#include <variant>
 
-class Argument {
+class RegisterArg {
 public:
-    virtual ~Argument();
-
-    std::type_index type() const;
+    Register value;
 };
 
-using ArgPtr = std::unique_ptr<Argument>;
-
-class RegisterArg : public Argument {
+class ImmediateArg {
 public:
-    const Register value;
+    bool negative;
+    uint16_t value;
 
-    RegisterArg(Register value);
+    // Empty if str isn't a number (see parse_number()).
+    static std::optional<ImmediateArg> parse(std::string_view str);
 };
 
-class ImmediateArg : public Argument {
+// The instruction a label is on, as its index in the program (the size of the program for a label
+// at the end), so that the instructions can move, and the section it is in (Program::section()).
+// A label at the end of a section is on the index of the first instruction of the next one, and
+// its section keeps it where it is. A program has fewer than 65536 instructions, which take a byte
+// each at least.
+class LabelArg {
 public:
-    const bool negative;
-    const uint16_t value;
+    uint16_t target;
+    uint16_t section;
+};
 
-    ImmediateArg(bool negative, uint16_t value);
+// Held by value (inline in the instruction), its kind is the index of the alternative.
+using Argument = std::variant<RegisterArg, ImmediateArg, LabelArg>;
 
-    static ArgPtr parse(const std::string& str);
+enum class ArgKind : uint8_t
+{
+    REGISTER,
+    IMMEDIATE,
+    LABEL,
 };
 
-class InstrInstance;
-class LabelArg : public Argument {
-public:
-    InstrInstance& target;
+static_assert(std::is_same_v<std::variant_alternative_t<*ArgKind::REGISTER, Argument>, RegisterArg>);
+static_assert(std::is_same_v<std::variant_alternative_t<*ArgKind::IMMEDIATE, Argument>, ImmediateArg>);
+static_assert(std::is_same_v<std::variant_alternative_t<*ArgKind::LABEL, Argument>, LabelArg>);
 
-    LabelArg(InstrInstance& target);
-};
+inline ArgKind kind(const Argument& arg) {
+    return ArgKind(arg.index());
+}
@@ -2,38 +2,132 @@
 
 #include <array>
 #include <cstdint>
-#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <variant>
+#include <vector>
+#include "arena.hpp"
 #include "instruction.hpp"
 
+// The bytes of an instruction: in place up to 8 of them, in the arena of the program past that.
+// It takes the size of the largest variant when it's made, so emitting again never allocates.
 class Buffer {
 private:
-    using Pointer = std::unique_ptr<uint8_t[]>;
-    using Local = std::array<uint8_t, sizeof(Pointer)>;
-    [[no_unique_address]] std::variant<Pointer, Local> _data;
+    using Local = std::array<uint8_t, sizeof(uint8_t*)>;
+    std::variant<uint8_t*, Local> _data;
 
 public:
-    Buffer();
+    Buffer(size_t capacity, Arena& arena);
 
-    uint8_t* get_size(size_t size);
+    uint8_t* get();
     const uint8_t* get() const;
 };
 
 class InstrInstance {
 private:
-    const std::vector<ArgPtr> _args;
-    const InstructionDef& _def;
-    size_t _curr_variant;
-    [[no_unique_address]] Buffer _buffer;
+    std::array<Argument, Signature::MAX_ARGS> _args;
+    const InstructionDef* _def;
+    Buffer _buffer;
+    uint8_t _count;
+    uint8_t _curr_variant;
     bool _success;
-    size_t _address;
 
 public:
-    InstrInstance(const Signature& signature, std::vector<ArgPtr>&& args);
+    // Takes the bytes it needs past 8 from arena.
+    InstrInstance(Opcode opcode, std::span<const Argument> args, Arena& arena);
 
-    bool try_emit();
+    // Emits the current variant at address, or moves on to the next (larger) one and returns
+    // false if it doesn't fit. Variants are never given back, so an instruction only grows.
+    bool try_emit(size_t address, const Layout& layout);
+    std::span<const Argument> args() const;
+    // Points the label argument at the instruction at target, in section.
+    void set_target(size_t argument, uint16_t target, uint16_t section);
+    Opcode opcode() const;
+    bool independent() const;
+    bool can_grow() const; // False at the largest variant.
     size_t size() const;
     void write(uint8_t* to) const;
 };
 
-void assemble(std::vector<InstrInstance>& program, uint8_t* dest);
\ No newline at end of file
+// The instructions from first on go from address on, up to the next origin (.move). Those before
+// the first origin go from 0. Every origin starts a section, even if nothing goes in it.
+class Origin {
+public:
+    uint32_t first;
+    uint16_t address;
+};
+
+// Bytes written from address on.
+class Segment {
+public:
+    uint16_t address;
+    uint32_t size; // Up to all of memory.
+};
+
+// Addresses of the instructions of a program, kept as a Fenwick tree of their sizes so that
+// growing an instruction and looking up an address both take O(log n) (and a binary search over
+// the origins).
+class Layout {
+private:
+    std::vector<size_t> _tree;
+    std::vector<Origin> _origins;
+
+    size_t _offset(size_t index) const;
+
+public:
+    Layout(std::span<const InstrInstance> program, std::span<const Origin> origins);
+
+    void grow(size_t index, size_t by);
+    size_t address(size_t index) const;
+    // The address of the instruction at index counted from the start of section, for a label: the
+    // end of the section if index is past it.
+    size_t address(size_t index, size_t section) const;
+    std::vector<Segment> segments() const; // The non-empty runs from the origins, in their order.
+};
+
+// The instructions of one assembly unit, one after the other in a single array (an instruction
+// takes less than a cache line), and everything they hold. All of it is in an arena, freed at once
+// with the program. The array doubles when it's full, and the old one stays in the arena until
+// then: the ones before it take less than it does.
+class Program {
+private:
+    Arena _arena;
+    InstrInstance* _instrs;
+    size_t _size;
+    size_t _capacity;
+    std::vector<Origin> _origins;
+
+public:
+    explicit Program(size_t capacity = 0);
+    Program(const Program&) = delete;
+    Program(Program&& other) noexcept;
+    Program& operator=(const Program&) = delete;
+
+    // Returns the index of the instruction, which labels on it take as their target. Throws if
+    // there is no instruction for the arguments, or no room for it in memory. An instruction
+    // without labels is emitted here, once, so it throws as well if its operands don't fit.
+    size_t add(Opcode opcode, std::span<const Argument> args);
+    // The instructions added next go from address on, in a new section.
+    void move(uint16_t address);
+    size_t size() const;
+    // The section the instructions added next go in: 0 before the first origin, then the number of
+    // origins, which labels defined now take as theirs.
+    uint16_t section() const;
+    std::span<InstrInstance> instructions();
+    std::span<const InstrInstance> instructions() const;
+    std::span<const Origin> origins() const;
+    const Arena& arena() const;
+};
+
+// An error in the instruction at index instruction of the program given to assemble().
+class AssemblyError : public std::runtime_error {
+public:
+    size_t instruction;
+
+    AssemblyError(size_t instruction, const std::string& message);
+};
+
+// Writes the program to dest (all of memory), and returns where. Throws AssemblyError if an
+// instruction can't be emitted, or if it goes past the end of memory or over one before it.
+std::vector<Segment> assemble(Program& program, uint8_t* dest);
\ No newline at end of file
@@ -0,0 +1,246 @@
+// Times building and assembling generated programs, and reports the memory they take. --check
+// compares the assembler with a naive layout of them instead.
+//     g++ -o bench bench.cpp src/*.cpp -std=c++23 -O3 -Wall
+#include "assembler.hpp"
+#include "linker.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// Every allocation of the process goes through these, so they count them.
+size_t heap_allocations = 0;
+size_t heap_bytes = 0;
+
+[[gnu::noinline]] void* operator new(size_t size) {
+    ++heap_allocations;
+    heap_bytes += size;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// A mix of what compiled code looks like: arithmetic, loads and stores, calls, and branches,
+// mostly to labels nearby and sometimes far, so that some of them grow.
+void generate(Program& program, size_t size, unsigned seed) {
+    std::mt19937 random(seed);
+    auto reg = [&] { return RegisterArg{ Register(random() % 16) }; };
+    auto imm = [&](int low, int high) {
+        int value = low + (int)(random() % (high - low + 1));
+        return ImmediateArg{ value < 0, (uint16_t)std::abs(value) };
+    };
+    auto label = [&](size_t index) {
+        size_t target = random() % 8 ? std::min<size_t>(index + random() % 80, size) : random() % (size + 1);
+        return LabelArg{ (uint16_t)target, 0 };
+    };
+    for (size_t i = 0; i < size; ++i) {
+        switch (random() % 16) {
+        case 0:
+        case 1:
+        case 2: {
+            Argument args[] = { reg(), reg(), reg() };
+            program.add(random() % 2 ? Opcode::ADD : Opcode::XOR, args);
+            break;
+        }
+        case 3:
+        case 4: {
+            Argument args[] = { reg(), imm(-300, 300) };
+            program.add(Opcode::ADD, args);
+            break;
+        }
+        case 5:
+        case 6: {
+            Argument args[] = { reg(), reg(), imm(-64, 64) };
+            program.add(random() % 2 ? Opcode::LDW : Opcode::STW, args);
+            break;
+        }
+        case 7: {
+            Argument args[] = { reg(), imm(-1000, 1000) };
+            program.add(Opcode::LDI, args);
+            break;
+        }
+        case 8: {
+            Argument args[] = { reg(), reg() };
+            program.add(Opcode::MOV, args);
+            break;
+        }
+        case 9:
+        case 10:
+        case 11: {
+            Argument args[] = { reg(), reg(), label(i) };
+            program.add(Opcode(*Opcode::BEQ + random() % 10), args);
+            break;
+        }
+        case 12: {
+            Argument args[] = { label(i) };
+            program.add(Opcode::BRA, args);
+            break;
+        }
+        case 13: {
+            Argument args[] = { label(i) };
+            program.add(Opcode::JSR, args);
+            break;
+        }
+        case 14: {
+            Argument args[] = { reg(), label(i) };
+            program.add(Opcode::LDI, args);
+            break;
+        }
+        default:
+            program.add(Opcode::RET, {});
+            break;
+        }
+    }
+}
+
+// Lays out the program the simple way: emits every instruction in turn where it is, growing the
+// ones that don't fit, until a whole pass grows none. It gets to the same sizes as assemble().
+std::vector<Segment> assemble_naively(Program& unit, uint8_t* dest) {
+    std::span<InstrInstance> program = unit.instructions();
+    Layout layout(program, unit.origins());
+    for (bool grew = true; grew;) {
+        grew = false;
+        for (size_t i = 0; i < program.size(); ++i) {
+            size_t size = program[i].size();
+            while (!program[i].try_emit(layout.address(i), layout)) {}
+            if (program[i].size() != size) {
+                layout.grow(i, program[i].size() - size);
+                grew = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < program.size(); ++i)
+        program[i].write(dest + layout.address(i));
+    return layout.segments();
+}
+
+// Assembles generated programs of up to 400 instructions with assemble() and assemble_naively(),
+// and compares what they write. Then links a few sources that went wrong once.
+int check(size_t programs) {
+    size_t mismatches = 0;
+    for (size_t seed = 0; seed < programs; ++seed) {
+        size_t size = 1 + seed % 400;
+        Program program, naive;
+        generate(program, size, seed);
+        generate(naive, size, seed);
+        std::vector<uint8_t> memory(65536), expected(65536);
+        std::vector<Segment> segments, expected_segments;
+        try {
+            segments = assemble(program, memory.data());
+            expected_segments = assemble_naively(naive, expected.data());
+        } catch (const std::exception& e) {
+            std::cout << "Program " << seed << ": " << e.what() << "\n";
+            ++mismatches;
+            continue;
+        }
+        bool same = memory == expected && segments.size() == expected_segments.size();
+        for (size_t i = 0; same && i < segments.size(); ++i)
+            same = segments[i].address == expected_segments[i].address && segments[i].size == expected_segments[i].size;
+        if (!same) {
+            std::cout << "Mismatch: program " << seed << "\n";
+            ++mismatches;
+        }
+    }
+
+    // A label at the end of a section, before a .move in its file or at the start of the next one,
+    // stays there: ldi t0 end is xor t0 r0 r0 7.
+    const std::vector<std::vector<std::string_view>> section_ends = {
+        { "main:\nldi t0 end\nhlt\nend:\n.move 0x100\n.word 5\n" },
+        { "main:\nldi t0 end\nhlt\nend:\n", ".move 0x100\n.word 5\n" },
+    };
+    for (const auto& sources : section_ends) {
+        std::vector<ObjectFile> objects;
+        for (std::string_view source : sources)
+            objects.emplace_back(source, "check " + std::to_string(objects.size()));
+        LinkedImage image = link(objects);
+        if (image.memory[2] != 7 || image.memory[3] != 0) {
+            std::cout << "Mismatch: label at the end of a section, in " << sources.size() << " files\n";
+            ++mismatches;
+        }
+    }
+    std::cout << programs << " programs, " << mismatches << " mismatches\n";
+    return mismatches ? 1 : 0;
+}
+
+void usage() {
+    std::cout << "Usage: ./bench [OPTIONS]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --size N   Instructions in each program (default 12000, about 40 KB).\n";
+    std::cout << "  --runs N   Programs to build and assemble (default 20).\n";
+    std::cout << "  --check N  Compare assembling N programs with a naive fixpoint, and exit.\n";
+}
+
+int main(int argc, char** argv) {
+    size_t size = 12000;
+    size_t runs = 20;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            size = std::stoul(argv[++i]);
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--check" && i + 1 < argc) {
+            return check(std::stoul(argv[++i]));
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    std::vector<uint8_t> memory(65536);
+    std::vector<double> build_times, assemble_times;
+    size_t bytes = 0, used = 0, reserved = 0, blocks = 0, allocations = 0, allocated = 0;
+    for (size_t run = 0; run <= runs; ++run) { // Run 0 warms up.
+        size_t allocations_before = heap_allocations, bytes_before = heap_bytes;
+        auto start = std::chrono::steady_clock::now();
+        Program program;
+        try {
+            generate(program, size, run);
+            auto built = std::chrono::steady_clock::now();
+            assemble(program, memory.data());
+            auto end = std::chrono::steady_clock::now();
+            if (!run)
+                continue;
+            build_times.push_back(std::chrono::duration<double, std::milli>(built - start).count());
+            assemble_times.push_back(std::chrono::duration<double, std::milli>(end - built).count());
+        } catch (const std::exception& e) {
+            std::cout << "Run " << run << ": " << e.what() << "\n";
+            return 1;
+        }
+        size_t end = 0;
+        for (const InstrInstance& instr : program.instructions())
+            end += instr.size();
+        bytes += end;
+        used += program.arena().used();
+        reserved += program.arena().reserved();
+        blocks += program.arena().allocations();
+        allocations += heap_allocations - allocations_before;
+        allocated += heap_bytes - bytes_before;
+    }
+
+    std::sort(build_times.begin(), build_times.end());
+    std::sort(assemble_times.begin(), assemble_times.end());
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << size << " instructions, " << bytes / runs << " bytes of code, " << runs << " runs\n";
+    std::cout << std::left << std::setw(24) << "build (median ms)" << build_times[runs / 2] << "\n";
+    std::cout << std::setw(24) << "assemble (median ms)" << assemble_times[runs / 2] << "\n";
+    std::cout << std::setw(24) << "instructions/s" << std::setprecision(0) << size / assemble_times[runs / 2] * 1000 << "\n";
+    std::cout << std::setw(24) << "arena used (bytes)" << used / runs << "\n";
+    std::cout << std::setw(24) << "arena reserved (bytes)" << reserved / runs << "\n";
+    std::cout << std::setw(24) << "arena blocks" << blocks / runs << "\n";
+    std::cout << std::setw(24) << "heap allocations" << allocations / runs << " (" << allocated / runs << " bytes)\n";
+    return 0;
+}
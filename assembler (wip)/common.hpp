@@ -1,13 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <concepts>
+#include <cstddef>
 #include <cstdint>
-#include <string>
-#include <unordered_map>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 
 template <typename E>
 requires std::is_enum_v<E>
-auto operator*(const E& e) {
+constexpr auto operator*(const E& e) {
     return std::underlying_type_t<E>(e);
 }
 
@@ -53,6 +59,9 @@ enum class Opcode : uint8_t
     LNOP, // pseudo-instruction
     LDI, // pseudo-instruction
     MOV, // pseudo-instruction
+    HLT, // pseudo-instruction
+    WORD, // .word, data
+    BYTE, // .byte and .str, data
 };
 
 enum class Register : uint8_t
@@ -75,5 +84,181 @@ enum class Register : uint8_t
     S3
 };
 
-const extern std::unordered_map<std::string, Opcode> OPCODES;
-const extern std::unordered_map<std::string, Register> REGISTERS;
\ No newline at end of file
+// Where the CPU reads the address it starts from.
+inline constexpr uint16_t RESET_VECTOR = 0xFFFD;
+
+// Hash of a key of a PerfectMap, with the seed that makes it perfect.
+constexpr uint64_t perfect_hash(std::string_view key, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for (char c : key)
+        hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    return hash ^ (hash >> 32);
+}
+
+constexpr uint64_t perfect_hash(uint32_t key, uint64_t seed) {
+    uint64_t hash = (key ^ seed) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+// A map fixed at compile time. The seed of its hash is searched for when it's built, until every
+// key gets a slot of its own, so a lookup hashes the key once and compares it with one entry.
+template <typename K, typename T, size_t N>
+class PerfectMap {
+private:
+    static constexpr size_t _SLOTS = std::bit_ceil(std::max<size_t>(4 * N, 1));
+
+    std::array<K, _SLOTS> _keys{};
+    std::array<T, _SLOTS> _values{};
+    std::array<bool, _SLOTS> _used{};
+    uint64_t _seed = 0;
+    size_t _longest = 0; // Key, for string keys.
+
+    constexpr size_t _slot(K key) const {
+        return perfect_hash(key, _seed) & (_SLOTS - 1);
+    }
+
+    // False if two keys get the same slot with the current seed.
+    constexpr bool _place(const std::array<std::pair<K, T>, N>& entries) {
+        _used = {};
+        for (const auto& [key, value] : entries) {
+            size_t slot = _slot(key);
+            if (_used[slot])
+                return false;
+            _used[slot] = true;
+            _keys[slot] = key;
+            _values[slot] = value;
+        }
+        return true;
+    }
+
+public:
+    constexpr PerfectMap(const std::array<std::pair<K, T>, N>& entries) {
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < i; ++j) {
+                if (entries[i].first == entries[j].first)
+                    throw std::logic_error("Duplicate key in PerfectMap.");
+            }
+        }
+        while (!_place(entries))
+            ++_seed;
+        if constexpr (std::is_same_v<K, std::string_view>) {
+            for (const auto& [key, value] : entries)
+                _longest = std::max(_longest, key.size());
+        }
+    }
+
+    // nullptr if key isn't in the map.
+    constexpr const T* find(K key) const {
+        if constexpr (std::is_same_v<K, std::string_view>) {
+            if (key.size() > _longest) // Labels, mostly, which needn't be hashed.
+                return nullptr;
+        }
+        size_t slot = _slot(key);
+        return _used[slot] && _keys[slot] == key ? &_values[slot] : nullptr;
+    }
+
+    constexpr bool contains(K key) const {
+        return find(key) != nullptr;
+    }
+};
+
+template <typename K, typename T, size_t N>
+constexpr PerfectMap<K, T, N> perfect_map(const std::pair<K, T> (&entries)[N]) {
+    return PerfectMap<K, T, N>(std::to_array(entries));
+}
+
+// The names of the opcodes, the first one of each being how messages write it.
+inline constexpr std::pair<std::string_view, Opcode> OPCODE_NAMES[] = {
+    { "add", Opcode::ADD },
+    { "sub", Opcode::SUB },
+    { "lsl", Opcode::LSL },
+    { "lsr", Opcode::LSR },
+    { "asr", Opcode::ASR },
+    { "xor", Opcode::XOR },
+    { "or", Opcode::OR },
+    { "and", Opcode::AND },
+    { "bra", Opcode::BRA },
+    { "jmp", Opcode::JMP },
+    { "mem", Opcode::MEM },
+
+    { "jsr", Opcode::JSR },
+    { "call", Opcode::CALL },
+    { "ret", Opcode::RET },
+    { "beq", Opcode::BEQ },
+    { "bne", Opcode::BNE },
+    { "blt", Opcode::BLT },
+    { "ble", Opcode::BLE },
+    { "bgt", Opcode::BGT },
+    { "bge", Opcode::BGE },
+    { "bltu", Opcode::BLTU },
+    { "bleu", Opcode::BLEU },
+    { "bgtu", Opcode::BGTU },
+    { "bgeu", Opcode::BGEU },
+    { "ldw", Opcode::LDW },
+    { "ldb", Opcode::LDB },
+    { "lbu", Opcode::LBU },
+    { "stw", Opcode::STW },
+    { "stb", Opcode::STB },
+    { "lw", Opcode::LDW }, // The names the programs use.
+    { "lb", Opcode::LDB },
+    { "sw", Opcode::STW },
+    { "sb", Opcode::STB },
+    { "ldi", Opcode::LDI },
+    { "mov", Opcode::MOV },
+    { "snop", Opcode::SNOP },
+    { "nop", Opcode::NOP },
+    { "lnop", Opcode::LNOP },
+    { "hlt", Opcode::HLT },
+};
+
+inline constexpr auto OPCODES = perfect_map(OPCODE_NAMES);
+
+// The name of each opcode, by its value (empty for the reserved ones).
+inline constexpr auto MNEMONICS = [] {
+    std::array<std::string_view, *Opcode::BYTE + 1> mnemonics{};
+    for (size_t i = std::size(OPCODE_NAMES); i-- > 0;)
+        mnemonics[*OPCODE_NAMES[i].second] = OPCODE_NAMES[i].first;
+    mnemonics[*Opcode::WORD] = ".word";
+    mnemonics[*Opcode::BYTE] = ".byte";
+    return mnemonics;
+}();
+
+inline constexpr auto REGISTERS = perfect_map<std::string_view, Register>({
+    { "r0", Register::R0 },
+    { "r1", Register::RA },
+    { "r2", Register::SP },
+    { "r3", Register::A0 },
+    { "r4", Register::A1 },
+    { "r5", Register::A2 },
+    { "r6", Register::A3 },
+    { "r7", Register::T0 },
+    { "r8", Register::T1 },
+    { "r9", Register::T2 },
+    { "r10", Register::T3 },
+    { "r11", Register::T4 },
+    { "r12", Register::S0 },
+    { "r13", Register::S1 },
+    { "r14", Register::S2 },
+    { "r15", Register::S3 },
+
+    { "zero", Register::R0 },
+    { "ra", Register::RA },
+    { "sp", Register::SP },
+    { "a0", Register::A0 },
+    { "a1", Register::A1 },
+    { "a2", Register::A2 },
+    { "a3", Register::A3 },
+    { "t0", Register::T0 },
+    { "t1", Register::T1 },
+    { "t2", Register::T2 },
+    { "t3", Register::T3 },
+    { "t4", Register::T4 },
+    { "s0", Register::S0 },
+    { "s1", Register::S1 },
+    { "s2", Register::S2 },
+    { "s3", Register::S3 },
+});
+
+// Parses a number as written in the source: decimal, 0x hexadecimal or 0b binary, after an
+// optional '-'. False if str isn't one or it doesn't fit in 16 bits.
+bool parse_number(std::string_view str, bool& negative, uint16_t& value);
\ No newline at end of file
@@ -1,41 +1,58 @@
 #pragma once
 
 #include "argument.hpp"
-#include <functional>
-#include <typeindex>
-#include <typeinfo>
-#include <memory>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <span>
 #include <string>
-#include <unordered_map>
-#include <vector>
+#include <utility>
 
-// Hashable and equality comparable class that defines the opcode and arguments
-// of an instruction.
+// Value type that defines the opcode and arguments of an instruction. It packs into a key(): the
+// opcode, then two bits for each argument (its kind + 1, 0 past the last).
 class Signature {
 public:
-    const Opcode opcode;
-    const std::vector<std::type_index> arguments;
+    static constexpr size_t MAX_ARGS = 4;
 
-    bool operator==(const Signature& other) const;
-    std::string to_string() const;
-};
+    Opcode opcode = Opcode::ADD;
+    uint8_t count = 0;
+    std::array<ArgKind, MAX_ARGS> arguments{};
 
-template <>
-class std::hash<Signature> {
-private:
-    [[no_unique_address]] std::hash<Opcode> _opcode_hasher;
-    [[no_unique_address]] std::hash<std::type_index> _type_hasher;
+    constexpr Signature() = default;
+    constexpr Signature(Opcode opcode, std::initializer_list<ArgKind> arguments) : opcode(opcode), count(arguments.size()) {
+        if (arguments.size() > MAX_ARGS)
+            throw std::logic_error("Too many arguments in a signature.");
+        std::copy(arguments.begin(), arguments.end(), this->arguments.begin());
+    }
 
-public:
-    size_t operator()(const Signature& sig) const;
+    // Throws if there are too many arguments.
+    static Signature of(Opcode opcode, std::span<const Argument> args);
+
+    constexpr uint32_t key() const {
+        uint32_t key = *opcode;
+        for (size_t i = 0; i < count; ++i)
+            key |= (*arguments[i] + 1u) << (8 + 2 * i);
+        return key;
+    }
+
+    bool operator==(const Signature& other) const = default;
+    std::string to_string() const;
 };
 
+class Layout;
+
+// Writes an instruction at address to to. Returns false if it doesn't fit in the variant (a
+// label too far, an immediate too large); the addresses of labels come from layout.
 class Variant {
 public:
-    using Emitter = bool(*)(Opcode opcode, const std::vector<ArgPtr>& args, uint8_t* to);
+    using Function = bool(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to);
+    using Emitter = Function*;
 
-    const size_t size;
-    const Emitter emitter;
+    size_t size;
+    Emitter emitter;
 };
 
 // Definition of an instruction. A definition may have multiple variants of the
@@ -47,9 +64,167 @@ public:
 //   - All variants must be sorted by size (non-descending)
 class InstructionDef {
 public:
-    const Signature signature;
-    const std::vector<Variant> variants;
-    const bool independent;
+    Signature signature;
+    std::span<const Variant> variants;
+    bool independent = false;
 };
 
-const extern std::unordered_map<Signature, InstructionDef> INSTRUCTIONS;
\ No newline at end of file
+// The emitters of the variants below (src/instruction.cpp). Each takes the forms of all the
+// instructions it's used for, and fails on what it can't encode in its size.
+Variant::Function emit_alu_short; // op rd rl rr
+Variant::Function emit_alu_byte; // op rd rl r0 [byte]
+Variant::Function emit_alu_word; // op rd rl r0 [word]
+Variant::Function emit_negated_byte; // sub as add rd rl r0 [-byte]
+Variant::Function emit_negated_word; // add as sub rd rl r0 [-word]
+Variant::Function emit_branch; // bra flags rl rr [byte], and hlt
+Variant::Function emit_branch_far; // bra !flags rl rr 4, jmp r0 r0 r0 [word]
+Variant::Function emit_jump_register; // jmp rd r0 rr
+Variant::Function emit_jump_offset; // jmp rd rl rr [byte]
+Variant::Function emit_jump_word; // jmp rd r0 r0 [word]
+Variant::Function emit_memory; // mem rd flags rr [byte]
+Variant::Function emit_load_zero; // xor rd rd rd
+Variant::Function emit_load_byte; // add rd r0 r0 [byte]
+Variant::Function emit_load_word; // xor rd r0 r0 [word]
+Variant::Function emit_move; // or rd rs rs
+Variant::Function emit_nop;
+Variant::Function emit_data; // The value itself
+
+inline constexpr Variant BYTE_ALU[] = { { 2, emit_alu_short }, { 3, emit_alu_byte } };
+inline constexpr Variant WORD_ALU[] = { { 2, emit_alu_short }, { 4, emit_alu_word } };
+inline constexpr Variant BYTE_IMMEDIATE[] = { { 3, emit_alu_byte } };
+inline constexpr Variant WORD_IMMEDIATE[] = { { 4, emit_alu_word } };
+inline constexpr Variant ADD_IMMEDIATE[] = { { 3, emit_alu_byte }, { 4, emit_negated_word } };
+inline constexpr Variant SUB_IMMEDIATE[] = { { 3, emit_negated_byte }, { 4, emit_alu_word } };
+inline constexpr Variant BRANCH[] = { { 3, emit_branch } };
+inline constexpr Variant BRANCH_ALWAYS[] = { { 3, emit_branch }, { 4, emit_jump_word } };
+inline constexpr Variant BRANCH_IF[] = { { 3, emit_branch }, { 7, emit_branch_far } };
+inline constexpr Variant JUMP_REGISTER[] = { { 2, emit_jump_register } };
+inline constexpr Variant JUMP_IMMEDIATE[] = { { 3, emit_jump_offset }, { 4, emit_jump_word } };
+inline constexpr Variant JUMP_WORD[] = { { 4, emit_jump_word } };
+inline constexpr Variant MEMORY[] = { { 3, emit_memory } };
+inline constexpr Variant LOAD_IMMEDIATE[] = { { 2, emit_load_zero }, { 3, emit_load_byte }, { 4, emit_load_word } };
+inline constexpr Variant LOAD_LABEL[] = { { 4, emit_load_word } };
+inline constexpr Variant MOVE[] = { { 2, emit_move } };
+inline constexpr Variant SHORT_NOP[] = { { 2, emit_nop } };
+inline constexpr Variant PLAIN_NOP[] = { { 3, emit_nop } };
+inline constexpr Variant LONG_NOP[] = { { 4, emit_nop } };
+inline constexpr Variant DATA_WORD[] = { { 2, emit_data } };
+inline constexpr Variant DATA_BYTE[] = { { 1, emit_data } };
+
+// An entry of INSTRUCTIONS. Instructions without labels don't depend on where they are.
+constexpr std::pair<uint32_t, InstructionDef> instruction_def(Opcode opcode, std::initializer_list<ArgKind> arguments, std::span<const Variant> variants) {
+    Signature signature(opcode, arguments);
+    bool independent = std::find(arguments.begin(), arguments.end(), ArgKind::LABEL) == arguments.end();
+    return { signature.key(), InstructionDef{ signature, variants, independent } };
+}
+
+// Keyed by Signature::key(), which is also a constant to switch on. The hash and the slots are
+// worked out at compile time, so finding the definition of an instruction is a multiplication and
+// a comparison. "op rd imm" is short for "op rd rd imm"; the pseudo-instructions that branch or
+// load a label grow into longer sequences when it's out of reach.
+inline constexpr auto INSTRUCTIONS = [] {
+    using enum Opcode;
+    using enum ArgKind;
+    return perfect_map<uint32_t, InstructionDef>({
+        instruction_def(ADD, { REGISTER, REGISTER, REGISTER }, BYTE_ALU),
+        instruction_def(LSL, { REGISTER, REGISTER, REGISTER }, BYTE_ALU),
+        instruction_def(LSR, { REGISTER, REGISTER, REGISTER }, BYTE_ALU),
+        instruction_def(ASR, { REGISTER, REGISTER, REGISTER }, BYTE_ALU),
+        instruction_def(SUB, { REGISTER, REGISTER, REGISTER }, WORD_ALU),
+        instruction_def(XOR, { REGISTER, REGISTER, REGISTER }, WORD_ALU),
+        instruction_def(OR, { REGISTER, REGISTER, REGISTER }, WORD_ALU),
+        instruction_def(AND, { REGISTER, REGISTER, REGISTER }, WORD_ALU),
+
+        instruction_def(ADD, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(LSL, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(LSR, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(ASR, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(SUB, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(XOR, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(OR, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(AND, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+
+        instruction_def(ADD, { REGISTER, REGISTER, IMMEDIATE }, ADD_IMMEDIATE),
+        instruction_def(LSL, { REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(LSR, { REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(ASR, { REGISTER, REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(SUB, { REGISTER, REGISTER, IMMEDIATE }, SUB_IMMEDIATE),
+        instruction_def(XOR, { REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(OR, { REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(AND, { REGISTER, REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+
+        instruction_def(ADD, { REGISTER, IMMEDIATE }, ADD_IMMEDIATE),
+        instruction_def(LSL, { REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(LSR, { REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(ASR, { REGISTER, IMMEDIATE }, BYTE_IMMEDIATE),
+        instruction_def(SUB, { REGISTER, IMMEDIATE }, SUB_IMMEDIATE),
+        instruction_def(XOR, { REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(OR, { REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+        instruction_def(AND, { REGISTER, IMMEDIATE }, WORD_IMMEDIATE),
+
+        instruction_def(SUB, { REGISTER, REGISTER, LABEL }, WORD_IMMEDIATE),
+        instruction_def(XOR, { REGISTER, REGISTER, LABEL }, WORD_IMMEDIATE),
+        instruction_def(OR, { REGISTER, REGISTER, LABEL }, WORD_IMMEDIATE),
+        instruction_def(AND, { REGISTER, REGISTER, LABEL }, WORD_IMMEDIATE),
+
+        instruction_def(BRA, { IMMEDIATE, REGISTER, REGISTER, IMMEDIATE }, BRANCH),
+        instruction_def(BRA, { IMMEDIATE, REGISTER, REGISTER, LABEL }, BRANCH),
+        instruction_def(BRA, { LABEL }, BRANCH_ALWAYS),
+        instruction_def(BEQ, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BEQ, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BNE, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BNE, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BLT, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BLT, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BLE, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BLE, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BGT, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BGT, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BGE, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BGE, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BLTU, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BLTU, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BLEU, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BLEU, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BGTU, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BGTU, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+        instruction_def(BGEU, { REGISTER, REGISTER, LABEL }, BRANCH_IF),
+        instruction_def(BGEU, { REGISTER, IMMEDIATE, LABEL }, BRANCH_IF),
+
+        instruction_def(JMP, { REGISTER }, JUMP_REGISTER),
+        instruction_def(JMP, { REGISTER, REGISTER, REGISTER }, JUMP_REGISTER),
+        instruction_def(JMP, { REGISTER, REGISTER, REGISTER, IMMEDIATE }, JUMP_IMMEDIATE),
+        instruction_def(JMP, { LABEL }, JUMP_WORD),
+        instruction_def(JMP, { REGISTER, LABEL }, JUMP_WORD),
+        instruction_def(JMP, { REGISTER, REGISTER, REGISTER, LABEL }, JUMP_WORD),
+        instruction_def(JSR, { REGISTER }, JUMP_REGISTER),
+        instruction_def(JSR, { LABEL }, JUMP_WORD),
+        instruction_def(CALL, { REGISTER }, JUMP_REGISTER),
+        instruction_def(CALL, { LABEL }, JUMP_WORD),
+        instruction_def(RET, {}, JUMP_REGISTER),
+
+        instruction_def(MEM, { REGISTER, IMMEDIATE, REGISTER, IMMEDIATE }, MEMORY),
+        instruction_def(LDW, { REGISTER, REGISTER }, MEMORY),
+        instruction_def(LDB, { REGISTER, REGISTER }, MEMORY),
+        instruction_def(LBU, { REGISTER, REGISTER }, MEMORY),
+        instruction_def(STW, { REGISTER, REGISTER }, MEMORY),
+        instruction_def(STB, { REGISTER, REGISTER }, MEMORY),
+        instruction_def(LDW, { REGISTER, REGISTER, IMMEDIATE }, MEMORY),
+        instruction_def(LDB, { REGISTER, REGISTER, IMMEDIATE }, MEMORY),
+        instruction_def(LBU, { REGISTER, REGISTER, IMMEDIATE }, MEMORY),
+        instruction_def(STW, { REGISTER, REGISTER, IMMEDIATE }, MEMORY),
+        instruction_def(STB, { REGISTER, REGISTER, IMMEDIATE }, MEMORY),
+
+        instruction_def(LDI, { REGISTER, IMMEDIATE }, LOAD_IMMEDIATE),
+        instruction_def(LDI, { REGISTER, LABEL }, LOAD_LABEL),
+        instruction_def(MOV, { REGISTER, REGISTER }, MOVE),
+        instruction_def(SNOP, {}, SHORT_NOP),
+        instruction_def(NOP, {}, PLAIN_NOP),
+        instruction_def(LNOP, {}, LONG_NOP),
+        instruction_def(HLT, {}, BRANCH),
+
+        instruction_def(WORD, { IMMEDIATE }, DATA_WORD),
+        instruction_def(WORD, { LABEL }, DATA_WORD),
+        instruction_def(BYTE, { IMMEDIATE }, DATA_BYTE),
+    });
+}();
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "object.hpp"
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// All of memory once a program is linked, and the parts of it the program is in.
+class LinkedImage {
+public:
+    std::vector<uint8_t> memory;
+    std::vector<Segment> segments;
+
+    // As the simulator loads it: a sparse image ("SIM1" and the segments), or all of memory.
+    void write(std::ostream& out, bool raw) const;
+};
+
+// Links objects, in their order, into one program: the symbols each uses are found in the others
+// (a symbol defined by more than one can't be used outside them), and the whole program is
+// relaxed at once, so that a branch or a call to another file gets the shortest variant that
+// reaches it. If nothing is at RESET_VECTOR, the address of entry goes there (when it's defined).
+// Throws std::runtime_error.
+LinkedImage link(std::span<const ObjectFile> objects, std::string_view entry = "main");
\ No newline at end of file
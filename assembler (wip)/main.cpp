@@ -0,0 +1,83 @@
+// Assembles source files into a program image for the simulator.
+//     g++ -o assembler main.cpp src/*.cpp -std=c++23 -O2 -Wall
+#include "linker.hpp"
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+void usage() {
+    std::cout << "Usage: ./assembler [OPTIONS] FILE...\n";
+    std::cout << "Assembles the files (in parallel) and links them in their order.\n";
+    std::cout << "Options:\n";
+    std::cout << "  --output FILE   Write the image to FILE (default program.bin).\n";
+    std::cout << "  --raw           Write all of memory, rather than a sparse image.\n";
+    std::cout << "  --entry LABEL   Where the reset vector points, if nothing is written there\n"
+                 "                  (default main).\n";
+    std::cout << "  --threads N     Assemble on N threads (default all cores).\n";
+    std::cout << "  --time          Print how long assembling and linking took.\n";
+}
+
+int main(int argc, char** argv) {
+    std::string output = "program.bin";
+    std::string entry = "main";
+    bool raw = false;
+    bool time = false;
+    unsigned threads = 0;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--entry" && i + 1 < argc) {
+            entry = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            std::string_view count = argv[++i];
+            auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), threads);
+            if (error != std::errc() || end != count.data() + count.size()) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--raw") {
+            raw = true;
+        } else if (arg == "--time") {
+            time = true;
+        } else if (!arg.starts_with("--")) {
+            paths.push_back(arg);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (paths.empty()) {
+        usage();
+        return 1;
+    }
+
+    try {
+        ThreadPool pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<ObjectFile> objects = assemble_files(paths, pool);
+        auto assembled = std::chrono::steady_clock::now();
+        LinkedImage image = link(objects, entry);
+        auto linked = std::chrono::steady_clock::now();
+        if (time) {
+            std::cout << "Assembled " << paths.size() << " files on " << pool.size() << " threads in "
+                      << std::chrono::duration<double, std::milli>(assembled - start).count() << " ms, linked in "
+                      << std::chrono::duration<double, std::milli>(linked - assembled).count() << " ms.\n";
+        }
+        std::ofstream file(output, std::ios::binary);
+        image.write(file, raw);
+        if (!file) {
+            std::cout << "Can't write " << output << ".\n";
+            return 2;
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "assembler.hpp"
+#include "thread_pool.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A label of an object file: one it defines, on the instruction at target in section, or one it
+// only uses.
+class Symbol {
+public:
+    std::string name;
+    bool defined;
+    uint16_t target;
+    uint16_t section;
+};
+
+// An argument of an instruction that is a label the file doesn't define, for the linker to set.
+class Relocation {
+public:
+    uint32_t instruction;
+    uint8_t argument;
+    uint32_t symbol; // In symbols.
+};
+
+// A source file assembled as far as it can be on its own. Its sections are the runs of the
+// program between origins (.move); the first one, before any, goes right after whatever is linked
+// before it. The labels it uses and defines point at their instruction in it, and the linker moves
+// them with the file. The others are relocations. Every label it defines is a symbol, which the
+// other files can use.
+class ObjectFile {
+public:
+    std::string name;
+    Program program;
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations; // In the order of their instructions.
+    std::vector<uint32_t> lines; // Of each instruction, for the errors of the linker.
+
+    // Throws std::runtime_error, with name and the line, on errors in source.
+    ObjectFile(std::string_view source, std::string name);
+};
+
+// Assembles the files at paths in parallel on pool, into objects in the same order. Throws the
+// error of the first one that has one.
+std::vector<ObjectFile> assemble_files(const std::vector<std::string>& paths, ThreadPool& pool);
\ No newline at end of file
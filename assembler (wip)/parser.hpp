@@ -1 +1,129 @@
-#pragma once
\ No newline at end of file
+#pragma once
+
+#include "common.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A source file mapped into memory (read into a string where there is no mmap), so that the
+// tokens of the lexer can be slices of it. It has to outlive them.
+class SourceFile {
+private:
+    const char* _data;
+    size_t _size;
+    std::string _copy;
+
+public:
+    explicit SourceFile(const std::string& path);
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile();
+
+    std::string_view text() const;
+};
+
+enum class TokenKind : uint8_t
+{
+    IDENTIFIER, // Mnemonic, register, alias or label
+    LABEL,      // Identifier followed by ':', without it
+    DIRECTIVE,  // '.' and an identifier, with the '.'
+    NUMBER,     // As parse_number() takes it, not checked
+    STRING,     // Between double quotes, with them, escapes as written
+    NEWLINE,
+    END,
+};
+
+class Token {
+public:
+    TokenKind kind;
+    std::string_view text;
+    uint32_t line;
+};
+
+// Splits source text into tokens. Comments go from '#' to the end of the line.
+class Lexer {
+private:
+    const char* _current;
+    const char* _end;
+    uint32_t _line;
+
+public:
+    explicit Lexer(std::string_view source);
+
+    Token next();
+};
+
+enum class OperandKind : uint8_t
+{
+    REGISTER,
+    NUMBER,
+    SYMBOL, // Label, which may be defined later
+    STRING,
+};
+
+class Operand {
+public:
+    OperandKind kind;
+    std::string_view text; // Without the quotes of a string, escapes as written
+    Register reg;
+    bool negative;
+    uint16_t value;
+};
+
+enum class StatementKind : uint8_t
+{
+    LABEL,
+    INSTRUCTION,
+    MOVE, // .move ADDRESS
+    WORD, // .word VALUE [COUNT]
+    BYTE, // .byte VALUE [COUNT]
+    STR,  // .str STRING
+};
+
+// One statement of the source, with its operands in place. name is the label or mnemonic.
+// Aliases (.def) are replaced by their values and don't make statements of their own.
+class Statement {
+public:
+    static constexpr size_t MAX_OPERANDS = 4;
+
+    StatementKind kind;
+    std::string_view name;
+    Opcode opcode; // Of an instruction
+    uint8_t count;
+    std::array<Operand, MAX_OPERANDS> operands;
+    uint32_t line;
+};
+
+// For the aliases: FNV-1a, inline, as names are a few characters long.
+struct StringHash {
+    size_t operator()(std::string_view str) const {
+        size_t hash = 14695981039346656037ull;
+        for (char c : str)
+            hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+        return hash;
+    }
+};
+
+// Parses source text one statement at a time as the lexer reads it. The text has to outlive the
+// statements, which point into it.
+class Parser {
+private:
+    Lexer _lexer;
+    std::unordered_map<std::string_view, Operand, StringHash> _aliases;
+    uint64_t _alias_bits = 0; // The alias_bit() of every alias, so that most symbols skip _aliases.
+
+    Operand _operand(const Token& token);
+    void _operands(Statement& statement);
+    // Kept out of the flattened next(), as directives are rare and their messages are many.
+    [[gnu::noinline]] bool _directive(Statement& statement, const Token& token);
+
+public:
+    explicit Parser(std::string_view source);
+
+    // Parses the next statement into statement, false at the end of the source. Throws
+    // std::runtime_error on errors.
+    bool next(Statement& statement);
+};
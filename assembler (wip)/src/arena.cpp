@@ -0,0 +1,79 @@
+#include "../arena.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+Arena::Arena() :
+    _blocks(nullptr),
+    _current(nullptr),
+    _end(nullptr),
+    _next_size(FIRST_BLOCK),
+    _used(0),
+    _reserved(0),
+    _allocations(0)
+{}
+
+Arena::Arena(Arena&& other) noexcept :
+    _blocks(std::exchange(other._blocks, nullptr)),
+    _current(std::exchange(other._current, nullptr)),
+    _end(std::exchange(other._end, nullptr)),
+    _next_size(std::exchange(other._next_size, FIRST_BLOCK)),
+    _used(std::exchange(other._used, 0)),
+    _reserved(std::exchange(other._reserved, 0)),
+    _allocations(std::exchange(other._allocations, 0))
+{}
+
+Arena::~Arena() {
+    release();
+}
+
+void Arena::_grow(size_t size, size_t align) {
+    size_t header = (sizeof(Block) + align - 1) / align * align;
+    size_t block_size = std::max(_next_size, header + size);
+    Block* block = static_cast<Block*>(std::malloc(block_size));
+    if (!block)
+        throw std::bad_alloc();
+    block->next = _blocks;
+    block->size = block_size;
+    _blocks = block;
+    _current = reinterpret_cast<uint8_t*>(block) + sizeof(Block);
+    _end = reinterpret_cast<uint8_t*>(block) + block_size;
+    _next_size = std::min(_next_size * 2, MAX_BLOCK);
+    _reserved += block_size;
+    ++_allocations;
+}
+
+void* Arena::allocate(size_t size, size_t align) {
+    uintptr_t address = (reinterpret_cast<uintptr_t>(_current) + align - 1) & ~(uintptr_t)(align - 1);
+    if (!_current || address + size > reinterpret_cast<uintptr_t>(_end)) {
+        _grow(size, align);
+        address = (reinterpret_cast<uintptr_t>(_current) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    _current = reinterpret_cast<uint8_t*>(address + size);
+    _used += size;
+    return reinterpret_cast<void*>(address);
+}
+
+void Arena::release() {
+    while (_blocks) {
+        Block* next = _blocks->next;
+        std::free(_blocks);
+        _blocks = next;
+    }
+    _current = _end = nullptr;
+    _next_size = FIRST_BLOCK;
+    _used = _reserved = 0;
+}
+
+size_t Arena::used() const {
+    return _used;
+}
+
+size_t Arena::reserved() const {
+    return _reserved;
+}
+
+size_t Arena::allocations() const {
+    return _allocations;
+}
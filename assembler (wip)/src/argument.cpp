@@ -1,13 +1,9 @@
 #include "../argument.hpp"
 
-Argument::~Argument() {}
-
-std::type_index Argument::type() const {
-    return typeid(*this);
+std::optional<ImmediateArg> ImmediateArg::parse(std::string_view str) {
+    bool negative;
+    uint16_t value;
+    if (!parse_number(str, negative, value))
+        return std::nullopt;
+    return ImmediateArg{ negative, value };
 }
-
-RegisterArg::RegisterArg(Register value) : value(value) {}
-
-ImmediateArg::ImmediateArg(bool negative, uint16_t value) : negative(negative), value(value) {}
-
-LabelArg::LabelArg(InstrInstance& target) : target(target) {}
\ No newline at end of file
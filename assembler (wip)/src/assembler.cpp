@@ -1,57 +1,85 @@
 #include "../assembler.hpp"
+#include <algorithm>
+#include <bit>
 #include <cstring>
 #include <format>
+#include <functional>
+#include <new>
+#include <numeric>
 #include <stdexcept>
+#include <utility>
 
-Buffer::Buffer() : _data() {
-    std::get<Local>(_data).fill(0);
+Buffer::Buffer(size_t capacity, Arena& arena) : _data(Local{}) {
+    if (capacity > sizeof(Local))
+        _data = arena.allocate<uint8_t>(capacity);
 }
 
-uint8_t* Buffer::get_size(size_t size) {
-    if (size > sizeof(Pointer)) {
-        _data = Pointer(new uint8_t[size]);
-        return std::get<Pointer>(_data).get();
-    }
+uint8_t* Buffer::get() {
+    if (std::holds_alternative<uint8_t*>(_data))
+        return std::get<uint8_t*>(_data);
     return std::get<Local>(_data).data();
 }
 
 const uint8_t* Buffer::get() const {
-    if (std::holds_alternative<Pointer>(_data))
-        return std::get<Pointer>(_data).get();
+    if (std::holds_alternative<uint8_t*>(_data))
+        return std::get<uint8_t*>(_data);
     return std::get<Local>(_data).data();
 }
 
 const InstructionDef& find_def(const Signature& signature) {
-    auto x = INSTRUCTIONS.find(signature);
-    if (x == INSTRUCTIONS.end()) {
+    const InstructionDef* def = INSTRUCTIONS.find(signature.key());
+    if (!def) {
         throw std::runtime_error(std::format("Unknown instruction {}.", signature.to_string()));
     }
-    return x->second;
+    return *def;
 }
 
-InstrInstance::InstrInstance(const Signature& signature, std::vector<ArgPtr>&& args) :
-    _args(std::forward<std::vector<ArgPtr>>(args)),
-    _def(find_def(signature)),
+InstrInstance::InstrInstance(Opcode opcode, std::span<const Argument> args, Arena& arena) :
+    _def(&find_def(Signature::of(opcode, args))),
+    _buffer(_def->variants.back().size, arena), // Variants are sorted by size.
+    _count(args.size()),
     _curr_variant(0),
     _success(false)
-{}
+{
+    std::copy(args.begin(), args.end(), _args.begin());
+}
 
-bool InstrInstance::try_emit() {
-    if (_def.independent && _success)
+bool InstrInstance::try_emit(size_t address, const Layout& layout) {
+    if (_def->independent && _success)
         return true;
-    const Variant& variant = _def.variants[_curr_variant];
-    _success = variant.emitter(_def.signature.opcode, _args, _buffer.get_size(variant.size));
+    const Variant& variant = _def->variants[_curr_variant];
+    _success = variant.emitter(_def->signature.opcode, args(), address, layout, _buffer.get());
     if (!_success) {
         ++_curr_variant;
-        if (_curr_variant == _def.variants.size()) {
-            throw std::runtime_error("Failed to emit instruction."); // TODO: list all errors by having emitter return them and storing them
+        if (_curr_variant == _def->variants.size()) {
+            throw std::runtime_error("The operands don't fit the instruction."); // TODO: list all errors by having emitter return them and storing them
         }
     }
     return _success;
 }
 
+std::span<const Argument> InstrInstance::args() const {
+    return std::span(_args.data(), _count);
+}
+
+void InstrInstance::set_target(size_t argument, uint16_t target, uint16_t section) {
+    std::get<LabelArg>(_args[argument]) = { target, section };
+}
+
+Opcode InstrInstance::opcode() const {
+    return _def->signature.opcode;
+}
+
+bool InstrInstance::independent() const {
+    return _def->independent;
+}
+
+bool InstrInstance::can_grow() const {
+    return _curr_variant + 1u < _def->variants.size();
+}
+
 size_t InstrInstance::size() const {
-    return _def.variants[_curr_variant].size;
+    return _def->variants[_curr_variant].size;
 }
 
 void InstrInstance::write(uint8_t* to) const {
@@ -60,22 +88,274 @@ void InstrInstance::write(uint8_t* to) const {
     std::memcpy(to, _buffer.get(), size());
 }
 
-void assemble(std::vector<InstrInstance>& program, uint8_t* dest) {
-    bool retry = true;
-    while (retry) {
-        retry = false;
-        for (size_t i = 0; i < program.size(); ++i) {
-            if (!program[i].try_emit()) {
-                retry = true;
+Layout::Layout(std::span<const InstrInstance> program, std::span<const Origin> origins) : _tree(program.size() + 1, 0) {
+    for (size_t i = 1; i < _tree.size(); ++i) {
+        _tree[i] += program[i - 1].size();
+        size_t parent = i + (i & -i);
+        if (parent < _tree.size())
+            _tree[parent] += _tree[i];
+    }
+    _origins.assign(origins.begin(), origins.end());
+    _origins.insert(_origins.begin(), { 0, 0 }); // Section 0.
+}
+
+void Layout::grow(size_t index, size_t by) {
+    for (size_t i = index + 1; i < _tree.size(); i += i & -i)
+        _tree[i] += by;
+}
+
+// The sum of the sizes of the instructions before index.
+size_t Layout::_offset(size_t index) const {
+    size_t offset = 0;
+    for (size_t i = index; i > 0; i -= i & -i)
+        offset += _tree[i];
+    return offset;
+}
+
+size_t Layout::address(size_t index) const {
+    auto origin = std::upper_bound(_origins.begin(), _origins.end(), index, [](size_t index, const Origin& origin) {
+        return index < origin.first;
+    }) - 1;
+    return origin->address + _offset(index) - _offset(origin->first);
+}
+
+size_t Layout::address(size_t index, size_t section) const {
+    return _origins[section].address + _offset(index) - _offset(_origins[section].first);
+}
+
+std::vector<Segment> Layout::segments() const {
+    std::vector<Segment> segments;
+    for (size_t i = 0; i < _origins.size(); ++i) {
+        size_t end = i + 1 < _origins.size() ? _origins[i + 1].first : _tree.size() - 1;
+        size_t size = _offset(end) - _offset(_origins[i].first);
+        if (size)
+            segments.push_back({ _origins[i].address, (uint32_t)size });
+    }
+    return segments;
+}
+
+static_assert(std::is_trivially_copyable_v<InstrInstance>, "Program moves instructions with memcpy.");
+static_assert(std::is_trivially_destructible_v<InstrInstance>, "Program never destroys instructions.");
+
+Program::Program(size_t capacity) : _instrs(nullptr), _size(0), _capacity(capacity) {
+    if (_capacity)
+        _instrs = _arena.allocate<InstrInstance>(_capacity);
+}
+
+Program::Program(Program&& other) noexcept :
+    _arena(std::move(other._arena)),
+    _instrs(std::exchange(other._instrs, nullptr)),
+    _size(std::exchange(other._size, 0)),
+    _capacity(std::exchange(other._capacity, 0)),
+    _origins(std::move(other._origins))
+{}
+
+size_t Program::add(Opcode opcode, std::span<const Argument> args) {
+    if (_size == UINT16_MAX) // Then a label at the end is on 65535.
+        throw std::runtime_error("Program too large :----(");
+    if (_size == _capacity) {
+        _capacity = std::max<size_t>(2 * _capacity, 64);
+        InstrInstance* instrs = _arena.allocate<InstrInstance>(_capacity);
+        if (_size)
+            std::memcpy(instrs, _instrs, _size * sizeof(InstrInstance));
+        _instrs = instrs;
+    }
+    InstrInstance* instr = new (&_instrs[_size]) InstrInstance(opcode, args, _arena);
+    if (instr->independent()) { // Where it goes doesn't matter, and try_emit() keeps it.
+        static const Layout no_labels({}, {});
+        while (!instr->try_emit(0, no_labels)) {}
+    }
+    return _size++;
+}
+
+void Program::move(uint16_t address) {
+    if (_origins.size() == UINT16_MAX)
+        throw std::runtime_error("Too many sections.");
+    _origins.push_back({ (uint32_t)_size, address });
+}
+
+size_t Program::size() const {
+    return _size;
+}
+
+uint16_t Program::section() const {
+    return _origins.size();
+}
+
+std::span<InstrInstance> Program::instructions() {
+    return std::span(_instrs, _size);
+}
+
+std::span<const InstrInstance> Program::instructions() const {
+    return std::span(_instrs, _size);
+}
+
+std::span<const Origin> Program::origins() const {
+    return _origins;
+}
+
+const Arena& Program::arena() const {
+    return _arena;
+}
+
+// The label uses of a program (instruction to target), by the instructions between the two. Those
+// are the ones that move the target relative to the user when they grow: only the uses whose span
+// holds the instruction that grew need to be emitted again. The spans are stored in the nodes of a
+// segment tree over the instructions (O(log n) nodes each, in one array), so finding the ones that
+// hold an instruction walks from its leaf to the root.
+class LabelUses {
+private:
+    size_t _leaves;
+    std::vector<uint32_t> _start; // Of the uses of each node in _users.
+    std::vector<uint32_t> _end; // Of those left.
+    std::vector<uint32_t> _users;
+
+public:
+    // A label can be on index program.size(), past the last instruction.
+    explicit LabelUses(std::span<const InstrInstance> program) : _leaves(std::bit_ceil(program.size() + 1)), _start(2 * _leaves + 1, 0) {
+        std::vector<std::pair<uint32_t, uint32_t>> nodes; // Node, user.
+        for (size_t user = 0; user < program.size(); ++user) {
+            for (const Argument& arg : program[user].args()) {
+                const LabelArg* label = std::get_if<LabelArg>(&arg);
+                if (!label)
+                    continue;
+                size_t target = label->target;
+                if (target > program.size())
+                    throw std::runtime_error("Label past the end of the program.");
+                size_t low = std::min(user, target) + _leaves, high = std::max(user, target) + _leaves;
+                for (; low < high; low >>= 1, high >>= 1) {
+                    if (low & 1)
+                        nodes.emplace_back(low++, user);
+                    if (high & 1)
+                        nodes.emplace_back(--high, user);
+                }
             }
         }
+        for (auto [node, user] : nodes)
+            ++_start[node + 1];
+        for (size_t node = 1; node < _start.size(); ++node)
+            _start[node] += _start[node - 1];
+        _users.resize(nodes.size());
+        _end.assign(_start.begin(), _start.end() - 1);
+        for (auto [node, user] : nodes)
+            _users[_end[node]++] = user;
     }
 
-    for (size_t i = 0, j = 0; i < program.size(); ++i) {
-        if (program[i].size() > 65536 - j) {
-            throw std::runtime_error("Program too large :----(");
+    // Calls f(user) for the uses whose span holds the instruction at index (a user appears once for
+    // each of its labels that does), and forgets the ones it returns false for.
+    template <typename F>
+    void for_each_across(size_t index, F f) {
+        for (size_t node = index + _leaves; node > 0; node >>= 1) {
+            for (size_t i = _start[node]; i < _end[node];) {
+                if (f(_users[i]))
+                    ++i;
+                else
+                    _users[i] = _users[--_end[node]];
+            }
         }
-        program[i].write(dest + j);
-        j += program[i].size();
     }
-}
\ No newline at end of file
+};
+
+AssemblyError::AssemblyError(size_t instruction, const std::string& message) :
+    std::runtime_error(message),
+    instruction(instruction)
+{}
+
+// Starts with the smallest variant of every instruction and grows the ones that don't fit until
+// they all do. When one grows, the instructions after it move, and the label uses across it are
+// the ones to emit again (those that can still grow: the others only need the final emission).
+// Those go through sweeps in address order, so that a use crossed by many instructions that grow
+// is emitted again once per sweep rather than once for each: the uses after the instruction that
+// grew are added to the current sweep, and the ones before it to the next. Values that hold
+// absolute addresses can change too, so once there is nothing left to sweep every instruction that
+// depends on addresses is emitted again where it ended up, and if any grows then it goes on.
+//
+// Every failed emission moves an instruction to a larger variant, and they have a finite number
+// of them (try_emit() throws past the last), so this ends after at most as many sweeps as there are
+// variants in the program.
+std::vector<Segment> assemble(Program& unit, uint8_t* dest) {
+    std::span<InstrInstance> program = unit.instructions();
+    Layout layout(program, unit.origins());
+    LabelUses uses(program);
+    std::vector<uint32_t> sweep(program.size()); // In increasing addresses.
+    std::vector<uint32_t> ahead; // A min-heap of those added to the current sweep.
+    std::vector<uint32_t> next;
+    std::vector<bool> queued(program.size(), true);
+    std::vector<bool> largest(program.size(), false); // At its largest variant, kept here to be looked up without reaching for it.
+    std::iota(sweep.begin(), sweep.end(), 0);
+
+    // Emits the instruction at index, true if it grew.
+    auto emit = [&](size_t index) {
+        size_t size = program[index].size();
+        try {
+            while (!program[index].try_emit(layout.address(index), layout)) {}
+        } catch (const std::runtime_error& e) {
+            throw AssemblyError(index, e.what());
+        }
+        largest[index] = !program[index].can_grow();
+        if (program[index].size() == size)
+            return false;
+        layout.grow(index, program[index].size() - size);
+        uses.for_each_across(index, [&](size_t user) {
+            if (largest[user])
+                return false;
+            if (!queued[user]) {
+                queued[user] = true;
+                if (user > index) {
+                    ahead.push_back(user);
+                    std::push_heap(ahead.begin(), ahead.end(), std::greater<>());
+                } else {
+                    next.push_back(user);
+                }
+            }
+            return true;
+        });
+        return true;
+    };
+
+    bool grew = true;
+    while (grew) {
+        while (!sweep.empty()) {
+            for (size_t i = 0; i < sweep.size() || !ahead.empty();) {
+                size_t index;
+                if (!ahead.empty() && (i == sweep.size() || ahead.front() < sweep[i])) {
+                    std::pop_heap(ahead.begin(), ahead.end(), std::greater<>());
+                    index = ahead.back();
+                    ahead.pop_back();
+                } else {
+                    index = sweep[i++];
+                }
+                queued[index] = false;
+                emit(index);
+            }
+            std::sort(next.begin(), next.end());
+            std::swap(sweep, next);
+            next.clear();
+        }
+        grew = false;
+        for (size_t i = 0; i < program.size(); ++i) {
+            if (!program[i].independent() && emit(i))
+                grew = true;
+        }
+        // The uses the final emission grew across.
+        next.insert(next.end(), ahead.begin(), ahead.end());
+        ahead.clear();
+        std::sort(next.begin(), next.end());
+        std::swap(sweep, next);
+        next.clear();
+    }
+
+    std::vector<bool> written(65536, false);
+    for (size_t i = 0; i < program.size(); ++i) {
+        size_t address = layout.address(i), end = address + program[i].size();
+        if (end > 65536)
+            throw AssemblyError(i, "Program too large :----(");
+        for (size_t byte = address; byte < end; ++byte) {
+            if (written[byte])
+                throw AssemblyError(i, std::format("The code at {:#06x} overlaps code before it.", byte));
+            written[byte] = true;
+        }
+        program[i].write(dest + address);
+    }
+    return layout.segments();
+}
@@ -1,6 +1,7 @@
 #include "../instruction.hpp"
+#include "../assembler.hpp"
 #include <cstdint>
-#include <limits>
+#include <stdexcept>
 
 enum class Flags : uint8_t
 {
@@ -11,7 +12,7 @@ enum class Flags : uint8_t
 
     JMP_WORD = 0x1,
     JMP_IMM = 0x2,
-    
+
     MEM_LOAD = 0x1,
     MEM_WORD = 0x2,
     MEM_SEX = 0x4,
@@ -46,19 +47,314 @@ uint8_t get_mem_flags(Opcode opcode) {
     }
 }
 
-bool Signature::operator==(const Signature& other) const {
-    return opcode == other.opcode && arguments == other.arguments;
+Signature Signature::of(Opcode opcode, std::span<const Argument> args) {
+    if (args.size() > MAX_ARGS)
+        throw std::runtime_error("Too many arguments.");
+    Signature signature;
+    signature.opcode = opcode;
+    signature.count = args.size();
+    for (size_t i = 0; i < args.size(); ++i)
+        signature.arguments[i] = kind(args[i]);
+    return signature;
+}
+
+std::string Signature::to_string() const {
+    static const char* const KINDS[] = { "register", "immediate", "label" };
+    std::string str = MNEMONICS[*opcode].empty() ? "opcode " + std::to_string(*opcode) : std::string(MNEMONICS[*opcode]);
+    for (size_t i = 0; i < count; ++i)
+        str += std::string(i ? ", " : " (") + KINDS[*arguments[i]];
+    return count ? str + ")" : str;
+}
+
+uint8_t register_of(const Argument& arg) {
+    return *std::get<RegisterArg>(arg).value;
+}
+
+// The value of an immediate, or the address of a label.
+int32_t value_of(const Argument& arg, const Layout& layout) {
+    if (const ImmediateArg* immediate = std::get_if<ImmediateArg>(&arg))
+        return immediate->negative ? -(int32_t)immediate->value : immediate->value;
+    const LabelArg& label = std::get<LabelArg>(arg);
+    return layout.address(label.target, label.section);
+}
+
+// A byte takes what reads the same sign extended or not, unless it has to be sign extended.
+bool fits_byte(int32_t value, bool sign_extended) {
+    return value >= -128 && value <= (sign_extended ? 127 : 255);
+}
+
+// A word takes what reads as one signed or unsigned.
+bool fits_word(int32_t value) {
+    return value >= -32768 && value <= 65535;
+}
+
+void put_instruction(uint8_t* to, Opcode opcode, uint8_t dest, uint8_t left, uint8_t right) {
+    to[0] = left << 4 | right;
+    to[1] = *opcode << 4 | dest;
+}
+
+void put_word(uint8_t* to, int32_t value) {
+    to[0] = value;
+    to[1] = value >> 8;
 }
 
-size_t std::hash<Signature>::operator()(const Signature& sig) const {
-    size_t hash = _opcode_hasher(sig.opcode);
-    for (const std::type_index& type: sig.arguments) {
-        hash += _type_hasher(type);
-        hash = (hash << 3) | (hash >> (std::numeric_limits<size_t>::digits - 3));
+// Operands of "op rd rl rr", "op rd rl rr imm" (raw: the immediate is written as it is),
+// "op rd rl imm|label" and "op rd imm".
+class AluOperands {
+public:
+    uint8_t dest;
+    uint8_t left;
+    uint8_t right;
+    bool raw;
+    int32_t value; // 0 without an immediate
+};
+
+AluOperands alu_operands(std::span<const Argument> args, const Layout& layout) {
+    uint8_t dest = register_of(args[0]);
+    switch (args.size()) {
+    case 2:
+        return { dest, dest, 0, false, value_of(args[1], layout) };
+    case 3:
+        if (kind(args[2]) == ArgKind::REGISTER)
+            return { dest, register_of(args[1]), register_of(args[2]), false, 0 };
+        return { dest, register_of(args[1]), 0, false, value_of(args[2], layout) };
+    default:
+        return { dest, register_of(args[1]), register_of(args[2]), true, value_of(args[3], layout) };
     }
-    return hash;
 }
 
-const std::unordered_map<Signature, InstructionDef> INSTRUCTIONS {
-    
-};
\ No newline at end of file
+// With r0 on the right, the instruction reads an immediate: none of them fit without one.
+bool alu_byte(Opcode opcode, const AluOperands& operands, uint8_t* to) {
+    if (operands.right != 0 || !fits_byte(operands.value, opcode == Opcode::ADD && !operands.raw))
+        return false;
+    put_instruction(to, opcode, operands.dest, operands.left, 0);
+    to[2] = operands.value;
+    return true;
+}
+
+bool alu_word(Opcode opcode, const AluOperands& operands, uint8_t* to) {
+    if (operands.right != 0 || !fits_word(operands.value))
+        return false;
+    put_instruction(to, opcode, operands.dest, operands.left, 0);
+    put_word(to + 2, operands.value);
+    return true;
+}
+
+bool emit_alu_short(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    if (args.size() != 3 || kind(args[2]) != ArgKind::REGISTER || register_of(args[2]) == 0)
+        return false;
+    put_instruction(to, opcode, register_of(args[0]), register_of(args[1]), register_of(args[2]));
+    return true;
+}
+
+bool emit_alu_byte(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    return alu_byte(opcode, alu_operands(args, layout), to);
+}
+
+bool emit_alu_word(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    return alu_word(opcode, alu_operands(args, layout), to);
+}
+
+// For sub, which has no byte form.
+bool emit_negated_byte(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    AluOperands operands = alu_operands(args, layout);
+    operands.value = -operands.value;
+    return alu_byte(Opcode::ADD, operands, to);
+}
+
+// For add, which has no word form. The value is checked as written, and negated modulo 2^16.
+bool emit_negated_word(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    AluOperands operands = alu_operands(args, layout);
+    if (!fits_word(operands.value))
+        return false;
+    operands.value = (uint16_t)-operands.value;
+    return alu_word(Opcode::SUB, operands, to);
+}
+
+// Flags and registers of "bra flags rl rr ...", "bra label", "bxx rl rr label", "bxx rl 0 label"
+// (against r0) and "hlt". False if the flags don't fit, or if bxx compares with another number.
+bool branch_operands(Opcode opcode, std::span<const Argument> args, const Layout& layout, uint8_t& flags, uint8_t& left, uint8_t& right) {
+    left = right = 0;
+    if (args.size() <= 1) {
+        flags = *Flags::BRA_NOT;
+        return true;
+    }
+    if (opcode != Opcode::BRA) {
+        flags = get_bra_cond_flags(opcode);
+        left = register_of(args[0]);
+        if (kind(args[1]) == ArgKind::IMMEDIATE)
+            return value_of(args[1], layout) == 0;
+        right = register_of(args[1]);
+        return true;
+    }
+    int32_t value = value_of(args[0], layout);
+    flags = value;
+    left = register_of(args[1]);
+    right = register_of(args[2]);
+    return value >= 0 && value <= 0xF;
+}
+
+// The offset is from the end of the instruction. hlt branches to itself, which the simulator
+// takes as halting.
+bool emit_branch(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t flags, left, right;
+    if (!branch_operands(opcode, args, layout, flags, left, right))
+        return false;
+    int32_t offset = args.empty() ? -3 : value_of(args.back(), layout);
+    bool label = !args.empty() && kind(args.back()) == ArgKind::LABEL;
+    if (label)
+        offset -= address + 3;
+    if (!fits_byte(offset, label))
+        return false;
+    put_instruction(to, Opcode::BRA, flags, left, right);
+    to[2] = offset;
+    return true;
+}
+
+// Branches over a jump to the label when the condition doesn't hold.
+bool emit_branch_far(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t flags, left, right;
+    if (!branch_operands(opcode, args, layout, flags, left, right))
+        return false;
+    put_instruction(to, Opcode::BRA, flags ^ *Flags::BRA_NOT, left, right);
+    to[2] = 4;
+    put_instruction(to + 3, Opcode::JMP, 0, 0, 0);
+    put_word(to + 5, value_of(args.back(), layout));
+    return true;
+}
+
+// "jmp rr", "jmp rd rl rr", "jsr rr", "call rr" and "ret".
+bool emit_jump_register(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t dest = 0, left = 0, right;
+    switch (opcode) {
+    case Opcode::RET:
+        right = *Register::RA;
+        break;
+    case Opcode::JSR:
+    case Opcode::CALL:
+        dest = *Register::RA;
+        right = register_of(args[0]);
+        break;
+    default:
+        if (args.size() == 1) {
+            right = register_of(args[0]);
+        } else {
+            dest = register_of(args[0]);
+            left = register_of(args[1]);
+            right = register_of(args[2]);
+        }
+        break;
+    }
+    if (left != 0 || right == 0) // Those read an immediate.
+        return false;
+    put_instruction(to, Opcode::JMP, dest, left, right);
+    return true;
+}
+
+// "jmp rd rl rr byte", with rl not r0.
+bool emit_jump_offset(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    int32_t offset = value_of(args[3], layout);
+    if (register_of(args[1]) == 0 || !fits_byte(offset, false))
+        return false;
+    put_instruction(to, Opcode::JMP, register_of(args[0]), register_of(args[1]), register_of(args[2]));
+    to[2] = offset;
+    return true;
+}
+
+// "jmp [rd] label", "jmp rd r0 r0 word" (or label), "jsr label", "call label", and "bra label" out
+// of reach.
+bool emit_jump_word(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t dest = 0;
+    if (opcode == Opcode::JSR || opcode == Opcode::CALL) {
+        dest = *Register::RA;
+    } else if (opcode == Opcode::JMP && args.size() > 1) {
+        dest = register_of(args[0]);
+        if (args.size() == 4 && (register_of(args[1]) != 0 || register_of(args[2]) != 0))
+            return false;
+    }
+    put_instruction(to, Opcode::JMP, dest, 0, 0);
+    put_word(to + 2, value_of(args.back(), layout));
+    return true;
+}
+
+// "mem rd flags rr byte" and "ldw rd rr [offset]" (and the other loads and stores).
+bool emit_memory(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t flags;
+    int32_t offset = 0;
+    bool raw = opcode == Opcode::MEM;
+    if (raw) {
+        int32_t value = value_of(args[1], layout);
+        if (value < 0 || value > 0xF)
+            return false;
+        flags = value;
+        offset = value_of(args[3], layout);
+    } else {
+        flags = get_mem_flags(opcode);
+        if (args.size() == 3)
+            offset = value_of(args[2], layout);
+    }
+    if (!fits_byte(offset, !raw))
+        return false;
+    put_instruction(to, Opcode::MEM, register_of(args[0]), flags, register_of(args[raw ? 2 : 1]));
+    to[2] = offset;
+    return true;
+}
+
+bool emit_load_zero(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t dest = register_of(args[0]);
+    if (dest == 0 || value_of(args[1], layout) != 0) // "xor r0 r0 r0" reads a word.
+        return false;
+    put_instruction(to, Opcode::XOR, dest, dest, dest);
+    return true;
+}
+
+bool emit_load_byte(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    return alu_byte(Opcode::ADD, { register_of(args[0]), 0, 0, false, value_of(args[1], layout) }, to);
+}
+
+bool emit_load_word(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    return alu_word(Opcode::XOR, { register_of(args[0]), 0, 0, false, value_of(args[1], layout) }, to);
+}
+
+bool emit_move(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    uint8_t dest = register_of(args[0]), source = register_of(args[1]);
+    if (source != 0)
+        put_instruction(to, Opcode::OR, dest, source, source);
+    else if (dest != 0)
+        put_instruction(to, Opcode::XOR, dest, dest, dest);
+    else
+        put_instruction(to, Opcode::ADD, 0, 0, *Register::RA); // Writes r0, which stays 0.
+    return true;
+}
+
+// "add r0 r0 ra", "add r0 r0 r0 0" and "xor r0 r0 r0 0".
+bool emit_nop(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    switch (opcode) {
+    case Opcode::SNOP:
+        put_instruction(to, Opcode::ADD, 0, 0, *Register::RA);
+        break;
+    case Opcode::NOP:
+        put_instruction(to, Opcode::ADD, 0, 0, 0);
+        to[2] = 0;
+        break;
+    default:
+        put_instruction(to, Opcode::XOR, 0, 0, 0);
+        put_word(to + 2, 0);
+        break;
+    }
+    return true;
+}
+
+bool emit_data(Opcode opcode, std::span<const Argument> args, size_t address, const Layout& layout, uint8_t* to) {
+    int32_t value = value_of(args[0], layout);
+    if (opcode == Opcode::WORD) {
+        if (!fits_word(value))
+            return false;
+        put_word(to, value);
+        return true;
+    }
+    if (!fits_byte(value, false))
+        return false;
+    to[0] = value;
+    return true;
+}
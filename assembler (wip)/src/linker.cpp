@@ -0,0 +1,119 @@
+#include "../linker.hpp"
+#include "../parser.hpp"
+#include <algorithm>
+#include <array>
+#include <format>
+#include <stdexcept>
+#include <unordered_map>
+
+// A symbol defined by some object, with the index and section its label has in the linked program.
+class Definition {
+public:
+    const ObjectFile* object;
+    uint32_t target;
+    uint16_t section;
+    const ObjectFile* other; // Another object that defines it, nullptr if none.
+};
+
+void LinkedImage::write(std::ostream& out, bool raw) const {
+    if (raw) {
+        out.write((const char*)memory.data(), memory.size());
+        return;
+    }
+    out.write("SIM1", 4);
+    for (const Segment& segment : segments) {
+        // A length takes 2 bytes, so all of memory takes 2 segments.
+        for (uint32_t start = 0; start < segment.size; start += 0xFFFF) {
+            uint32_t address = segment.address + start, size = std::min<uint32_t>(segment.size - start, 0xFFFF);
+            const uint8_t header[4] = { (uint8_t)address, (uint8_t)(address >> 8), (uint8_t)size, (uint8_t)(size >> 8) };
+            out.write((const char*)header, 4);
+            out.write((const char*)memory.data() + address, size);
+        }
+    }
+}
+
+// The object the instruction at index of the linked program comes from, and its line there.
+std::pair<const ObjectFile*, uint32_t> source_of(std::span<const ObjectFile> objects, std::span<const uint32_t> bases, size_t index) {
+    size_t object = std::upper_bound(bases.begin(), bases.end(), index) - bases.begin() - 1;
+    return { &objects[object], objects[object].lines[index - bases[object]] };
+}
+
+LinkedImage link(std::span<const ObjectFile> objects, std::string_view entry) {
+    size_t size = 0, sections = 0;
+    std::vector<uint32_t> bases; // Of the instructions of each object.
+    std::vector<uint16_t> section_bases; // The section the first instructions of each go in.
+    std::unordered_map<std::string_view, Definition, StringHash> definitions;
+    for (const ObjectFile& object : objects) {
+        bases.push_back(size);
+        section_bases.push_back(sections);
+        for (const Symbol& symbol : object.symbols) {
+            if (!symbol.defined)
+                continue;
+            Definition linked{ &object, (uint32_t)(size + symbol.target), (uint16_t)(sections + symbol.section), nullptr };
+            auto [definition, added] = definitions.emplace(symbol.name, linked);
+            if (!added && !definition->second.other)
+                definition->second.other = &object;
+        }
+        size += object.program.size();
+        sections += object.program.origins().size();
+    }
+
+    Program program(size);
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const ObjectFile& object = objects[i];
+        std::span<const InstrInstance> instrs = object.program.instructions();
+        std::span<const Origin> origins = object.program.origins();
+        auto origin = origins.begin();
+        auto relocation = object.relocations.begin();
+        for (size_t index = 0; index < instrs.size(); ++index) {
+            for (; origin != origins.end() && origin->first == index; ++origin)
+                program.move(origin->address);
+            std::array<Argument, Signature::MAX_ARGS> args;
+            std::copy(instrs[index].args().begin(), instrs[index].args().end(), args.begin());
+            for (Argument& arg : std::span(args.data(), instrs[index].args().size())) {
+                if (LabelArg* label = std::get_if<LabelArg>(&arg)) {
+                    label->target += bases[i];
+                    label->section += section_bases[i];
+                }
+            }
+            for (; relocation != object.relocations.end() && relocation->instruction == index; ++relocation) {
+                const std::string& name = object.symbols[relocation->symbol].name;
+                auto definition = definitions.find(name);
+                if (definition == definitions.end())
+                    throw std::runtime_error(std::format("{}: {} isn't defined.", object.name, name));
+                if (definition->second.other)
+                    throw std::runtime_error(std::format("{}: {} is defined in both {} and {}.", object.name, name,
+                        definition->second.object->name, definition->second.other->name));
+                std::get<LabelArg>(args[relocation->argument]) = { (uint16_t)definition->second.target, definition->second.section };
+            }
+            try {
+                program.add(instrs[index].opcode(), std::span(args.data(), instrs[index].args().size()));
+            } catch (const std::runtime_error& e) {
+                throw std::runtime_error(std::format("{}: Line {}: {}", object.name, object.lines[index], e.what()));
+            }
+        }
+        for (; origin != origins.end(); ++origin) // .moves at the end of the file.
+            program.move(origin->address);
+    }
+
+    LinkedImage image{ std::vector<uint8_t>(65536), {} };
+    try {
+        image.segments = assemble(program, image.memory.data());
+    } catch (const AssemblyError& e) {
+        auto [object, line] = source_of(objects, bases, e.instruction);
+        throw std::runtime_error(std::format("{}: Line {}: {}", object->name, line, e.what()));
+    }
+
+    bool has_vector = std::any_of(image.segments.begin(), image.segments.end(), [](const Segment& segment) {
+        return segment.address < RESET_VECTOR + 2 && segment.address + segment.size > RESET_VECTOR;
+    });
+    auto definition = definitions.find(entry);
+    if (!has_vector && definition != definitions.end()) {
+        Layout layout(program.instructions(), program.origins());
+        size_t address = layout.address(definition->second.target, definition->second.section);
+        image.memory[RESET_VECTOR] = address;
+        image.memory[RESET_VECTOR + 1] = address >> 8;
+        image.segments.push_back({ RESET_VECTOR, 2 });
+    }
+    return image;
+}
@@ -0,0 +1,156 @@
+#include "../object.hpp"
+#include "../parser.hpp"
+#include <exception>
+#include <format>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+
+// The bytes of a string as written between the quotes.
+std::string unescape(std::string_view text, uint32_t line) {
+    std::string bytes;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != '\\') {
+            bytes += text[i];
+            continue;
+        }
+        switch (text[++i]) { // The lexer doesn't end a string on a '\'.
+        case 'n': bytes += '\n'; break;
+        case 't': bytes += '\t'; break;
+        case 'r': bytes += '\r'; break;
+        case '0': bytes += '\0'; break;
+        case '\\': bytes += '\\'; break;
+        case '"': bytes += '"'; break;
+        default:
+            throw std::runtime_error(std::format("Line {}: unknown escape \\{}.", line, text[i]));
+        }
+    }
+    return bytes;
+}
+
+// A label operand, set once the whole file is read.
+class Use {
+public:
+    uint32_t instruction;
+    uint8_t argument;
+    std::string_view name;
+    uint32_t line;
+};
+
+ObjectFile::ObjectFile(std::string_view source, std::string name) : name(std::move(name)) {
+    Parser parser(source);
+    Statement statement;
+    std::unordered_map<std::string_view, LabelArg, StringHash> labels;
+    std::vector<Use> uses;
+
+    // Adds an instruction, or a piece of data, with the labels in it as uses.
+    auto add = [&](Opcode opcode, std::span<const Argument> args, std::span<const Operand> operands) {
+        try {
+            program.add(opcode, args);
+            lines.push_back(statement.line);
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(std::format("Line {}: {}", statement.line, e.what()));
+        }
+        for (size_t i = 0; i < operands.size(); ++i) {
+            if (operands[i].kind == OperandKind::SYMBOL)
+                uses.push_back({ (uint32_t)program.size() - 1, (uint8_t)i, operands[i].text, statement.line });
+        }
+    };
+
+    try {
+        while (parser.next(statement)) {
+            std::span<const Operand> operands(statement.operands.data(), statement.count);
+            std::array<Argument, Statement::MAX_OPERANDS> args;
+            for (size_t i = 0; i < operands.size(); ++i) {
+                switch (operands[i].kind) {
+                case OperandKind::REGISTER:
+                    args[i] = RegisterArg{ operands[i].reg };
+                    break;
+                case OperandKind::NUMBER:
+                    args[i] = ImmediateArg{ operands[i].negative, operands[i].value };
+                    break;
+                case OperandKind::SYMBOL:
+                    args[i] = LabelArg{ 0, 0 };
+                    break;
+                case OperandKind::STRING:
+                    if (statement.kind != StatementKind::STR)
+                        throw std::runtime_error(std::format("Line {}: unexpected string.", statement.line));
+                    break;
+                }
+            }
+
+            switch (statement.kind) {
+            case StatementKind::LABEL: {
+                LabelArg label{ (uint16_t)program.size(), program.section() };
+                if (!labels.emplace(statement.name, label).second)
+                    throw std::runtime_error(std::format("Line {}: {} is already defined.", statement.line, statement.name));
+                symbols.push_back({ std::string(statement.name), true, label.target, label.section });
+                break;
+            }
+            case StatementKind::INSTRUCTION:
+                add(statement.opcode, std::span(args.data(), operands.size()), operands);
+                break;
+            case StatementKind::MOVE:
+                if (operands[0].kind != OperandKind::NUMBER || operands[0].negative)
+                    throw std::runtime_error(std::format("Line {}: .move needs an address.", statement.line));
+                program.move(operands[0].value);
+                break;
+            case StatementKind::WORD:
+            case StatementKind::BYTE: {
+                if (statement.kind == StatementKind::BYTE && operands[0].kind != OperandKind::NUMBER)
+                    throw std::runtime_error(std::format("Line {}: .byte needs a number.", statement.line));
+                Opcode opcode = statement.kind == StatementKind::WORD ? Opcode::WORD : Opcode::BYTE;
+                for (size_t i = 0; i < (operands.size() == 2 ? operands[1].value : 1); ++i)
+                    add(opcode, std::span(args.data(), 1), operands.first(1));
+                break;
+            }
+            case StatementKind::STR:
+                for (char c : unescape(operands[0].text, statement.line) + '\0') {
+                    Argument byte = ImmediateArg{ false, (uint8_t)c };
+                    add(Opcode::BYTE, std::span(&byte, 1), {});
+                }
+                break;
+            }
+        }
+
+        std::unordered_map<std::string_view, uint32_t, StringHash> undefined; // Symbol of each.
+        for (const Use& use : uses) {
+            InstrInstance& instr = program.instructions()[use.instruction];
+            if (auto label = labels.find(use.name); label != labels.end()) {
+                instr.set_target(use.argument, label->second.target, label->second.section);
+                continue;
+            }
+            auto [symbol, added] = undefined.emplace(use.name, symbols.size());
+            if (added)
+                symbols.push_back({ std::string(use.name), false, 0, 0 });
+            relocations.push_back({ use.instruction, use.argument, symbol->second });
+        }
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(std::format("{}: {}", this->name, e.what()));
+    }
+}
+
+std::vector<ObjectFile> assemble_files(const std::vector<std::string>& paths, ThreadPool& pool) {
+    std::vector<std::optional<ObjectFile>> objects(paths.size());
+    std::vector<std::exception_ptr> errors(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        pool.submit([&, i] {
+            try {
+                SourceFile source(paths[i]);
+                objects[i].emplace(source.text(), paths[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    pool.wait();
+
+    std::vector<ObjectFile> result;
+    result.reserve(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+        result.push_back(std::move(*objects[i]));
+    }
+    return result;
+}
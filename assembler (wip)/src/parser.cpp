@@ -1,2 +1,264 @@
 #include "../parser.hpp"
+#include <cstring>
+#include <format>
+#include <stdexcept>
 
+#if __has_include(<sys/mman.h>)
+#define USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+SourceFile::SourceFile(const std::string& path) : _data(nullptr), _size(0) {
+#ifdef USE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(std::format("Cannot open {}.", path));
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        throw std::runtime_error(std::format("Cannot read {}.", path));
+    }
+    _size = info.st_size;
+    if (_size) { // mmap() takes no empty mappings.
+        void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(std::format("Cannot read {}.", path));
+        }
+        madvise(data, _size, MADV_SEQUENTIAL);
+        _data = (const char*)data;
+    }
+    close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error(std::format("Cannot open {}.", path));
+    _copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    _data = _copy.data();
+    _size = _copy.size();
+#endif
+}
+
+SourceFile::~SourceFile() {
+#ifdef USE_MMAP
+    if (_data)
+        munmap((void*)_data, _size);
+#endif
+}
+
+std::string_view SourceFile::text() const {
+    return std::string_view(_data, _size);
+}
+
+enum class CharClass : uint8_t
+{
+    OTHER,
+    SPACE,
+    DIGIT,
+    LETTER, // Or '_'
+};
+
+// What each character can be, looked up instead of compared against ranges.
+constexpr std::array<CharClass, 256> CLASSES = [] {
+    std::array<CharClass, 256> classes{};
+    classes[' '] = classes['\t'] = classes['\r'] = CharClass::SPACE;
+    for (int c = '0'; c <= '9'; ++c)
+        classes[c] = CharClass::DIGIT;
+    for (int c = 'a'; c <= 'z'; ++c)
+        classes[c] = classes[c - 'a' + 'A'] = CharClass::LETTER;
+    classes['_'] = CharClass::LETTER;
+    return classes;
+}();
+
+CharClass char_class(char c) {
+    return CLASSES[(uint8_t)c];
+}
+
+Lexer::Lexer(std::string_view source) : _current(source.data()), _end(source.data() + source.size()), _line(1) {}
+
+Token Lexer::next() {
+    while (_current != _end) {
+        if (char_class(*_current) == CharClass::SPACE) {
+            ++_current;
+        } else if (*_current == '#') {
+            const char* newline = (const char*)std::memchr(_current, '\n', _end - _current);
+            _current = newline ? newline : _end;
+        } else {
+            break;
+        }
+    }
+    if (_current == _end)
+        return { TokenKind::END, {}, _line };
+
+    const char* start = _current;
+    TokenKind kind;
+    switch (char_class(*_current)) {
+    case CharClass::LETTER:
+        kind = TokenKind::IDENTIFIER;
+        break;
+    case CharClass::DIGIT:
+        kind = TokenKind::NUMBER;
+        break;
+    default:
+        if (*_current == '\n') {
+            ++_current;
+            return { TokenKind::NEWLINE, std::string_view(start, 1), _line++ };
+        }
+        if (*_current == '"') {
+            for (++_current; _current != _end && *_current != '"' && *_current != '\n'; ++_current) {
+                if (*_current == '\\' && _current + 1 != _end && _current[1] != '\n')
+                    ++_current;
+            }
+            if (_current == _end || *_current != '"')
+                throw std::runtime_error(std::format("Line {}: unterminated string.", _line));
+            ++_current;
+            return { TokenKind::STRING, std::string_view(start, _current - start), _line };
+        }
+        if (*_current == '.' || *_current == '-') {
+            kind = *_current == '.' ? TokenKind::DIRECTIVE : TokenKind::NUMBER;
+            ++_current;
+            if (_current != _end && char_class(*_current) == (*start == '.' ? CharClass::LETTER : CharClass::DIGIT))
+                break;
+        }
+        throw std::runtime_error(std::format("Line {}: unexpected character '{}'.", _line, *start));
+    }
+
+    // Numbers take letters too (0x, hexadecimal digits), and are checked as a whole by the parser.
+    while (_current != _end && char_class(*_current) >= CharClass::DIGIT)
+        ++_current;
+    std::string_view text(start, _current - start);
+    if (kind == TokenKind::IDENTIFIER && _current != _end && *_current == ':') {
+        ++_current;
+        kind = TokenKind::LABEL;
+    }
+    return { kind, text, _line };
+}
+
+// The bit of Parser::_alias_bits a name takes: from its ends and its length, without a loop.
+uint64_t alias_bit(std::string_view name) {
+    return 1ull << ((name.front() ^ name.back() * 7 ^ name.size() * 13) & 63);
+}
+
+Parser::Parser(std::string_view source) : _lexer(source) {
+    _aliases.emplace("RESET_VECTOR", Operand{ OperandKind::NUMBER, "0xFFFD", Register::R0, false, RESET_VECTOR });
+    _alias_bits |= alias_bit("RESET_VECTOR");
+}
+
+Operand Parser::_operand(const Token& token) {
+    Operand operand{ OperandKind::NUMBER, token.text, Register::R0, false, 0 };
+    switch (token.kind) {
+    case TokenKind::NUMBER:
+        if (!parse_number(token.text, operand.negative, operand.value))
+            throw std::runtime_error(std::format("Line {}: invalid number {}.", token.line, token.text));
+        return operand;
+    case TokenKind::STRING:
+        operand.kind = OperandKind::STRING;
+        operand.text = token.text.substr(1, token.text.size() - 2);
+        return operand;
+    case TokenKind::IDENTIFIER:
+        if (const Register* reg = REGISTERS.find(token.text)) {
+            operand.kind = OperandKind::REGISTER;
+            operand.reg = *reg;
+            return operand;
+        }
+        if (_alias_bits & alias_bit(token.text)) {
+            if (auto alias = _aliases.find(token.text); alias != _aliases.end())
+                return alias->second;
+        }
+        operand.kind = OperandKind::SYMBOL;
+        return operand;
+    default:
+        throw std::runtime_error(std::format("Line {}: unexpected {}.", token.line, token.text));
+    }
+}
+
+void Parser::_operands(Statement& statement) {
+    statement.count = 0;
+    for (Token token = _lexer.next(); token.kind != TokenKind::NEWLINE && token.kind != TokenKind::END; token = _lexer.next()) {
+        if (statement.count == Statement::MAX_OPERANDS)
+            throw std::runtime_error(std::format("Line {}: too many operands.", token.line));
+        statement.operands[statement.count++] = _operand(token);
+    }
+}
+
+bool Parser::_directive(Statement& statement, const Token& token) {
+    if (token.text == ".def") {
+        Token name = _lexer.next();
+        if (name.kind != TokenKind::IDENTIFIER || REGISTERS.contains(name.text))
+            throw std::runtime_error(std::format("Line {}: .def needs a name that isn't a register.", token.line));
+        _operands(statement);
+        if (statement.count != 1)
+            throw std::runtime_error(std::format("Line {}: .def needs one value.", token.line));
+        if (!_aliases.emplace(name.text, statement.operands[0]).second)
+            throw std::runtime_error(std::format("Line {}: {} is already defined.", token.line, name.text));
+        _alias_bits |= alias_bit(name.text);
+        return false;
+    }
+
+    uint8_t min, max;
+    if (token.text == ".move") {
+        statement.kind = StatementKind::MOVE;
+        min = max = 1;
+    } else if (token.text == ".word" || token.text == ".byte") {
+        statement.kind = token.text == ".word" ? StatementKind::WORD : StatementKind::BYTE;
+        min = 1;
+        max = 2;
+    } else if (token.text == ".str") {
+        statement.kind = StatementKind::STR;
+        min = max = 1;
+    } else {
+        throw std::runtime_error(std::format("Line {}: unknown directive {}.", token.line, token.text));
+    }
+    _operands(statement);
+    if (statement.count < min || statement.count > max)
+        throw std::runtime_error(std::format("Line {}: wrong number of operands for {}.", token.line, token.text));
+
+    const Operand& value = statement.operands[0];
+    if (statement.kind == StatementKind::STR ? value.kind != OperandKind::STRING
+            : value.kind != OperandKind::NUMBER && value.kind != OperandKind::SYMBOL)
+        throw std::runtime_error(std::format("Line {}: wrong operand for {}.", token.line, token.text));
+    if (statement.count == 2 && (statement.operands[1].kind != OperandKind::NUMBER || statement.operands[1].negative))
+        throw std::runtime_error(std::format("Line {}: the count of {} has to be a number.", token.line, token.text));
+    return true;
+}
+
+// Flattened, so that a statement is lexed and parsed in one function, with the lexer's position
+// in a register instead of going through memory at every token.
+[[gnu::flatten]] bool Parser::next(Statement& statement) {
+    while (true) {
+        Token token = _lexer.next();
+        statement.name = token.text;
+        statement.line = token.line;
+        switch (token.kind) {
+        case TokenKind::NEWLINE:
+            break;
+        case TokenKind::END:
+            return false;
+        case TokenKind::LABEL:
+            statement.kind = StatementKind::LABEL;
+            statement.count = 0;
+            return true;
+        case TokenKind::DIRECTIVE:
+            if (_directive(statement, token))
+                return true;
+            break;
+        case TokenKind::IDENTIFIER: {
+            const Opcode* opcode = OPCODES.find(token.text);
+            if (!opcode)
+                throw std::runtime_error(std::format("Line {}: unknown instruction {}.", token.line, token.text));
+            statement.kind = StatementKind::INSTRUCTION;
+            statement.opcode = *opcode;
+            _operands(statement);
+            return true;
+        }
+        default:
+            throw std::runtime_error(std::format("Line {}: unexpected {}.", token.line, token.text));
+        }
+    }
+}
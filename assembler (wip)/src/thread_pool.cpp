@@ -0,0 +1,53 @@
+#include "../thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) : _running(0), _stopping(false) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i)
+        _workers.emplace_back(&ThreadPool::_work, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(_mutex);
+        _stopping = true;
+    }
+    _queued.notify_all();
+    for (std::thread& worker : _workers)
+        worker.join();
+}
+
+void ThreadPool::_work() {
+    std::unique_lock lock(_mutex);
+    while (true) {
+        _queued.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+        if (_tasks.empty())
+            return;
+        std::function<void()> task = std::move(_tasks.front());
+        _tasks.pop_front();
+        ++_running;
+        lock.unlock();
+        task();
+        lock.lock();
+        if (--_running == 0 && _tasks.empty())
+            _done.notify_all();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard lock(_mutex);
+        _tasks.push_back(std::move(task));
+    }
+    _queued.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock(_mutex);
+    _done.wait(lock, [this] { return _running == 0 && _tasks.empty(); });
+}
+
+unsigned ThreadPool::size() const {
+    return _workers.size();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that take tasks from one queue, made once and kept for every task given to them.
+// Tasks shouldn't throw: what they fail with has to be kept by them.
+class ThreadPool {
+private:
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _queued; // A task, or stopping.
+    std::condition_variable _done; // No task queued or running.
+    std::deque<std::function<void()>> _tasks;
+    size_t _running;
+    bool _stopping;
+
+    void _work();
+
+public:
+    // All cores if threads is 0.
+    explicit ThreadPool(unsigned threads = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool(); // After the tasks left.
+
+    void submit(std::function<void()> task);
+    void wait(); // Until every task submitted has finished.
+    unsigned size() const;
+};
\ No newline at end of file
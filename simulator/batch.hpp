@@ -0,0 +1,261 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "image.hpp"
+#include "profile.hpp"
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs many independent programs at once, one CPU per worker thread.
+class Batch
+{
+public:
+    struct Job
+    {
+        std::string program; // As written in the manifest.
+        std::shared_ptr<const CPU::Snapshot> start; // Power-on state with the program loaded, shared by every job of it.
+        std::vector<std::pair<uint8_t, uint16_t>> registers; // Set before the first cycle.
+        uint64_t max_cycles = std::numeric_limits<uint64_t>::max();
+    };
+
+private:
+    // Jobs waiting for one worker. The owner takes from the back, the others steal from the front.
+    struct _Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<Job> _jobs;
+    std::map<std::string, std::shared_ptr<const CPU::Snapshot>> _programs;
+    std::unique_ptr<_Queue[]> _queues;
+    unsigned _threads = 0;
+    std::mutex _output;
+    uint64_t _cycles = 0; // Total of every finished job, under _output.
+    std::map<std::string, Profiler> _profiles; // Of every program, under _output.
+
+    // Register number for rN or an ABI name, -1 if it's neither.
+    static int _register_index(const std::string& name)
+    {
+        static const char* names[16] = {
+            "zero", "ra", "sp", "a0", "a1", "a2", "a3", "t0",
+            "t1", "t2", "t3", "t4", "s0", "s1", "s2", "s3",
+        };
+        for (int i = 0; i < 16; ++i)
+        {
+            if (name == names[i])
+                return i;
+        }
+        if (name.size() < 2 || name.size() > 3 || name[0] != 'r' || !std::all_of(name.begin() + 1, name.end(), ::isdigit))
+            return -1;
+        int index = std::stoi(name.substr(1));
+        return index < 16 ? index : -1;
+    }
+
+    static std::string _json_string(const std::string& text)
+    {
+        std::string result = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                result += '\\';
+            if ((unsigned char)c < 0x20)
+            {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                result += escape;
+            }
+            else
+            {
+                result += c;
+            }
+        }
+        return result + '"';
+    }
+
+    bool _take(unsigned worker, size_t& job)
+    {
+        {
+            std::lock_guard lock(_queues[worker].mutex);
+            if (!_queues[worker].jobs.empty())
+            {
+                job = _queues[worker].jobs.back();
+                _queues[worker].jobs.pop_back();
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < _threads; ++i)
+        {
+            _Queue& victim = _queues[(worker + i) % _threads];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.jobs.empty())
+            {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false; // Nothing is ever queued after the start, so every queue stays empty.
+    }
+
+    void _work(unsigned worker, CPU::Engine engine, bool profile, std::ostream& out)
+    {
+        CPU cpu; // Restored between jobs, its memory and caches are reused.
+        std::map<std::string, Profiler> profiles;
+        size_t index;
+        while (_take(worker, index))
+        {
+            const Job& job = _jobs[index];
+            auto start = std::chrono::steady_clock::now();
+            cpu.restore(*job.start); // Only copies the pages the last job changed, if it ran the same program.
+            for (auto [reg, value] : job.registers)
+                cpu.set_register(reg, value);
+            if (profile)
+            {
+                Profiler& profiler = profiles[job.program];
+                profiler.unwind();
+                profiler.run(cpu, job.max_cycles);
+            }
+            else
+            {
+                cpu.run(job.max_cycles, engine);
+            }
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+            std::ostringstream line;
+            line << "{\"job\":" << index << ",\"program\":" << _json_string(job.program)
+                 << ",\"cycles\":" << cpu.cycles() << ",\"instructions\":" << cpu.instructions()
+                 << ",\"halted\":" << (cpu.halted() ? "true" : "false") << ",\"pc\":" << cpu.pc()
+                 << ",\"registers\":[";
+            for (int i = 0; i < 16; ++i)
+                line << (i ? "," : "") << cpu.registers()[i];
+            line << "],\"seconds\":" << seconds.count() << "}\n";
+
+            std::lock_guard lock(_output);
+            out << line.str() << std::flush;
+            _cycles += cpu.cycles();
+        }
+
+        std::lock_guard lock(_output);
+        for (const auto& [program, profiler] : profiles)
+            _profiles[program].merge(profiler);
+    }
+
+public:
+    // Reads a manifest with one job per line: a program, then register=value overrides and an
+    // optional cycles=N budget, separated by spaces. Registers are rN or ABI names, numbers
+    // can be hex (0x) or octal (0). Blank lines and lines starting with # are skipped.
+    bool load(const std::string& filename)
+    {
+        std::ifstream file(filename);
+        if (!file)
+        {
+            std::cout << "Can't open " << filename << ".\n";
+            return false;
+        }
+        std::string text;
+        for (size_t line = 1; std::getline(file, text); ++line)
+        {
+            std::istringstream words(text);
+            Job job;
+            if (!(words >> job.program) || job.program.starts_with("#"))
+                continue;
+
+            auto& start = _programs[job.program];
+            if (!start)
+            {
+                Image image;
+                if (!image.open(job.program))
+                {
+                    std::cout << filename << ":" << line << ": invalid input file " << job.program << ": " << image.error() << ".\n";
+                    return false;
+                }
+                CPU cpu;
+                image.load(cpu);
+                start = std::make_shared<const CPU::Snapshot>(cpu.snapshot());
+            }
+            job.start = start;
+
+            for (std::string word; words >> word;)
+            {
+                size_t equals = word.find('=');
+                std::string name = word.substr(0, equals);
+                uint64_t value = 0;
+                try
+                {
+                    value = std::stoull(word.substr(equals + 1), nullptr, 0);
+                }
+                catch (const std::exception&)
+                {
+                    equals = std::string::npos;
+                }
+                if (equals != std::string::npos && name == "cycles")
+                {
+                    job.max_cycles = value;
+                }
+                else if (equals != std::string::npos && _register_index(name) >= 0 && value <= 0xFFFF)
+                {
+                    job.registers.emplace_back(_register_index(name), value);
+                }
+                else
+                {
+                    std::cout << filename << ":" << line << ": invalid setting " << word << ".\n";
+                    return false;
+                }
+            }
+            _jobs.push_back(std::move(job));
+        }
+        return true;
+    }
+
+    // Runs every job on the given number of threads (all cores if 0) and writes a JSON line to
+    // out for each one as soon as it finishes. Returns the total of cycles run. With profile, the
+    // jobs run in a Profiler instead of the engine, see report().
+    uint64_t run(unsigned threads, CPU::Engine engine, std::ostream& out, bool profile = false)
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        _threads = threads;
+        _queues.reset(new _Queue[threads]);
+        for (size_t i = 0; i < _jobs.size(); ++i)
+            _queues[i % threads].jobs.push_back(i);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(&Batch::_work, this, i, engine, profile, std::ref(out));
+        _work(0, engine, profile, out);
+        for (std::thread& worker : workers)
+            worker.join();
+        return _cycles;
+    }
+
+    size_t size() const
+    {
+        return _jobs.size();
+    }
+
+    // Writes a report of the profile of every program, with the jobs of each added up.
+    void report(std::ostream& out, Profiler::Report kind) const
+    {
+        CPU cpu;
+        for (const auto& [program, profiler] : _profiles)
+        {
+            if (kind != Profiler::FOLDED && program != _profiles.begin()->first)
+                out << '\n';
+            cpu.restore(*_programs.at(program));
+            profiler.report(out, kind, cpu.memory(), program);
+        }
+    }
+};
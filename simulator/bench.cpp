@@ -0,0 +1,620 @@
+#include "cpu.hpp"
+#include "lockstep.hpp"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Builds guest programs by hand, one instruction at a time. Branch targets are labels, which
+// are resolved once the whole program has been written.
+class Program
+{
+public:
+    // Branch conditions, as encoded in the destination field of BRA.
+    enum Condition : uint8_t
+    {
+        ALWAYS = 0x1,
+        BEQ = 0x8,
+        BNE = 0x9,
+        BLT = 0x2,
+        BGE = 0x3,
+        BLTU = 0x6,
+        BGEU = 0x7,
+    };
+
+    // Memory access flags, as encoded in the left field of MEM.
+    enum Access : uint8_t
+    {
+        STORE = 0x0,
+        LOAD = 0x1,
+        WORD = 0x2,
+    };
+
+private:
+    std::vector<uint8_t> _code;
+    std::map<std::string, uint16_t> _labels;
+    std::vector<std::pair<size_t, std::string>> _branches; // Offset byte, target label
+    std::vector<std::pair<size_t, std::string>> _calls; // Address word, target label
+
+    void _instruction(uint8_t opcode, uint8_t dest, uint8_t left, uint8_t right)
+    {
+        _code.push_back(left << 4 | right);
+        _code.push_back(opcode << 4 | dest);
+    }
+
+public:
+    // op rd rl rr
+    void reg(CPU::Opcode opcode, uint8_t dest, uint8_t left, uint8_t right)
+    {
+        _instruction(opcode, dest, left, right);
+    }
+
+    // op rd rl r0 [byte], for ADD, LSL, LSR and ASR
+    void byte(CPU::Opcode opcode, uint8_t dest, uint8_t left, int8_t value)
+    {
+        _instruction(opcode, dest, left, 0);
+        _code.push_back(value);
+    }
+
+    // op rd rl r0 [word], for SUB, XOR, OR and AND
+    void word(CPU::Opcode opcode, uint8_t dest, uint8_t left, uint16_t value)
+    {
+        _instruction(opcode, dest, left, 0);
+        _code.push_back(value);
+        _code.push_back(value >> 8);
+    }
+
+    void bra(Condition condition, uint8_t left, uint8_t right, const std::string& target)
+    {
+        _instruction(CPU::BRA, condition, left, right);
+        _branches.emplace_back(_code.size(), target);
+        _code.push_back(0);
+    }
+
+    // mem rd [flags] rr [byte]
+    void mem(uint8_t flags, uint8_t dest, uint8_t base, int8_t offset)
+    {
+        _instruction(CPU::MEM, dest, flags, base);
+        _code.push_back(offset);
+    }
+
+    // jmp ra r0 r0 [word], the assembler's jsr
+    void jsr(const std::string& target)
+    {
+        _instruction(CPU::JMP, CPU::RA, CPU::ZERO, CPU::ZERO);
+        _calls.emplace_back(_code.size(), target);
+        _code.push_back(0);
+        _code.push_back(0);
+    }
+
+    // jmp r0 ra ra [0], the assembler's ret
+    void ret()
+    {
+        _instruction(CPU::JMP, CPU::ZERO, CPU::RA, CPU::RA);
+        _code.push_back(0);
+    }
+
+    void label(const std::string& name)
+    {
+        _labels[name] = _code.size();
+    }
+
+    // Branches to itself, which the CPU treats as halting.
+    void halt()
+    {
+        std::string name = "halt" + std::to_string(_code.size());
+        label(name);
+        bra(ALWAYS, CPU::ZERO, CPU::ZERO, name);
+    }
+
+    // Returns a full memory image with the program at address 0, which the reset vector points to.
+    std::vector<uint8_t> image() const
+    {
+        std::vector<uint8_t> memory(CPU::MEM_SIZE, 0);
+        std::copy(_code.begin(), _code.end(), memory.begin());
+        for (const auto& [offset, target] : _branches)
+        {
+            int distance = (int)_labels.at(target) - (int)(offset + 1);
+            if (distance < -128 || distance > 127)
+                throw std::runtime_error("Branch to " + target + " is out of range.");
+            memory[offset] = (uint8_t)distance;
+        }
+        for (const auto& [offset, target] : _calls)
+        {
+            memory[offset] = _labels.at(target);
+            memory[offset + 1] = _labels.at(target) >> 8;
+        }
+        return memory;
+    }
+};
+
+// Computes the 24th Fibonacci number in a loop like programs/fibonacci.txt, repeatedly.
+Program fibonacci(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::T0, CPU::ZERO, 0);
+    p.byte(CPU::ADD, CPU::T1, CPU::ZERO, 1);
+    p.byte(CPU::ADD, CPU::T3, CPU::ZERO, 24);
+    p.label("loop");
+    p.reg(CPU::ADD, CPU::T2, CPU::T0, CPU::T1);
+    p.reg(CPU::XOR, CPU::T0, CPU::ZERO, CPU::T1);
+    p.reg(CPU::XOR, CPU::T1, CPU::ZERO, CPU::T2);
+    p.byte(CPU::ADD, CPU::T3, CPU::T3, -1);
+    p.bra(Program::BNE, CPU::T3, CPU::ZERO, "loop");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Computes the 18th Fibonacci number recursively, with the calls and stack frames of
+// programs/stack test.txt, repeatedly. Mostly calls, returns, loads and stores.
+Program stack(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::SP, CPU::ZERO, 0x8000);
+    p.byte(CPU::ADD, CPU::A0, CPU::ZERO, 18);
+    p.jsr("fib");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+
+    p.label("fib"); // a0 = fib(a0)
+    p.byte(CPU::ADD, CPU::T0, CPU::ZERO, 2);
+    p.bra(Program::BLTU, CPU::A0, CPU::T0, "return");
+    p.byte(CPU::ADD, CPU::SP, CPU::SP, -6);
+    p.mem(Program::STORE | Program::WORD, CPU::RA, CPU::SP, 0);
+    p.mem(Program::STORE | Program::WORD, CPU::A0, CPU::SP, 2);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, -1);
+    p.jsr("fib");
+    p.mem(Program::STORE | Program::WORD, CPU::A0, CPU::SP, 4);
+    p.mem(Program::LOAD | Program::WORD, CPU::A0, CPU::SP, 2);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, -2);
+    p.jsr("fib");
+    p.mem(Program::LOAD | Program::WORD, CPU::T0, CPU::SP, 4);
+    p.reg(CPU::ADD, CPU::A0, CPU::A0, CPU::T0);
+    p.mem(Program::LOAD | Program::WORD, CPU::RA, CPU::SP, 0);
+    p.byte(CPU::ADD, CPU::SP, CPU::SP, 6);
+    p.label("return");
+    p.ret();
+    return p;
+}
+
+// Copies 4 KiB from 0x4000 to 0x6000 a word at a time, repeatedly.
+Program copy(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::T0, CPU::ZERO, 0x4000);
+    p.word(CPU::XOR, CPU::T1, CPU::ZERO, 0x6000);
+    p.word(CPU::XOR, CPU::T3, CPU::ZERO, 2048);
+    p.label("loop");
+    p.mem(Program::LOAD | Program::WORD, CPU::T2, CPU::T0, 0);
+    p.mem(Program::STORE | Program::WORD, CPU::T2, CPU::T1, 0);
+    p.byte(CPU::ADD, CPU::T0, CPU::T0, 2);
+    p.byte(CPU::ADD, CPU::T1, CPU::T1, 2);
+    p.byte(CPU::ADD, CPU::T3, CPU::T3, -1);
+    p.bra(Program::BNE, CPU::T3, CPU::ZERO, "loop");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Runs a 16 bit xorshift generator (x ^= x << 7, x ^= x >> 9, x ^= x << 8) in a0 0xFFFF times,
+// repeatedly.
+Program shifts(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.byte(CPU::ADD, CPU::A0, CPU::ZERO, 1);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::S0, CPU::ZERO, 0xFFFF);
+    p.label("loop");
+    p.byte(CPU::LSL, CPU::T0, CPU::A0, 7);
+    p.reg(CPU::XOR, CPU::A0, CPU::A0, CPU::T0);
+    p.byte(CPU::LSR, CPU::T0, CPU::A0, 9);
+    p.reg(CPU::XOR, CPU::A0, CPU::A0, CPU::T0);
+    p.byte(CPU::LSL, CPU::T0, CPU::A0, 8);
+    p.reg(CPU::XOR, CPU::A0, CPU::A0, CPU::T0);
+    p.byte(CPU::ADD, CPU::S0, CPU::S0, -1);
+    p.bra(Program::BNE, CPU::S0, CPU::ZERO, "loop");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Sums the Collatz trajectory lengths of 1..700 into a0, repeatedly. Almost every instruction
+// is next to a data dependent branch.
+Program collatz(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.byte(CPU::ADD, CPU::T3, CPU::ZERO, 1);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::S0, CPU::ZERO, 700); // Trajectories up to 700 stay below 0x10000
+    p.label("outer");
+    p.reg(CPU::XOR, CPU::T0, CPU::ZERO, CPU::S0);
+    p.label("inner");
+    p.bra(Program::BEQ, CPU::T0, CPU::T3, "next");
+    p.word(CPU::AND, CPU::T1, CPU::T0, 1);
+    p.bra(Program::BEQ, CPU::T1, CPU::ZERO, "even");
+    p.reg(CPU::ADD, CPU::T2, CPU::T0, CPU::T0);
+    p.reg(CPU::ADD, CPU::T0, CPU::T2, CPU::T0);
+    p.byte(CPU::ADD, CPU::T0, CPU::T0, 1);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, 1);
+    p.bra(Program::ALWAYS, CPU::ZERO, CPU::ZERO, "inner");
+    p.label("even");
+    p.byte(CPU::LSR, CPU::T0, CPU::T0, 1);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, 1);
+    p.bra(Program::ALWAYS, CPU::ZERO, CPU::ZERO, "inner");
+    p.label("next");
+    p.byte(CPU::ADD, CPU::S0, CPU::S0, -1);
+    p.bra(Program::BNE, CPU::S0, CPU::ZERO, "outer");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Counts the set bits of 1..0xFFFF into a0 one bit at a time, repeatedly.
+Program popcount(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::S0, CPU::ZERO, 0xFFFF);
+    p.label("outer");
+    p.reg(CPU::XOR, CPU::T0, CPU::ZERO, CPU::S0);
+    p.label("bits");
+    p.bra(Program::BEQ, CPU::T0, CPU::ZERO, "next");
+    p.word(CPU::AND, CPU::T1, CPU::T0, 1);
+    p.bra(Program::BEQ, CPU::T1, CPU::ZERO, "zero");
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, 1);
+    p.label("zero");
+    p.byte(CPU::LSR, CPU::T0, CPU::T0, 1);
+    p.bra(Program::ALWAYS, CPU::ZERO, CPU::ZERO, "bits");
+    p.label("next");
+    p.byte(CPU::ADD, CPU::S0, CPU::S0, -1);
+    p.bra(Program::BNE, CPU::S0, CPU::ZERO, "outer");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Scrambles the input in a1 with every number from 0xFFFF down to 1, repeatedly. No branch
+// depends on the input, so instances with different inputs never diverge.
+Program scramble(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.label("repeat");
+    p.word(CPU::XOR, CPU::S0, CPU::ZERO, 0xFFFF);
+    p.label("loop");
+    p.byte(CPU::LSL, CPU::T0, CPU::A1, 3);
+    p.reg(CPU::XOR, CPU::A1, CPU::A1, CPU::T0);
+    p.reg(CPU::ADD, CPU::A1, CPU::A1, CPU::S0);
+    p.byte(CPU::ASR, CPU::T1, CPU::A1, 5);
+    p.reg(CPU::XOR, CPU::A1, CPU::A1, CPU::T1);
+    p.byte(CPU::ADD, CPU::S0, CPU::S0, -1);
+    p.bra(Program::BNE, CPU::S0, CPU::ZERO, "loop");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+// Sums the Collatz trajectory lengths of 1..a1 into a0, repeatedly. Instances with different
+// inputs take different branches all the time.
+Program collatz_sweep(uint16_t repeat)
+{
+    Program p;
+    p.word(CPU::XOR, CPU::S1, CPU::ZERO, repeat);
+    p.byte(CPU::ADD, CPU::T3, CPU::ZERO, 1);
+    p.label("repeat");
+    p.reg(CPU::XOR, CPU::S0, CPU::ZERO, CPU::A1);
+    p.label("outer");
+    p.reg(CPU::XOR, CPU::T0, CPU::ZERO, CPU::S0);
+    p.label("inner");
+    p.bra(Program::BEQ, CPU::T0, CPU::T3, "next");
+    p.word(CPU::AND, CPU::T1, CPU::T0, 1);
+    p.bra(Program::BEQ, CPU::T1, CPU::ZERO, "even");
+    p.reg(CPU::ADD, CPU::T2, CPU::T0, CPU::T0);
+    p.reg(CPU::ADD, CPU::T0, CPU::T2, CPU::T0);
+    p.byte(CPU::ADD, CPU::T0, CPU::T0, 1);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, 1);
+    p.bra(Program::ALWAYS, CPU::ZERO, CPU::ZERO, "inner");
+    p.label("even");
+    p.byte(CPU::LSR, CPU::T0, CPU::T0, 1);
+    p.byte(CPU::ADD, CPU::A0, CPU::A0, 1);
+    p.bra(Program::ALWAYS, CPU::ZERO, CPU::ZERO, "inner");
+    p.label("next");
+    p.byte(CPU::ADD, CPU::S0, CPU::S0, -1);
+    p.bra(Program::BNE, CPU::S0, CPU::ZERO, "outer");
+    p.byte(CPU::ADD, CPU::S1, CPU::S1, -1);
+    p.bra(Program::BNE, CPU::S1, CPU::ZERO, "repeat");
+    p.halt();
+    return p;
+}
+
+struct Result
+{
+    double seconds;
+    uint64_t cycles;
+    uint64_t instructions;
+    std::array<uint16_t, 16> registers;
+};
+
+Result run(const std::vector<uint8_t>& image, CPU::Engine engine)
+{
+    CPU cpu;
+    cpu.load_memory(image, 0);
+    auto start = std::chrono::steady_clock::now();
+    cpu.run(std::numeric_limits<uint64_t>::max(), engine);
+    auto end = std::chrono::steady_clock::now();
+    return { std::chrono::duration<double>(end - start).count(), cpu.cycles(), cpu.instructions(), cpu.registers() };
+}
+
+// Mean of samples and the half width of its 95% confidence interval (from Student's t).
+std::pair<double, double> mean_interval(const std::vector<double>& samples)
+{
+    static const double t[30] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    double mean = 0;
+    for (double sample : samples)
+        mean += sample / samples.size();
+    if (samples.size() < 2)
+        return { mean, 0 };
+    double variance = 0;
+    for (double sample : samples)
+        variance += (sample - mean) * (sample - mean) / (samples.size() - 1);
+    size_t freedom = samples.size() - 1;
+    return { mean, (freedom <= 30 ? t[freedom - 1] : 1.96) * std::sqrt(variance / samples.size()) };
+}
+
+// Value of a field in a line of results, as main() writes them. Empty if it's missing.
+std::string json_field(const std::string& line, const std::string& name)
+{
+    size_t start = line.find('"' + name + "\":");
+    if (start == std::string::npos)
+        return "";
+    start += name.size() + 3;
+    if (line[start] == '"')
+        return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+void usage()
+{
+    std::cout << "Usage: ./bench [OPTIONS]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --runs N          Run each kernel N times on each engine (default 5).\n";
+    std::cout << "  --output FILE     Write the results to FILE, a JSON line per kernel and engine.\n";
+    std::cout << "  --baseline FILE   Compare with results written by --output, and fail if any is\n"
+                 "                    slower by more than the threshold (between the nearest ends of\n"
+                 "                    the 95% confidence intervals).\n";
+    std::cout << "  --threshold PCT   Slowdown that counts as a regression (default 5).\n";
+}
+
+const double SAMPLE_SECONDS = 0.05;
+
+int main(int argc, char** argv)
+{
+    size_t runs = 5;
+    const char* output = nullptr;
+    const char* baseline = nullptr;
+    double threshold = 5;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc)
+            runs = std::max(1ul, std::stoul(argv[++i]));
+        else if (arg == "--output" && i + 1 < argc)
+            output = argv[++i];
+        else if (arg == "--baseline" && i + 1 < argc)
+            baseline = argv[++i];
+        else if (arg == "--threshold" && i + 1 < argc)
+            threshold = std::stod(argv[++i]);
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    // MIPS and its confidence interval by kernel and engine.
+    std::map<std::pair<std::string, std::string>, std::pair<double, double>> expected;
+    if (baseline)
+    {
+        std::ifstream file(baseline);
+        if (!file)
+        {
+            std::cout << "Can't open " << baseline << ".\n";
+            return 2;
+        }
+        for (std::string line; std::getline(file, line);)
+        {
+            std::string mips = json_field(line, "mips");
+            std::string interval = json_field(line, "mips_ci95");
+            if (!mips.empty())
+                expected[{ json_field(line, "kernel"), json_field(line, "engine") }] = { std::stod(mips), interval.empty() ? 0 : std::stod(interval) };
+        }
+    }
+    std::ofstream results;
+    if (output)
+    {
+        results.open(output);
+        if (!results)
+        {
+            std::cout << "Can't create " << output << ".\n";
+            return 2;
+        }
+    }
+
+    const std::vector<std::pair<std::string, Program>> kernels = {
+        { "fibonacci", fibonacci(60000) },
+        { "stack", stack(100) },
+        { "copy", copy(600) },
+        { "shifts", shifts(16) },
+        { "collatz", collatz(30) },
+        { "popcount", popcount(2) },
+    };
+    const std::vector<std::pair<std::string, CPU::Engine>> engines = {
+        { "micro", CPU::MICRO },
+        { "fast", CPU::FAST },
+        { "predecoded", CPU::PREDECODED },
+        { "threaded", CPU::THREADED },
+        { "blocks", CPU::BLOCKS },
+        { "jit", CPU::JIT },
+    };
+
+    int status = 0;
+    size_t regressions = 0;
+    std::cout << std::left << std::setw(10) << "kernel" << std::setw(12) << "engine" << std::right
+              << std::setw(12) << "Mcycles/s" << std::setw(9) << "+-" << std::setw(10) << "MIPS"
+              << std::setw(8) << "+-" << std::setw(10) << "speedup" << (baseline ? "  vs baseline" : "") << '\n';
+    for (const auto& [kernel, program] : kernels)
+    {
+        std::vector<uint8_t> image = program.image();
+        Result reference = run(image, CPU::MICRO);
+        // Samples of every engine are taken in turn, so that drift in the speed of the machine
+        // spreads over all of them.
+        std::vector<std::vector<double>> mcycles(engines.size()), mips(engines.size());
+        for (size_t i = 0; i < runs; ++i)
+        {
+            for (size_t e = 0; e < engines.size(); ++e)
+            { // A sample runs the kernel as many times as fit in SAMPLE_SECONDS, so fast engines aren't timing noise.
+                double seconds = 0;
+                uint64_t cycles = 0, instructions = 0;
+                do
+                {
+                    Result result = run(image, engines[e].second);
+                    if (result.cycles != reference.cycles || result.registers != reference.registers)
+                    {
+                        std::cout << kernel << ": " << engines[e].first << " doesn't match the micro engine.\n";
+                        status = 1;
+                    }
+                    seconds += result.seconds;
+                    cycles += result.cycles;
+                    instructions += result.instructions;
+                } while (seconds < SAMPLE_SECONDS);
+                mcycles[e].push_back(cycles / seconds / 1e6);
+                mips[e].push_back(instructions / seconds / 1e6);
+            }
+        }
+
+        double micro = mean_interval(mips[0]).first;
+        for (size_t e = 0; e < engines.size(); ++e)
+        {
+            const std::string& name = engines[e].first;
+            auto [cycles_mean, cycles_interval] = mean_interval(mcycles[e]);
+            auto [mips_mean, mips_interval] = mean_interval(mips[e]);
+            std::cout << std::left << std::setw(10) << kernel << std::setw(12) << name << std::right << std::fixed
+                      << std::setprecision(1) << std::setw(12) << cycles_mean << std::setw(9) << cycles_interval
+                      << std::setw(10) << mips_mean << std::setw(8) << mips_interval
+                      << std::setw(9) << mips_mean / micro << 'x';
+            auto before = expected.find({ kernel, name });
+            if (before != expected.end())
+            { // Only a regression if the confidence intervals are further apart than the threshold.
+                auto [before_mean, before_interval] = before->second;
+                double change = (mips_mean / before_mean - 1) * 100;
+                std::cout << std::showpos << std::setw(12) << change << '%' << std::noshowpos;
+                if ((1 - (mips_mean + mips_interval) / (before_mean - before_interval)) * 100 > threshold)
+                {
+                    std::cout << "  REGRESSION";
+                    ++regressions;
+                }
+            }
+            std::cout << '\n';
+
+            if (output)
+            {
+                results << std::fixed << std::setprecision(2) << "{\"kernel\":\"" << kernel << "\",\"engine\":\"" << name
+                        << "\",\"runs\":" << runs << ",\"cycles\":" << reference.cycles
+                        << ",\"instructions\":" << reference.instructions << ",\"mcycles_per_s\":" << cycles_mean
+                        << ",\"mcycles_per_s_ci95\":" << cycles_interval << ",\"mips\":" << mips_mean
+                        << ",\"mips_ci95\":" << mips_interval << "}\n";
+            }
+        }
+    }
+    if (baseline)
+    {
+        std::cout << regressions << " regressions of more than " << threshold << "% against " << baseline << ".\n";
+        if (regressions)
+            status = 1;
+    }
+
+    // Parameter sweeps: the same program with a different a1 in every instance, one instance at
+    // a time or all of them in lockstep.
+    const std::vector<std::pair<std::string, Program>> sweeps = {
+        { "scramble", scramble(2) },
+        { "collatz", collatz_sweep(4) },
+    };
+    const size_t instances = 4 * Lockstep::LANES;
+    std::cout << '\n' << std::left << std::setw(10) << "sweep" << std::setw(12) << "engine"
+              << std::right << std::setw(10) << "seconds" << std::setw(12) << "Mcycles/s"
+              << std::setw(10) << "lanes" << std::setw(10) << "speedup" << '\n';
+    for (const auto& [kernel, program] : sweeps)
+    {
+        std::vector<uint8_t> image = program.image();
+        std::vector<CPU> reference(instances);
+        std::vector<CPU> lanes(instances);
+        std::vector<CPU*> pointers;
+        for (size_t i = 0; i < instances; ++i)
+        {
+            for (CPU* cpu : { &reference[i], &lanes[i] })
+            {
+                cpu->load_memory(image, 0);
+                cpu->set_register(CPU::A1, 600 + i);
+            }
+            pointers.push_back(&lanes[i]);
+        }
+
+        uint64_t cycles = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (CPU& cpu : reference)
+        {
+            cpu.run(std::numeric_limits<uint64_t>::max(), CPU::THREADED);
+            cycles += cpu.cycles();
+        }
+        std::chrono::duration<double> threaded = std::chrono::steady_clock::now() - start;
+
+        Lockstep lockstep;
+        start = std::chrono::steady_clock::now();
+        lockstep.run(pointers, std::numeric_limits<uint64_t>::max());
+        std::chrono::duration<double> vector = std::chrono::steady_clock::now() - start;
+
+        for (size_t i = 0; i < instances; ++i)
+        {
+            if (!lanes[i].same_state(reference[i]))
+            {
+                std::cout << kernel << ": lockstep instance " << i << " doesn't match the threaded engine.\n";
+                status = 1;
+            }
+        }
+        std::cout << std::left << std::setw(10) << kernel << std::setw(12) << "threaded" << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(10) << threaded.count()
+                  << std::setprecision(1) << std::setw(12) << cycles / threaded.count() / 1e6
+                  << std::setw(10) << 1.0 << std::setw(9) << 1.0 << "x\n";
+        std::cout << std::left << std::setw(10) << kernel << std::setw(12) << "lockstep" << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(10) << vector.count()
+                  << std::setprecision(1) << std::setw(12) << cycles / vector.count() / 1e6
+                  << std::setw(10) << lockstep.occupancy() << std::setw(9) << threaded / vector << "x\n";
+    }
+    return status;
+}
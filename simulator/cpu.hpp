@@ -0,0 +1,3097 @@
+#pragma once
+
+#include "device.hpp"
+#include "jit.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <vector>
+
+// Labels as values (a GCC extension that clang supports too) let every handler of the threaded
+// engine jump straight to the next one. Define SIM_NO_COMPUTED_GOTO to use the portable switch.
+#if defined(__GNUC__) && !defined(SIM_NO_COMPUTED_GOTO)
+#define SIM_COMPUTED_GOTO
+#endif
+
+// GCC merges the copies of the dispatch at the end of the handlers back into one (cross-jumping),
+// which leaves the host a single indirect jump to predict again.
+#if defined(__GNUC__) && !defined(__clang__)
+#define SIM_SEPARATE_DISPATCH [[gnu::optimize("no-crossjumping")]]
+#else
+#define SIM_SEPARATE_DISPATCH
+#endif
+
+static_assert(std::numeric_limits<unsigned char>::digits == 8, "silly platform");
+
+class CPU
+{
+    friend class Lockstep;
+    friend class Tracer;
+    friend class Profiler;
+
+public:
+    enum Opcode
+    {
+        ADD, // 0
+        SUB, // 1
+        RO0, // 2, reserved
+        RO1, // 3, reserved
+        RO2, // 4, reserved
+        RO3, // 5, reserved
+        RO4, // 6, reserved
+        LSL, // 7
+        LSR, // 8
+        ASR, // 9
+        XOR, // A
+        OR,  // B
+        AND, // C
+        BRA, // D
+        JMP, // E
+        MEM, // F
+    };
+
+    enum Register
+    {
+        ZERO, // Hard-wired zero
+        RA, // Return address
+        SP, // Stack pointer
+        RR0, // Reserved
+
+        A0, // Arguments (callee saved)
+        A1,
+        A2,
+        A3,
+
+        T0, // Temporary (caller saved)
+        T1,
+        T2,
+        T3,
+
+        S0, // Saved (callee saved)
+        S1,
+        S2,
+        S3
+    };
+
+    enum Engine
+    {
+        MICRO, // Cycle by cycle, through update()
+        FAST, // Instruction by instruction, through step()
+        PREDECODED, // Instruction by instruction, from the predecode cache
+        THREADED, // Like PREDECODED, with threaded dispatch between per-opcode handlers
+        BLOCKS, // Whole basic blocks at a time, from the translation cache
+        JIT, // Translated blocks compiled to native code (x86-64 Linux only, BLOCKS elsewhere)
+    };
+#ifdef SIM_STATS
+    static_assert(JIT + 1 == Stats::ENGINES);
+#endif
+
+    // Why the last run() or step() stopped short, see stop().
+    enum Stop
+    {
+        NO_STOP,
+        BREAKPOINT, // Before the instruction at a breakpoint whose condition holds.
+        WATCHPOINT, // After an instruction that accessed a watched byte.
+    };
+
+    // Accesses a watchpoint stops on.
+    enum Watch : uint8_t
+    {
+        WATCH_READ = 1,
+        WATCH_WRITE = 2,
+    };
+
+    // Condition of a breakpoint: a register compared (unsigned) with a value.
+    struct Condition
+    {
+        enum Compare : uint8_t
+        {
+            ALWAYS,
+            EQ,
+            NE,
+            LT,
+            LE,
+            GT,
+            GE,
+        };
+
+        Compare compare = ALWAYS;
+        uint8_t reg = 0;
+        uint16_t value = 0;
+
+        bool holds(const std::array<uint16_t, 16>& registers) const
+        {
+            uint16_t left = reg & 0xF ? registers[reg & 0xF] : 0; // update() leaves junk in r0.
+            switch (compare)
+            {
+            case EQ: return left == value;
+            case NE: return left != value;
+            case LT: return left < value;
+            case LE: return left <= value;
+            case GT: return left > value;
+            case GE: return left >= value;
+            default: return true;
+            }
+        }
+    };
+
+    struct Decoded;
+
+    // Executes a decoded instruction. next is the address right after it, the return value is the
+    // address of the instruction that follows.
+    using Handler = uint16_t (*)(CPU& cpu, const Decoded& instruction, uint16_t next);
+
+    // An instruction with its fields split out and its immediate already fetched.
+    struct Decoded
+    {
+        Handler handler;
+        uint16_t immediate; // Sign extended if the CPU would sign extend it.
+        uint8_t opcode;
+        uint8_t dest;
+        uint8_t left;
+        uint8_t right;
+        uint8_t length; // In bytes. 0 marks an entry of the predecode cache that must be decoded again.
+        uint8_t cycles; // Cycles update() takes to execute it.
+    };
+
+    static const size_t MEM_SIZE = 65536;
+    static const uint16_t RESET_VECTOR = 0xFFFD;
+    static const uint16_t INTERRUPT_VECTOR = 0xFFFB; // Word holding the address of the interrupt handler.
+    static const uint8_t MIN_INSTRUCTION_CYCLES = 5; // But the reset sequence, which takes 4.
+    static const uint8_t MAX_INSTRUCTION_CYCLES = 6;
+    static const size_t MAX_BLOCK_INSTRUCTIONS = 64;
+    static const size_t PAGE_SIZE = 256;
+
+    // Everything needed to carry on from a point of a run: memory, registers, every field of the
+    // decoder (so a snapshot can be taken in the middle of an instruction) and the statistics.
+    // Memory is kept in pages that are shared, read only, with the CPU and the other snapshots
+    // taken from it, so each snapshot only copies the pages written since the previous one.
+    class Snapshot
+    {
+        friend class CPU;
+
+        using Page = std::array<uint8_t, PAGE_SIZE>;
+
+        std::array<std::shared_ptr<const Page>, MEM_SIZE / PAGE_SIZE> _pages;
+        std::bitset<MEM_SIZE / PAGE_SIZE> _written; // Since the snapshot (or restore) before.
+        std::array<uint16_t, 16> _register{};
+        uint16_t _bus = 0;
+        uint16_t _address = 0;
+        uint16_t _temp_pc = 0;
+        uint16_t _alu_left = 0;
+        uint16_t _alu_right = 0;
+        uint16_t _alu_result = 0;
+        uint8_t _cycle = 0;
+        uint8_t _opcode = 0;
+        uint8_t _dest = 0;
+        uint8_t _left = 0;
+        uint8_t _right = 0;
+        uint8_t _index = 0;
+        bool _inc_addr = false;
+        bool _load_imm = false;
+        bool _load_word = false;
+        bool _load_high = false;
+        bool _imm_to_idx = false;
+        bool _take_branch = false;
+        uint64_t _cycles = 0;
+        uint64_t _instructions = 0;
+        bool _halted = false;
+
+    public:
+        uint64_t cycles() const
+        {
+            return _cycles;
+        }
+
+        uint64_t instructions() const
+        {
+            return _instructions;
+        }
+
+        // Pages the CPU wrote between the snapshot (or restore) before and this one, even if it
+        // wrote what was there already.
+        const std::bitset<MEM_SIZE / PAGE_SIZE>& written_pages() const
+        {
+            return _written;
+        }
+
+        // Bytes of memory this snapshot holds that previous (an earlier snapshot of the same CPU,
+        // or nullptr) doesn't. Pages of zeros are free.
+        size_t bytes_since(const Snapshot* previous) const
+        {
+            size_t bytes = 0;
+            for (size_t page = 0; page < _pages.size(); ++page)
+            {
+                if (_pages[page] != _zero_page() && (!previous || _pages[page] != previous->_pages[page]))
+                    bytes += sizeof(Page);
+            }
+            return bytes;
+        }
+    };
+
+private:
+    // Data
+    std::unique_ptr<uint8_t[]> _memory;
+    using Registers = std::array<uint16_t, 16>;
+    Registers _register;
+    std::unique_ptr<Decoded[]> _decoded; // Predecode cache indexed by address, allocated on first use.
+
+    static const uint8_t _AT_BREAKPOINT = 0x10; // Added to the opcode of predecode cache entries at a breakpoint.
+
+    // Kinds of micro-op in a translated block. ALU operations keep their opcode, the other
+    // instructions get one kind per form so that executing them doesn't need to look at flags.
+    enum _MicroKind : uint8_t
+    {
+        UOP_RESERVED = 2, // Any of RO0-RO4
+        UOP_BRA = 13,
+        UOP_LOAD_BYTE = 16,
+        UOP_LOAD_SBYTE,
+        UOP_LOAD_WORD,
+        UOP_STORE_BYTE,
+        UOP_STORE_WORD,
+        UOP_JMP_REGISTER,
+        UOP_JMP_OFFSET,
+        UOP_JMP_WORD,
+    };
+
+    struct _MicroOp
+    {
+        uint16_t immediate; // 0 for ALU operations on registers, so the right operand is always r[right] + immediate.
+        uint8_t kind;
+        uint8_t dest;
+        uint8_t left;
+        uint8_t right;
+        uint8_t length;
+        uint8_t cycles;
+    };
+
+    // A straight run of instructions ending at a branch or a jump (or after MAX_BLOCK_INSTRUCTIONS,
+    // or before a breakpoint).
+    struct _Block
+    {
+        std::vector<_MicroOp> ops;
+        uint64_t cycles = 0; // Sum of the cycles of every instruction.
+        uint16_t start = 0;
+        uint16_t length = 0; // In bytes, may wrap around the end of memory.
+        bool valid = true; // Cleared when one of its bytes is written.
+        bool delay_loop = false; // An ADD or SUB of an immediate and a BNE back to it, see _skip_delay_loop().
+        _Block* exits[2] = {}; // Chained successors: fall through or jump target, and branch target.
+        uint8_t* native = nullptr; // Compiled code, if the JIT compiled the block.
+        std::vector<std::pair<uint8_t*, uint8_t*>> links; // Jumps the JIT patched to native, and where they went before.
+    };
+
+    // The cycles of a block at a breakpoint, which has no instructions: it never fits in what is
+    // left to run, and the engines check the breakpoint when they get to it.
+    static const uint64_t _BREAKPOINT_BLOCK_CYCLES = std::numeric_limits<uint64_t>::max() / 2;
+
+    std::vector<std::unique_ptr<_Block>> _blocks; // Owns every block, valid or not, until the next flush.
+    std::unique_ptr<_Block*[]> _block_at; // Valid block starting at each address, allocated on first use.
+    std::array<std::vector<_Block*>, MEM_SIZE / 256> _page_blocks; // Blocks overlapping each 256 byte page.
+    std::array<bool, MEM_SIZE / 256> _code_page{}; // Was anything on the page ever decoded or translated?
+
+    // Memory is the same as these pages of the last snapshot taken or restored, except on the
+    // dirty pages.
+    std::array<std::shared_ptr<const Snapshot::Page>, MEM_SIZE / PAGE_SIZE> _base;
+    std::array<bool, MEM_SIZE / PAGE_SIZE> _dirty_page;
+    size_t _invalid_blocks = 0;
+
+    // Devices on the bus. Loads and stores check _slow_page first, a single lookup, and only go
+    // through _mapping (and the watchpoints) if it's set.
+    struct _Mapping
+    {
+        Device* device = nullptr;
+        uint16_t base = 0; // Address of the device's first page.
+    };
+    std::vector<std::shared_ptr<Device>> _devices;
+    std::array<_Mapping, MEM_SIZE / PAGE_SIZE> _mapping{};
+    std::array<bool, MEM_SIZE / PAGE_SIZE> _slow_page{}; // Has a device or a watchpoint, or the next page has one (a word can reach into it).
+    bool _any_slow_page = false; // Compiled code only checks _slow_page if so.
+
+    // Breakpoints and watchpoints. Only the pages flagged here look them up: the engines find
+    // breakpoints through their caches (see _predecoded() and _translate()), watchpoints take the
+    // slow path of loads and stores.
+    std::map<uint16_t, Condition> _breakpoints;
+    std::map<uint16_t, uint8_t> _watchpoints; // Watch flags of each byte.
+    std::array<bool, MEM_SIZE / PAGE_SIZE> _break_page{};
+    std::array<uint16_t, MEM_SIZE / PAGE_SIZE> _watched_bytes{};
+    bool _watch_hit = false; // A watched byte was accessed by the instruction running.
+    uint16_t _watched = 0; // The byte.
+    Stop _stop = NO_STOP;
+
+    // Events of the devices. The engines don't look at them until _cycles reaches _limit, the
+    // next event or the end of the run, and update() only when an instruction ends.
+    Scheduler _scheduler;
+    uint64_t _next_event = Scheduler::NEVER; // _scheduler.next(), kept up to date after device accesses.
+    uint64_t _limit = 0; // Engines stop at the first instruction boundary at or after it.
+
+#ifdef SIM_JIT
+    // Why native code returned to the dispatcher.
+    enum _JitExit : uint32_t
+    {
+        JIT_LINK, // Jumped to a block that isn't compiled yet, through a jump that can be patched to it.
+        JIT_INDIRECT, // Jumped through a register to an address that isn't compiled yet.
+        JIT_BUDGET, // The next block doesn't fit in the cycles left.
+        JIT_INTERPRET, // Reached a store to a page with code on it or an access to a slow page, which the interpreter has to do.
+        JIT_BREAKPOINT, // Reached a block that starts at a breakpoint, which the dispatcher checks.
+        JIT_HALT, // Took a halting branch.
+        JIT_DELAY_LOOP, // Took the branch back to the start of a delay loop, which the interpreter skips.
+    };
+
+    // State of a native run. The trampoline copies it to the host stack, where the compiled code
+    // finds it through rsp, and the epilogue copies it back.
+    struct _JitFrame
+    {
+        _JitFrame* self;
+        uint8_t* memory;
+        uint8_t* const* entries;
+        const bool* code_page;
+        bool* dirty_page;
+        const bool* slow_page;
+        uint64_t budget; // Cycles left.
+        uint64_t instructions;
+        uint8_t* link; // The jump a JIT_LINK exit went through.
+        uint32_t pc; // Address of the next instruction.
+        uint32_t reason;
+        uint16_t registers[16]; // Guest registers that aren't kept in host registers, and r0.
+        uint16_t alu_result;
+    };
+
+    struct _Jit
+    {
+        X64 code;
+        std::unique_ptr<uint8_t*[]> entries; // Native code of the valid block at each address.
+        void (*enter)(_JitFrame* frame, const uint8_t* entry) = nullptr;
+        uint8_t* epilogue = nullptr;
+        uint8_t* blocks = nullptr; // Compiled blocks start here.
+    };
+
+    static const size_t _JIT_CODE_SIZE = 4 << 20;
+    static const size_t _JIT_BLOCK_SPACE = 32 << 10; // More than the largest block compiles to.
+    static const uint8_t _JIT_PINNED_REGISTERS = 12; // r1-r11 live in host registers, r12-r15 in the frame.
+
+    // Host registers of guest registers r1-r11. The scratch registers are rax, rcx and rdx, r15
+    // points to guest memory.
+    static constexpr X64::Reg _JIT_PINNED[_JIT_PINNED_REGISTERS] = {
+        X64::RAX, // r0 is never read from a register.
+        X64::RBX, X64::RSI, X64::RDI, X64::RBP, X64::R8, X64::R9,
+        X64::R10, X64::R11, X64::R12, X64::R13, X64::R14,
+    };
+
+    std::unique_ptr<_Jit> _jit; // Allocated on first use.
+    bool _jit_unavailable = false; // Executable memory couldn't be allocated.
+#endif
+    uint16_t _bus = 0; // Common bus, reset to 0 every time it's read.
+    uint16_t _address = RESET_VECTOR; // The current memory address reads/writes will go to.
+    uint16_t _temp_pc = 0; // Used to save the next instruction's address when performing a load/store.
+    uint16_t _alu_left = 0; // ALU current left operand.
+    uint16_t _alu_right = 0; // ALU current right operand.
+    uint16_t _alu_result = 0; // ALU result.
+
+    // Decoder stuff
+    uint8_t _cycle = 2; // The current cycle.
+    uint8_t _opcode = JMP; // Current opcode.
+    uint8_t _dest = 0; // Destination register, or branch flags.
+    uint8_t _left = 0; // Left operand register, or load/store flags.
+    uint8_t _right = 0;  // Right operand register, or 0 to signify immediate.
+    uint8_t _index = 0; // If !_inc_addr, this is added (sign extended) to the effective address and reset to 0 before the next cycle.
+    bool _inc_addr = false; // Increment address before next cycle (overrides _index, making it wait one more cycle).
+    bool _load_imm = true; // Are we loading an immediate?
+    bool _load_word = true; // If we're loading an immediate, it is a word or a byte?
+    bool _load_high = true; // If we're loading a word, do we still have to load the high byte?
+    bool _imm_to_idx = false; // Will this immediate go to _index or to _alu_right?
+    bool _take_branch = false; // Are we going to take the upcoming branch?
+
+    // Statistics
+    uint64_t _cycles = 0; // Number of cycles executed since reset.
+    uint64_t _instructions = 0; // Number of instructions retired since reset (the reset jump counts as one).
+    bool _halted = false; // Did the last instruction branch to itself (bra 0x1 r0 r0 -3)?
+
+    enum _Flags : uint8_t
+    {
+        BRA_NOT = 0x1,
+        BRA_LT = 0x2,
+        BRA_U = 0x4,
+        BRA_EQ = 0x8,
+        
+        MEM_LOAD = 0x1,
+        MEM_WORD = 0x2,
+        MEM_SEX = 0x4,
+    };
+
+    // Performs arithmetic right shift by n bits on x.
+    // The 4 highest bits of n are discarded, so the shift count is within 0-15.
+    static uint16_t _asr(uint16_t x, uint8_t n)
+    {
+        n &= 0x000F;
+        if (n == 0)
+            return x;
+
+        bool neg = x & 0x8000;
+        x >>= n;
+        if (!neg)
+            return x;
+            
+        uint16_t pad = 0xFFFF;
+        pad <<= 16 - n;
+        x |= pad;
+        return x;
+    }
+
+    // Read the word currently on the bus. This will reset the bus to 0.
+    // If sex is true, the value will be sign extended according to the low byte. The high byte is ignored.
+    uint16_t _read_bus(bool sex)
+    {
+        uint16_t value = _bus;
+        _bus = 0;
+        if (sex && value & 0x0080)
+            value |= 0xFF00;
+        return value;
+    }
+
+    // Overwrite the value on the bus.
+    void _write_bus(uint16_t value)
+    {
+        _bus = value;
+    }
+
+    // Overwrite the low byte of the value on the bus.
+    void _write_bus_low(uint8_t value)
+    {
+        _bus &= 0xFF00;
+        _bus |= value;
+    }
+
+    // Overwrite the high byte of the value on the bus.
+    void _write_bus_high(uint8_t value)
+    {
+        _bus &= 0x00FF;
+        _bus |= (uint16_t)value << 8;
+    }
+
+    void _decode(uint16_t instruction)
+    {
+        _opcode = instruction >> 12;
+        _dest = (instruction >> 8) & 0xF;
+        _left = (instruction >> 4) & 0xF;
+        _right = instruction & 0xF;
+
+        _load_imm = false;
+        _load_word = false;
+        _imm_to_idx = false;
+        switch (_opcode)
+        {
+        case SUB:
+            _load_imm = _right == 0;
+            _load_word = true;
+            break;
+        case ADD:
+        case LSL:
+        case LSR:
+        case ASR:
+            _load_imm = _right == 0;
+            _load_word = false;
+            break;
+        case XOR:
+        case OR:
+        case AND:
+            _load_imm = _right == 0;
+            _load_word = true;
+            break;
+        case JMP:
+            _load_imm = _right == 0 || _left != 0;
+            _load_word = _left == 0;
+            _imm_to_idx = _left != 0;
+            break;
+        case BRA:
+            _load_imm = false;
+            break;
+        case MEM:
+            _load_imm = true;
+            _load_word = false;
+            _imm_to_idx = true;
+            break;
+        default:
+            break;
+        }
+        _load_high = true;
+    }
+
+    void _test_branch()
+    {
+        _take_branch = _branch_taken(_dest, _alu_left, _alu_right);
+    }
+
+    void _execute_alu()
+    {
+        switch (_opcode)
+        {
+        case ADD:
+            _alu_result = _alu_left + _alu_right;
+            break;
+        case SUB:
+            _alu_result = _alu_left - _alu_right;
+            break;
+        case LSL:
+            _alu_result = _alu_left << (_alu_right & 0xF);
+            break;
+        case LSR:
+            _alu_result = _alu_left >> (_alu_right & 0xF);
+            break;
+        case ASR:
+            _alu_result = _asr(_alu_left, _alu_right);
+            break;
+        case XOR:
+            _alu_result = _alu_left ^ _alu_right;
+            break;
+        case OR:
+            _alu_result = _alu_left | _alu_right;
+            break;
+        case AND:
+            _alu_result = _alu_left & _alu_right;
+            break;
+        case BRA:
+            _test_branch();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void _load_immediate()
+    {
+        _inc_addr = true;
+        if (_load_word)
+        {
+            if (_load_high)
+            {
+                _write_bus_low(_memory[_address]);
+                _load_high = false;
+            }
+            else
+            {
+                _write_bus_high(_memory[_address]);
+                if (_imm_to_idx)
+                    _index = _read_bus(false);
+                else
+                    _alu_right = _read_bus(false);
+                ++_cycle;
+            }
+        }
+        else
+        {
+            _write_bus_low(_memory[_address]);
+            if (_imm_to_idx)
+                _index = _read_bus(false);
+            else
+                _alu_right = _read_bus(true);
+            ++_cycle;
+        }
+    }
+
+    void _load()
+    {
+        if (_left & MEM_WORD)
+        {
+            if (_load_high)
+            {
+                _inc_addr = true;
+                _write_bus_low(_read_byte(_address, _cycles));
+                _load_high = false;
+            }
+            else
+            {
+                _write_bus_high(_read_byte(_address, _cycles));
+                _register[_dest] = _read_bus(false);
+                _address = _temp_pc;
+                _cycle = 0;
+                SIM_COUNT(LOADS_WORD);
+            }
+        }
+        else
+        {
+            _write_bus_low(_read_byte(_address, _cycles));
+            _register[_dest] = _read_bus(_left & MEM_SEX);
+            _address = _temp_pc;
+            _cycle = 0;
+            SIM_COUNT(LOADS_BYTE);
+        }
+    }
+
+    void _store()
+    {
+        if (_left & MEM_WORD)
+        {
+            if (_load_high)
+            {
+                _inc_addr = true;
+                _write_bus_low(_register[_dest]);
+                _write_byte(_address, _read_bus(false), _cycles);
+                _load_high = false;
+            }
+            else
+            {
+                _write_bus_low(_register[_dest] >> 8);
+                _write_byte(_address, _read_bus(false), _cycles);
+                _address = _temp_pc;
+                _cycle = 0;
+                SIM_COUNT(STORES_WORD);
+            }
+        }
+        else
+        {
+            _write_bus_low(_register[_dest]);
+            _write_byte(_address, _read_bus(false), _cycles);
+            _address = _temp_pc;
+            _cycle = 0;
+            SIM_COUNT(STORES_BYTE);
+        }
+    }
+
+    // Every write to memory goes through here so that cached decodings of the bytes stay valid.
+    void _write_memory(uint16_t address, uint8_t value)
+    {
+        _memory[address] = value;
+        _dirty_page[address / PAGE_SIZE] = true;
+        if (_decoded)
+        { // The longest instruction is 4 bytes, so only the 4 that could start at or before address are stale.
+            for (uint16_t i = 0; i < 4; ++i)
+                _decoded[(uint16_t)(address - i)].length = 0;
+        }
+        if (_code_page[address >> 8])
+            _invalidate_blocks(address);
+    }
+
+    // A byte of a load or store, from or to the device on its page if there is one. cycle is
+    // when the access happens.
+    uint8_t _read_byte(uint16_t address, uint64_t cycle)
+    {
+        if (_slow_page[address >> 8]) [[unlikely]]
+            return _slow_read(address, cycle);
+        return _memory[address];
+    }
+
+    void _write_byte(uint16_t address, uint8_t value, uint64_t cycle)
+    {
+        if (_slow_page[address >> 8]) [[unlikely]]
+            _slow_write(address, value, cycle);
+        else
+            _write_memory(address, value);
+    }
+
+    [[gnu::noinline]] uint8_t _slow_read(uint16_t address, uint64_t cycle)
+    {
+        const _Mapping& mapping = _mapping[address >> 8];
+        uint8_t value;
+        if (mapping.device)
+        {
+            SIM_COUNT(DEVICE_READS);
+            value = mapping.device->read(address - mapping.base, cycle);
+            _device_accessed();
+        }
+        else
+        {
+            value = _memory[address];
+        }
+        _check_watchpoint(address, WATCH_READ);
+        return value;
+    }
+
+    [[gnu::noinline]] void _slow_write(uint16_t address, uint8_t value, uint64_t cycle)
+    {
+        const _Mapping& mapping = _mapping[address >> 8];
+        if (mapping.device)
+        {
+            SIM_COUNT(DEVICE_WRITES);
+            mapping.device->write(address - mapping.base, value, cycle);
+            _device_accessed();
+        }
+        else
+        {
+            _write_memory(address, value);
+        }
+        _check_watchpoint(address, WATCH_WRITE);
+    }
+
+    // The engine running stops at the end of an instruction that hit a watchpoint, and update()
+    // looks at it there, like at an event.
+    void _check_watchpoint(uint16_t address, uint8_t access)
+    {
+        if (!_watched_bytes[address >> 8])
+            return;
+        auto watchpoint = _watchpoints.find(address);
+        if (watchpoint == _watchpoints.end() || !(watchpoint->second & access))
+            return;
+        _watch_hit = true;
+        _watched = address;
+        _next_event = 0;
+        _limit = 0;
+    }
+
+    // When the engines have to stop for _events(): the next event, or right away after a
+    // watchpoint.
+    uint64_t _next_stop() const
+    {
+        return _watch_hit ? 0 : _scheduler.next();
+    }
+
+    // A device may have scheduled an event or changed the interrupts: the engine running stops
+    // in time for it.
+    void _device_accessed()
+    {
+        _next_event = _next_stop();
+        _limit = std::min(_limit, _next_event);
+    }
+
+    // At an instruction boundary at or after _next_event, before the instruction at pc: stops
+    // after a watchpoint, runs the events that are due and takes an interrupt if one can be
+    // taken, which costs no cycles (and stops if the handler starts at a breakpoint). Returns
+    // the address to carry on from.
+    [[gnu::noinline]] uint16_t _events(uint16_t pc)
+    {
+        if (_watch_hit)
+        {
+            _watch_hit = false;
+            _stop = WATCHPOINT;
+        }
+        _scheduler.run(_cycles);
+        if (_scheduler.interrupting())
+        {
+            _scheduler.enter(pc);
+            pc = _read_word(INTERRUPT_VECTOR);
+            _halted = false;
+            if (_break_page[pc >> 8])
+                _breakpoint_hit(pc);
+        }
+        _next_event = _scheduler.next();
+        return pc;
+    }
+
+    // Runs the events due between instructions where update() takes over, which only looks at
+    // them when an instruction ends: from the host (which may have used a device) or an engine.
+    void _catch_up_events()
+    {
+        _next_event = _next_stop();
+        if (_cycle == 0 && !_halted && _cycles >= _next_event)
+            _address = _events(_sync());
+    }
+
+    // A halted CPU spins on its branch, 6 cycles at a time, until an interrupt takes it away.
+    // If one can, skips the spinning up to each event until it does or max_cycles is reached.
+    // Returns true if it did, with cycles left to run.
+    bool _idle(uint64_t max_cycles)
+    {
+        const uint64_t spin = 6;
+        while (_halted && _cycle == 0 && _scheduler.can_interrupt())
+        {
+            if (_cycles < _next_event)
+            {
+                uint64_t spins = std::min((_next_event - _cycles + spin - 1) / spin, (max_cycles - std::min(max_cycles, _cycles)) / spin);
+                _cycles += spins * spin;
+                _instructions += spins;
+                if (_cycles < _next_event)
+                    return false;
+            }
+            _address = _events(_sync());
+        }
+        return !_halted && _cycles < max_cycles;
+    }
+
+    bool _breakpoint_at(uint16_t address) const
+    {
+        return _break_page[address >> 8] && _breakpoints.contains(address);
+    }
+
+    // Before the instruction at pc, which the engine found on a page with breakpoints: stops
+    // there if a breakpoint is there and its condition holds.
+    [[gnu::noinline]] bool _breakpoint_hit(uint16_t pc)
+    {
+        if (_stop) // A watchpoint the instruction before hit comes first.
+            return true;
+        auto breakpoint = _breakpoints.find(pc);
+        if (breakpoint == _breakpoints.end() || !breakpoint->second.holds(_register))
+            return false;
+        _stop = BREAKPOINT;
+        _limit = 0;
+        return true;
+    }
+
+    // The cached decodings and translations of address have to find out again whether there is
+    // a breakpoint on it.
+    void _breakpoint_changed(uint16_t address)
+    {
+        auto next = _breakpoints.lower_bound(address & 0xFF00);
+        _break_page[address >> 8] = next != _breakpoints.end() && next->first >> 8 == address >> 8;
+        if (_decoded)
+            _decoded[address].length = 0;
+        if (_block_at)
+            _invalidate_blocks(address);
+    }
+
+    void _mark_slow_pages()
+    {
+        auto slow = [&](size_t page) { return page < _mapping.size() && (_mapping[page].device || _watched_bytes[page]); };
+        for (size_t page = 0; page < _slow_page.size(); ++page)
+        {
+            _slow_page[page] = slow(page) || slow(page + 1);
+            if (_slow_page[page] && !_any_slow_page)
+            {
+                _any_slow_page = true;
+                if (_block_at)
+                    _flush_blocks(); // Compiled code only checks for slow pages if there are any.
+            }
+        }
+    }
+
+    // Whole loads and stores (flags as in MEM) on a page where _slow_page is set, for the
+    // engines that run whole instructions. start is the cycle count before the instruction.
+    [[gnu::noinline]] uint16_t _slow_load(uint8_t flags, uint16_t address, uint64_t start)
+    {
+        uint16_t value = _read_byte(address, start + 4);
+        if (flags & MEM_WORD)
+            return value | (uint16_t)_read_byte(address + 1, start + 5) << 8;
+        return flags & MEM_SEX ? (uint16_t)(int8_t)value : value;
+    }
+
+    [[gnu::noinline]] void _slow_store(uint8_t flags, uint16_t address, uint16_t value, uint64_t start)
+    {
+        _write_byte(address, value, start + 4);
+        if (flags & MEM_WORD)
+            _write_byte(address + 1, value >> 8, start + 5);
+    }
+
+    // Stops translated blocks that overlap address (or the length bytes from it, within its page)
+    // from being run or chained to again. They stay allocated (a store in the middle of one may
+    // be executing) until the next flush.
+    void _invalidate_blocks(uint16_t address, uint16_t length = 1)
+    {
+        for (_Block* block : _page_blocks[address >> 8])
+        {
+            bool overlaps = (uint16_t)(address - block->start) < block->length || (uint16_t)(block->start - address) < length;
+            if (block->valid && overlaps)
+            {
+                block->valid = false;
+                _block_at[block->start] = nullptr;
+                ++_invalid_blocks;
+#ifdef SIM_JIT
+                if (block->native)
+                { // Native code jumping to the block goes back through the dispatcher.
+                    _jit->entries[block->start] = nullptr;
+                    for (auto [rel32, stub] : block->links)
+                        X64::patch(rel32, stub);
+                }
+#endif
+            }
+        }
+    }
+
+    void _cycle_0()
+    {
+        _inc_addr = true;
+        _write_bus_low(_memory[_address]);
+        ++_cycle;
+    }
+
+    void _cycle_1()
+    {
+        _inc_addr = true;
+        _write_bus_high(_memory[_address]);
+        _decode(_read_bus(false));
+        ++_cycle;
+    }
+
+    void _cycle_2()
+    {
+        if (_load_imm)
+        {
+            _load_immediate();
+        }
+        else
+        {
+            _write_bus(_register[_right]);
+            _alu_right = _read_bus(false);
+            ++_cycle;
+        }
+    }
+
+    void _cycle_3()
+    {
+        if (_opcode <= BRA)
+        { // arithmetic or branch
+            _write_bus(_register[_left]);
+            _alu_left = _read_bus(false);
+            ++_cycle;
+        }
+        else if (_opcode == JMP)
+        {
+            _inc_addr = _imm_to_idx;
+            _write_bus(_address);
+            _register[_dest] = _read_bus(false);
+            ++_cycle;
+        }
+        else if (_opcode == MEM)
+        {
+            _temp_pc = _address;
+            _write_bus(_register[_right]);
+            _address = _read_bus(false);
+            ++_cycle;
+        }
+    }
+
+    void _cycle_4()
+    {
+        if (_opcode <= AND)
+        { // arithmetic
+            _execute_alu();
+            _write_bus(_alu_result);
+            _register[_dest] = _read_bus(false);
+            _cycle = 0;
+        }
+        else if (_opcode == BRA)
+        {
+            _inc_addr = true;
+            _write_bus_low(_memory[_address]);
+            _execute_alu();
+            ++_cycle;
+        }
+        else if (_opcode == JMP)
+        {
+            if (!_imm_to_idx)
+            {
+                _write_bus(_alu_right);
+                _address = _read_bus(false);
+            }
+            else
+            {
+                _write_bus(_register[_right]);
+                _address = _read_bus(false);
+            }
+            _cycle = 0;
+        }
+        else if (_opcode == MEM)
+        {
+            if (_left & MEM_LOAD)
+                _load();
+            else
+                _store();
+        }
+    }
+
+    void _cycle_5()
+    {
+        if (_opcode == BRA)
+        {
+            _halted = false;
+            if (_take_branch)
+            {
+                _index = _read_bus(false);
+                // A taken branch is 3 bytes long, so an offset of -3 lands on itself. Branches don't
+                // change any state, so the CPU will spin there forever.
+                _halted = (int8_t)_index == -3;
+            }
+            _cycle = 0;
+        }
+    }
+
+    // Reads the little endian word at address, wrapping around the end of memory.
+    uint16_t _read_word(uint16_t address) const
+    {
+        return _memory[address] | (uint16_t)_memory[(uint16_t)(address + 1)] << 8;
+    }
+
+    // Executes the instruction at pc as a whole and moves pc to the next instruction.
+    // Leaves registers, memory and _alu_result exactly as update() would after the instruction's
+    // last cycle, and returns the number of cycles update() would have taken (see cycles.txt).
+    // cycles is the cycle count before the instruction, for devices.
+    [[gnu::always_inline]] uint8_t _execute(uint16_t& pc, uint64_t cycles)
+    {
+        return _execute(_register, _alu_result, _halted, pc, cycles);
+    }
+
+    // Same, on copies of the registers, _alu_result and _halted that a run keeps in locals (see
+    // _run_fast()).
+    [[gnu::always_inline]] uint8_t _execute(Registers& registers, uint16_t& alu_result, bool& halted,
+        uint16_t& pc, uint64_t cycles)
+    {
+        registers[0] = 0;
+        uint16_t instruction = _read_word(pc);
+        pc += 2;
+        SIM_COUNT_OPCODE(instruction >> 12);
+        switch (instruction >> 12)
+        {
+        case ADD: return _execute<ADD>(registers, alu_result, halted, instruction, pc, cycles);
+        case SUB: return _execute<SUB>(registers, alu_result, halted, instruction, pc, cycles);
+        case LSL: return _execute<LSL>(registers, alu_result, halted, instruction, pc, cycles);
+        case LSR: return _execute<LSR>(registers, alu_result, halted, instruction, pc, cycles);
+        case ASR: return _execute<ASR>(registers, alu_result, halted, instruction, pc, cycles);
+        case XOR: return _execute<XOR>(registers, alu_result, halted, instruction, pc, cycles);
+        case OR:  return _execute<OR>(registers, alu_result, halted, instruction, pc, cycles);
+        case AND: return _execute<AND>(registers, alu_result, halted, instruction, pc, cycles);
+        case BRA: return _execute<BRA>(registers, alu_result, halted, instruction, pc, cycles);
+        case JMP: return _execute<JMP>(registers, alu_result, halted, instruction, pc, cycles);
+        case MEM: return _execute<MEM>(registers, alu_result, halted, instruction, pc, cycles);
+        default:  return _execute<RO0>(registers, alu_result, halted, instruction, pc, cycles);
+        }
+    }
+
+    // The rest of _execute() for an instruction with this opcode, once pc is past its first word.
+    template <uint8_t opcode>
+    [[gnu::always_inline]] uint8_t _execute(Registers& registers, uint16_t& alu_result, bool& halted,
+        uint16_t instruction, uint16_t& pc, uint64_t cycles)
+    {
+        uint8_t dest = (instruction >> 8) & 0xF;
+        uint8_t left = (instruction >> 4) & 0xF;
+        uint8_t right = instruction & 0xF;
+
+        switch (opcode)
+        {
+        case ADD:
+            _write_alu(registers, alu_result, dest, registers[left] + _byte_operand(registers, right, pc));
+            return 5;
+        case LSL:
+            _write_alu(registers, alu_result, dest, registers[left] << (_byte_operand(registers, right, pc) & 0xF));
+            return 5;
+        case LSR:
+            _write_alu(registers, alu_result, dest, registers[left] >> (_byte_operand(registers, right, pc) & 0xF));
+            return 5;
+        case ASR:
+            _write_alu(registers, alu_result, dest, _asr(registers[left], _byte_operand(registers, right, pc)));
+            return 5;
+        case SUB:
+            _write_alu(registers, alu_result, dest, registers[left] - _word_operand(registers, right, pc));
+            return right ? 5 : 6;
+        case XOR:
+            _write_alu(registers, alu_result, dest, registers[left] ^ _word_operand(registers, right, pc));
+            return right ? 5 : 6;
+        case OR:
+            _write_alu(registers, alu_result, dest, registers[left] | _word_operand(registers, right, pc));
+            return right ? 5 : 6;
+        case AND:
+            _write_alu(registers, alu_result, dest, registers[left] & _word_operand(registers, right, pc));
+            return right ? 5 : 6;
+        case BRA:
+        {
+            int8_t offset = _memory[pc++];
+            halted = false;
+            if (_branch_taken(dest, registers[left], registers[right]))
+            {
+                pc += offset;
+                halted = offset == -3;
+            }
+            return 6;
+        }
+        case JMP:
+        {
+            if (left)
+            { // register + byte
+                int8_t offset = _memory[pc++];
+                registers[dest] = pc;
+                registers[0] = 0;
+                pc = registers[right] + offset;
+                return 5;
+            }
+            if (right)
+            { // register
+                uint16_t target = registers[right];
+                registers[dest] = pc;
+                registers[0] = 0;
+                pc = target;
+                return 5;
+            }
+            // word
+            uint16_t target = _read_word(pc);
+            pc += 2;
+            registers[dest] = pc;
+            registers[0] = 0;
+            pc = target;
+            return 6;
+        }
+        case MEM:
+        {
+            uint16_t address = registers[right] + (int8_t)_memory[pc++];
+            if (_slow_page[address >> 8]) [[unlikely]]
+            {
+                if (left & MEM_LOAD)
+                    registers[dest] = _slow_load(left, address, cycles);
+                else
+                    _slow_store(left, address, registers[dest], cycles);
+                return left & MEM_WORD ? 6 : 5;
+            }
+            if (left & MEM_LOAD)
+            {
+                if (left & MEM_WORD)
+                {
+                    SIM_COUNT(LOADS_WORD);
+                    registers[dest] = _read_word(address);
+                    return 6;
+                }
+                SIM_COUNT(LOADS_BYTE);
+                uint16_t value = _memory[address];
+                if (left & MEM_SEX && value & 0x0080)
+                    value |= 0xFF00;
+                registers[dest] = value;
+                return 5;
+            }
+            _write_memory(address, registers[dest]);
+            if (left & MEM_WORD)
+            {
+                SIM_COUNT(STORES_WORD);
+                _write_memory(address + 1, registers[dest] >> 8);
+                return 6;
+            }
+            SIM_COUNT(STORES_BYTE);
+            return 5;
+        }
+        default: // reserved, the ALU does nothing and its previous result is written back
+            registers[dest] = alu_result;
+            return 5;
+        }
+    }
+
+    // Right operand of ADD/LSL/LSR/ASR: a register, or a sign extended immediate byte if right is r0.
+    uint16_t _byte_operand(const Registers& registers, uint8_t right, uint16_t& pc) const
+    {
+        if (right)
+            return registers[right];
+        return (int8_t)_memory[pc++];
+    }
+
+    // Right operand of SUB/XOR/OR/AND: a register, or an immediate word if right is r0.
+    uint16_t _word_operand(const Registers& registers, uint8_t right, uint16_t& pc) const
+    {
+        if (right)
+            return registers[right];
+        uint16_t value = _read_word(pc);
+        pc += 2;
+        return value;
+    }
+
+    void _write_alu(uint8_t dest, uint16_t result)
+    {
+        _write_alu(_register, _alu_result, dest, result);
+    }
+
+    static void _write_alu(Registers& registers, uint16_t& alu_result, uint8_t dest, uint16_t result)
+    {
+        alu_result = result;
+        registers[dest] = result;
+    }
+
+    static bool _branch_taken(uint8_t flags, uint16_t left, uint16_t right)
+    {
+        bool take = false;
+        if (flags & BRA_EQ)
+            take = left == right;
+        if (flags & BRA_LT)
+        {
+            if (flags & BRA_U)
+                take = take || left < right;
+            else
+                take = take || (int16_t)left < (int16_t)right;
+        }
+        if (flags & BRA_NOT)
+            take = !take;
+        if (take)
+            SIM_COUNT(BRANCHES_TAKEN);
+        else
+            SIM_COUNT(BRANCHES_NOT_TAKEN);
+        return take;
+    }
+
+    template <uint8_t opcode, bool immediate>
+    static uint16_t _run_alu(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        uint16_t left = cpu._register[instruction.left];
+        uint16_t right = immediate ? instruction.immediate : cpu._register[instruction.right];
+        uint16_t result;
+        switch (opcode)
+        {
+        case ADD: result = left + right; break;
+        case SUB: result = left - right; break;
+        case LSL: result = left << (right & 0xF); break;
+        case LSR: result = left >> (right & 0xF); break;
+        case ASR: result = _asr(left, right); break;
+        case XOR: result = left ^ right; break;
+        case OR:  result = left | right; break;
+        case AND: result = left & right; break;
+        default:  result = cpu._alu_result; break; // reserved
+        }
+        cpu._write_alu(instruction.dest, result);
+        return next;
+    }
+
+    static uint16_t _run_bra(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        cpu._halted = false;
+        if (!_branch_taken(instruction.dest, cpu._register[instruction.left], cpu._register[instruction.right]))
+            return next;
+        cpu._halted = (int16_t)instruction.immediate == -3;
+        return next + instruction.immediate;
+    }
+
+    static uint16_t _run_jmp_register(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        uint16_t target = cpu._register[instruction.right];
+        cpu._register[instruction.dest] = next;
+        cpu._register[0] = 0;
+        return target;
+    }
+
+    static uint16_t _run_jmp_offset(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        cpu._register[instruction.dest] = next;
+        cpu._register[0] = 0;
+        return cpu._register[instruction.right] + instruction.immediate;
+    }
+
+    static uint16_t _run_jmp_word(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        cpu._register[instruction.dest] = next;
+        cpu._register[0] = 0;
+        return instruction.immediate;
+    }
+
+    template <uint8_t flags>
+    static uint16_t _run_mem(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        uint16_t address = cpu._register[instruction.right] + instruction.immediate;
+        if (cpu._slow_page[address >> 8]) [[unlikely]]
+        { // The engines that run handlers leave _cycles at the end of the instruction for this.
+            uint64_t start = cpu._cycles - instruction.cycles;
+            if (flags & MEM_LOAD)
+                cpu._register[instruction.dest] = cpu._slow_load(flags, address, start);
+            else
+                cpu._slow_store(flags, address, cpu._register[instruction.dest], start);
+            return next;
+        }
+        if (flags & MEM_LOAD)
+        {
+            uint16_t value;
+            if (flags & MEM_WORD)
+                value = cpu._read_word(address);
+            else if (flags & MEM_SEX)
+                value = (int8_t)cpu._memory[address];
+            else
+                value = cpu._memory[address];
+            cpu._register[instruction.dest] = value;
+            if (flags & MEM_WORD)
+                SIM_COUNT(LOADS_WORD);
+            else
+                SIM_COUNT(LOADS_BYTE);
+        }
+        else
+        {
+            if (flags & MEM_WORD)
+                SIM_COUNT(STORES_WORD);
+            else
+                SIM_COUNT(STORES_BYTE);
+            uint16_t value = cpu._register[instruction.dest];
+            cpu._write_memory(address, value);
+            if (flags & MEM_WORD)
+                cpu._write_memory(address + 1, value >> 8);
+        }
+        return next;
+    }
+
+    // Runs an instruction at a breakpoint whose condition doesn't hold.
+    [[gnu::noinline]] uint16_t _run_original(const Decoded& instruction, uint16_t next)
+    {
+        return decode(&_memory[0], next - instruction.length).handler(*this, instruction, next);
+    }
+
+    // Handler of an instruction at a breakpoint, in the predecode cache. If it stops, the
+    // instruction doesn't run and the engine takes back the cycles it counted for it.
+    static uint16_t _run_breakpoint(CPU& cpu, const Decoded& instruction, uint16_t next)
+    {
+        if (cpu._breakpoint_hit(next - instruction.length))
+            return next - instruction.length;
+        return cpu._run_original(instruction, next);
+    }
+
+    template <uint8_t opcode>
+    static Handler _alu_handler(bool immediate)
+    {
+        return immediate ? &_run_alu<opcode, true> : &_run_alu<opcode, false>;
+    }
+
+    static Handler _mem_handler(uint8_t flags)
+    {
+        if (!(flags & MEM_LOAD))
+            return flags & MEM_WORD ? &_run_mem<MEM_WORD> : &_run_mem<0>;
+        if (flags & MEM_WORD)
+            return &_run_mem<MEM_LOAD | MEM_WORD>;
+        return flags & MEM_SEX ? &_run_mem<MEM_LOAD | MEM_SEX> : &_run_mem<MEM_LOAD>;
+    }
+
+    // Returns the predecode cache entry for address, decoding it if it isn't valid. Inlined into
+    // the dispatch of the engines, which only call out on a miss.
+    [[gnu::always_inline]] Decoded& _predecoded(uint16_t address)
+    {
+        Decoded& instruction = _decoded[address];
+        if (instruction.length == 0) [[unlikely]]
+            _predecode(address);
+        else
+            SIM_COUNT(PREDECODE_HITS);
+        return instruction;
+    }
+
+    [[gnu::noinline]] void _predecode(uint16_t address)
+    {
+        SIM_COUNT(PREDECODE_MISSES);
+        Decoded& instruction = _decoded[address];
+        instruction = decode(&_memory[0], address);
+        if (_breakpoint_at(address))
+        { // The engines check the breakpoint when they get to it, see _run_breakpoint().
+            instruction.opcode |= _AT_BREAKPOINT;
+            instruction.handler = &_run_breakpoint;
+        }
+        _code_page[address >> 8] = true;
+        _code_page[(uint16_t)(address + instruction.length - 1) >> 8] = true;
+    }
+
+    void _allocate_decoded()
+    {
+        if (_decoded)
+            return;
+        _decoded.reset(new Decoded[MEM_SIZE]);
+        for (size_t i = 0; i < MEM_SIZE; ++i)
+            _decoded[i].length = 0;
+    }
+
+    // Times x has to be stepped by step to reach 0, wrapping around, or 0 if it never does.
+    static uint32_t _steps_to_zero(uint16_t x, uint16_t step)
+    {
+        if (step == 0)
+            return x == 0;
+        uint16_t power = step & -step; // x + n * step = 0 is n * (step / power) = -x / power mod 65536 / power.
+        if (x % power)
+            return 0;
+        uint32_t modulus = 65536 / power;
+        uint32_t odd = step / power;
+        uint32_t inverse = odd; // Newton's iteration, each one doubles the correct low bits.
+        for (int i = 0; i < 4; ++i)
+            inverse *= 2 - odd * inverse;
+        uint32_t steps = (uint16_t)-x / power * inverse % modulus;
+        return steps ? steps : modulus;
+    }
+
+    // A delay loop adds an immediate to a register and branches back while it isn't 0:
+    //     add rX rX r0 -1  (or sub rX rX r0 1)
+    //     bra 0x9 rX r0 -6 (bne, with the operands either way)
+    // Called when the branch of one has just been taken, with the register not 0. Runs every
+    // iteration but the last one at once, or as many as fit before _limit: they only move the
+    // register, the ALU result and the counts on. The rest runs normally, so the state is the
+    // same at every cycle as if each iteration had run.
+    void _skip_delay_loop(uint8_t reg, uint16_t step, uint64_t iteration_cycles, uint64_t& cycles, uint64_t& instructions)
+    {
+        if (cycles >= _limit)
+            return;
+        uint64_t skip = (_limit - cycles) / iteration_cycles;
+        uint32_t steps = _steps_to_zero(_register[reg], step);
+        if (steps)
+            skip = std::min<uint64_t>(skip, steps - 1);
+        if (skip == 0)
+            return;
+        _register[reg] += skip * step;
+        _alu_result = _register[reg];
+        cycles += skip * iteration_cycles;
+        instructions += 2 * skip;
+    }
+
+    // The register a branch counts down if it can close a delay loop (a BNE of a register other
+    // than r0 against r0, back over an ADD or SUB of an immediate), 0 if it can't.
+    static uint8_t _delay_loop_register(uint8_t flags, uint8_t left, uint8_t right, uint16_t offset)
+    {
+        if (flags != (BRA_NOT | BRA_EQ) || (left && right) || ((uint16_t)(offset + 7) > 1))
+            return 0;
+        return left | right;
+    }
+
+    static bool _delay_loop_body(uint8_t reg, uint16_t offset, uint8_t opcode, uint8_t dest, uint8_t left, uint8_t right, uint8_t length)
+    {
+        return (opcode == ADD || opcode == SUB) && right == 0 && dest == reg && left == reg && length + 3 == -(int16_t)offset;
+    }
+
+    // For the threaded engine, after the branch that went to pc.
+    [[gnu::noinline]] void _predecoded_delay_loop(const Decoded& branch, uint16_t pc, uint64_t& cycles, uint64_t& instructions)
+    {
+        uint8_t reg = _delay_loop_register(branch.dest, branch.left, branch.right, branch.immediate);
+        if (!reg || !_register[reg])
+            return;
+        const Decoded& body = _predecoded(pc);
+        if (!_delay_loop_body(reg, branch.immediate, body.opcode, body.dest, body.left, body.right, body.length))
+            return;
+        uint16_t step = body.opcode == ADD ? body.immediate : -body.immediate;
+        _skip_delay_loop(reg, step, body.cycles + branch.cycles, cycles, instructions);
+    }
+
+    // Runs instructions with _execute(), starting at pc, until the CPU halts or cycles reaches
+    // _limit. Returns the address of the next instruction. The registers and the ALU result are
+    // locals for the whole run (written back before a breakpoint's condition reads them), which
+    // nothing the instructions store to can alias, so the host keeps them close instead of
+    // storing every result to the CPU and loading it back for the next instruction.
+    SIM_SEPARATE_DISPATCH uint16_t _run_fast(uint16_t pc)
+    {
+        Registers registers = _register;
+        uint16_t alu_result = _alu_result;
+        bool halted = _halted;
+        uint64_t cycles = _cycles;
+        uint64_t instructions = _instructions;
+
+#ifdef SIM_COMPUTED_GOTO
+        static void* const handlers[16] = {
+            &&op_add, &&op_sub, &&op_reserved, &&op_reserved, &&op_reserved, &&op_reserved, &&op_reserved, &&op_lsl,
+            &&op_lsr, &&op_asr, &&op_xor, &&op_or, &&op_and, &&op_bra, &&op_jmp, &&op_mem,
+        };
+        uint16_t instruction;
+
+        // As in _run_threaded, every handler ends with its own copy of the dispatch. Only a branch
+        // can halt the CPU.
+#define SIM_DISPATCH()                                  \
+        do                                              \
+        {                                               \
+            if (cycles >= _limit)                       \
+                goto done;                              \
+            if (_break_page[pc >> 8]) [[unlikely]]      \
+            {                                           \
+                _register = registers;                  \
+                _alu_result = alu_result;               \
+                if (_breakpoint_hit(pc))                \
+                    goto done;                          \
+            }                                           \
+            registers[0] = 0;                           \
+            instruction = _read_word(pc);               \
+            pc += 2;                                    \
+            ++instructions;                             \
+            SIM_COUNT_OPCODE(instruction >> 12);        \
+            goto *handlers[instruction >> 12];          \
+        } while (false)
+#define SIM_HANDLER(label, opcode)                                                              \
+    label:                                                                                      \
+        cycles += _execute<opcode>(registers, alu_result, halted, instruction, pc, cycles);     \
+        SIM_DISPATCH();
+
+        if (halted)
+            goto done;
+        SIM_DISPATCH();
+        SIM_HANDLER(op_add, ADD)
+        SIM_HANDLER(op_sub, SUB)
+        SIM_HANDLER(op_lsl, LSL)
+        SIM_HANDLER(op_lsr, LSR)
+        SIM_HANDLER(op_asr, ASR)
+        SIM_HANDLER(op_xor, XOR)
+        SIM_HANDLER(op_or, OR)
+        SIM_HANDLER(op_and, AND)
+        SIM_HANDLER(op_jmp, JMP)
+        SIM_HANDLER(op_mem, MEM)
+        SIM_HANDLER(op_reserved, RO0)
+    op_bra:
+        cycles += _execute<BRA>(registers, alu_result, halted, instruction, pc, cycles);
+        if (halted)
+            goto done;
+        SIM_DISPATCH();
+    done:
+#undef SIM_HANDLER
+#undef SIM_DISPATCH
+#else
+        while (!halted && cycles < _limit)
+        {
+            if (_break_page[pc >> 8]) [[unlikely]]
+            {
+                _register = registers;
+                _alu_result = alu_result;
+                if (_breakpoint_hit(pc))
+                    break;
+            }
+            cycles += _execute(registers, alu_result, halted, pc, cycles);
+            ++instructions;
+        }
+#endif
+        _register = registers;
+        _alu_result = alu_result;
+        _halted = halted;
+        _cycles = cycles;
+        _instructions = instructions;
+        return pc;
+    }
+
+    // Runs instructions out of the predecode cache, starting at pc, until the CPU halts or cycles
+    // reaches _limit. Returns the address of the next instruction.
+    uint16_t _run_predecoded(uint16_t pc)
+    {
+        _allocate_decoded();
+        uint64_t cycles = _cycles;
+        uint64_t instructions = _instructions;
+        while (!_halted && cycles < _limit)
+        {
+            Decoded& instruction = _predecoded(pc);
+            _register[0] = 0;
+            cycles += instruction.cycles;
+            ++instructions;
+            SIM_COUNT_OPCODE(instruction.opcode);
+            _cycles = cycles;
+            pc = instruction.handler(*this, instruction, pc + instruction.length);
+        }
+        if (_stop == BREAKPOINT) [[unlikely]]
+        { // Before the instruction at pc, which was counted.
+            cycles -= _decoded[pc].cycles;
+            --instructions;
+        }
+        _cycles = cycles;
+        _instructions = instructions;
+        return pc;
+    }
+
+    // ALU instruction for the threaded engine. Register forms decode with a 0 immediate and
+    // immediate forms name r0, which is 0 at this point, so the right operand is just the sum.
+    template <uint8_t opcode>
+    [[gnu::always_inline]] void _threaded_alu(const Decoded& instruction)
+    {
+        uint16_t left = _register[instruction.left];
+        uint16_t right = _register[instruction.right] + instruction.immediate;
+        uint16_t result;
+        switch (opcode)
+        {
+        case ADD: result = left + right; break;
+        case SUB: result = left - right; break;
+        case LSL: result = left << (right & 0xF); break;
+        case LSR: result = left >> (right & 0xF); break;
+        case ASR: result = _asr(left, right); break;
+        case XOR: result = left ^ right; break;
+        case OR:  result = left | right; break;
+        case AND: result = left & right; break;
+        default:  result = _alu_result; break; // reserved
+        }
+        _write_alu(instruction.dest, result);
+    }
+
+    // Same as _run_predecoded, but dispatches on the opcode instead of calling the cached handler
+    // for every instruction, with ALU instructions and branches inlined into the dispatch loop.
+    SIM_SEPARATE_DISPATCH uint16_t _run_threaded(uint16_t pc)
+    {
+        _allocate_decoded();
+        uint64_t cycles = _cycles;
+        uint64_t instructions = _instructions;
+        const Decoded* instruction;
+
+#ifdef SIM_COMPUTED_GOTO
+        static void* const handlers[32] = {
+            &&op_add, &&op_sub, &&op_reserved, &&op_reserved, &&op_reserved, &&op_reserved, &&op_reserved, &&op_lsl,
+            &&op_lsr, &&op_asr, &&op_xor, &&op_or, &&op_and, &&op_bra, &&op_jmp, &&op_mem,
+            &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break,
+            &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break, &&op_break,
+        };
+
+        // Every handler ends with its own copy of the dispatch, so the host can predict the
+        // successor of each opcode separately. Only a branch can halt the CPU.
+#define SIM_DISPATCH()                                  \
+        do                                              \
+        {                                               \
+            if (cycles >= _limit)                       \
+                goto done;                              \
+            instruction = &_predecoded(pc);             \
+            _register[0] = 0;                           \
+            cycles += instruction->cycles;              \
+            ++instructions;                             \
+            SIM_COUNT_OPCODE(instruction->opcode);      \
+            pc += instruction->length;                  \
+            goto *handlers[instruction->opcode];        \
+        } while (false)
+
+        if (_halted)
+            goto done;
+        SIM_DISPATCH();
+    op_add:
+        _threaded_alu<ADD>(*instruction);
+        SIM_DISPATCH();
+    op_sub:
+        _threaded_alu<SUB>(*instruction);
+        SIM_DISPATCH();
+    op_lsl:
+        _threaded_alu<LSL>(*instruction);
+        SIM_DISPATCH();
+    op_lsr:
+        _threaded_alu<LSR>(*instruction);
+        SIM_DISPATCH();
+    op_asr:
+        _threaded_alu<ASR>(*instruction);
+        SIM_DISPATCH();
+    op_xor:
+        _threaded_alu<XOR>(*instruction);
+        SIM_DISPATCH();
+    op_or:
+        _threaded_alu<OR>(*instruction);
+        SIM_DISPATCH();
+    op_and:
+        _threaded_alu<AND>(*instruction);
+        SIM_DISPATCH();
+    op_reserved:
+        _threaded_alu<RO0>(*instruction);
+        SIM_DISPATCH();
+    op_bra:
+        pc = _run_bra(*this, *instruction, pc);
+        if (_halted)
+            goto done;
+        if ((uint16_t)(instruction->immediate + 7) <= 1)
+        { // Through copies, which leaves the counts in registers everywhere else.
+            uint64_t loop_cycles = cycles, loop_instructions = instructions;
+            _predecoded_delay_loop(*instruction, pc, loop_cycles, loop_instructions);
+            cycles = loop_cycles;
+            instructions = loop_instructions;
+        }
+        SIM_DISPATCH();
+    op_mem:
+        _cycles = cycles;
+        pc = instruction->handler(*this, *instruction, pc);
+        SIM_DISPATCH();
+    op_jmp:
+        pc = instruction->handler(*this, *instruction, pc);
+        SIM_DISPATCH();
+    op_break:
+        if (_breakpoint_hit(pc - instruction->length))
+        {
+            cycles -= instruction->cycles;
+            --instructions;
+            pc -= instruction->length;
+            goto done;
+        }
+        _cycles = cycles;
+        pc = _run_original(*instruction, pc);
+        if (_halted) // It may have been a branch.
+            goto done;
+        SIM_DISPATCH();
+    done:
+#undef SIM_DISPATCH
+#else
+        while (!_halted && cycles < _limit)
+        {
+            instruction = &_predecoded(pc);
+            _register[0] = 0;
+            cycles += instruction->cycles;
+            ++instructions;
+            SIM_COUNT_OPCODE(instruction->opcode);
+            pc += instruction->length;
+            switch (instruction->opcode)
+            {
+            case ADD: _threaded_alu<ADD>(*instruction); break;
+            case SUB: _threaded_alu<SUB>(*instruction); break;
+            case LSL: _threaded_alu<LSL>(*instruction); break;
+            case LSR: _threaded_alu<LSR>(*instruction); break;
+            case ASR: _threaded_alu<ASR>(*instruction); break;
+            case XOR: _threaded_alu<XOR>(*instruction); break;
+            case OR:  _threaded_alu<OR>(*instruction); break;
+            case AND: _threaded_alu<AND>(*instruction); break;
+            case BRA:
+                pc = _run_bra(*this, *instruction, pc);
+                if ((uint16_t)(instruction->immediate + 7) <= 1)
+                { // Through copies, as above.
+                    uint64_t loop_cycles = cycles, loop_instructions = instructions;
+                    _predecoded_delay_loop(*instruction, pc, loop_cycles, loop_instructions);
+                    cycles = loop_cycles;
+                    instructions = loop_instructions;
+                }
+                break;
+            case JMP: pc = instruction->handler(*this, *instruction, pc); break;
+            case MEM:
+                _cycles = cycles;
+                pc = instruction->handler(*this, *instruction, pc);
+                break;
+            default:
+                if (instruction->opcode < _AT_BREAKPOINT)
+                {
+                    _threaded_alu<RO0>(*instruction);
+                }
+                else if (_breakpoint_hit(pc - instruction->length))
+                {
+                    cycles -= instruction->cycles;
+                    --instructions;
+                    pc -= instruction->length;
+                }
+                else
+                {
+                    _cycles = cycles;
+                    pc = _run_original(*instruction, pc);
+                }
+                break;
+            }
+        }
+#endif
+        _cycles = cycles;
+        _instructions = instructions;
+        return pc;
+    }
+
+    // Translates the basic block starting at pc.
+    _Block* _translate(uint16_t pc)
+    {
+        SIM_COUNT(BLOCKS_TRANSLATED);
+        auto block = std::make_unique<_Block>();
+        block->start = pc;
+        uint16_t address = pc;
+        if (_breakpoint_at(pc))
+            block->cycles = _BREAKPOINT_BLOCK_CYCLES;
+        while (block->cycles != _BREAKPOINT_BLOCK_CYCLES)
+        {
+            Decoded instruction = decode(&_memory[0], address);
+            _MicroOp op;
+            op.immediate = instruction.immediate;
+            op.kind = instruction.opcode;
+            op.dest = instruction.dest;
+            op.left = instruction.left;
+            op.right = instruction.right;
+            op.length = instruction.length;
+            op.cycles = instruction.cycles;
+            switch (instruction.opcode)
+            {
+            case ADD:
+            case SUB:
+            case LSL:
+            case LSR:
+            case ASR:
+            case XOR:
+            case OR:
+            case AND:
+            case BRA:
+                break;
+            case JMP:
+                if (instruction.left)
+                    op.kind = UOP_JMP_OFFSET;
+                else if (!instruction.right)
+                    op.kind = UOP_JMP_WORD;
+                else
+                    op.kind = UOP_JMP_REGISTER;
+                break;
+            case MEM:
+                if (!(instruction.left & MEM_LOAD))
+                    op.kind = instruction.left & MEM_WORD ? UOP_STORE_WORD : UOP_STORE_BYTE;
+                else if (instruction.left & MEM_WORD)
+                    op.kind = UOP_LOAD_WORD;
+                else
+                    op.kind = instruction.left & MEM_SEX ? UOP_LOAD_SBYTE : UOP_LOAD_BYTE;
+                break;
+            default:
+                op.kind = UOP_RESERVED;
+                break;
+            }
+            block->ops.push_back(op);
+            block->cycles += op.cycles;
+            block->length += op.length;
+            address += op.length;
+            if (op.kind == BRA || op.kind >= UOP_JMP_REGISTER || block->ops.size() == MAX_BLOCK_INSTRUCTIONS || _breakpoint_at(address))
+                break;
+        }
+
+        for (uint16_t offset = 0; offset < block->length + 255u; offset += 256)
+        { // Every page from the first byte to the last one
+            uint8_t page = (uint16_t)(pc + std::min<uint16_t>(offset, block->length - 1)) >> 8;
+            if (_page_blocks[page].empty() || _page_blocks[page].back() != block.get())
+                _page_blocks[page].push_back(block.get());
+            _code_page[page] = true;
+        }
+
+        if (block->ops.size() == 2)
+        {
+            const _MicroOp& body = block->ops[0];
+            const _MicroOp& branch = block->ops[1];
+            uint8_t reg = _delay_loop_register(branch.dest, branch.left, branch.right, branch.immediate);
+            block->delay_loop = branch.kind == UOP_BRA && reg
+                && _delay_loop_body(reg, branch.immediate, body.kind, body.dest, body.left, body.right, body.length);
+        }
+
+        _Block* result = block.get();
+        _block_at[pc] = result;
+        _blocks.push_back(std::move(block));
+        return result;
+    }
+
+    void _allocate_blocks()
+    {
+        if (_block_at)
+            return;
+        _block_at.reset(new _Block*[MEM_SIZE]);
+        std::fill(&_block_at[0], &_block_at[MEM_SIZE], nullptr);
+    }
+
+    // Drops every translated block, including the invalidated ones, and their native code. The
+    // code pages stay marked, the predecode cache may still hold instructions from them.
+    void _flush_blocks()
+    {
+        SIM_COUNT(BLOCK_FLUSHES);
+        for (const auto& block : _blocks)
+        { // Every valid block is in there, so this clears every entry.
+            _block_at[block->start] = nullptr;
+#ifdef SIM_JIT
+            if (_jit)
+                _jit->entries[block->start] = nullptr;
+#endif
+        }
+        _blocks.clear();
+        for (auto& blocks : _page_blocks)
+            blocks.clear();
+        _invalid_blocks = 0;
+#ifdef SIM_JIT
+        if (_jit)
+            _jit->code.rewind(_jit->blocks);
+#endif
+    }
+
+    // Cycle count before op while block runs, cycles being the count after the whole block.
+    static uint64_t _op_start(const _Block& block, const _MicroOp& op, uint64_t cycles)
+    {
+        for (const _MicroOp* rest = &op; rest != block.ops.data() + block.ops.size(); ++rest)
+            cycles -= rest->cycles;
+        return cycles;
+    }
+
+    // Takes the cycles and instructions of the ops after op back from the counts of a block that
+    // stops early.
+    static void _give_back(const _Block& block, const _MicroOp& op, uint64_t& cycles, uint64_t& instructions)
+    {
+        for (const _MicroOp* rest = &op + 1; rest != block.ops.data() + block.ops.size(); ++rest)
+        {
+            cycles -= rest->cycles;
+            --instructions;
+        }
+    }
+
+    // A load or store of a block on a device page. The block stops right after it, so that an
+    // event the device scheduled is on time.
+    [[gnu::noinline]] void _block_slow_access(const _Block& block, const _MicroOp& op, uint16_t address, uint64_t& cycles, uint64_t& instructions)
+    {
+        uint64_t start = _op_start(block, op, cycles);
+        if (op.kind < UOP_STORE_BYTE)
+            _register[op.dest] = _slow_load(op.left, address, start);
+        else
+            _slow_store(op.left, address, _register[op.dest], start);
+        _give_back(block, op, cycles, instructions);
+    }
+
+    // Runs a whole block. Returns the index of the exit it left through and moves pc to the next
+    // instruction. If a store invalidates the block or a device is accessed, it stops right after.
+    [[gnu::always_inline]] int _run_block(const _Block& block, uint16_t& pc, uint64_t& cycles, uint64_t& instructions)
+    {
+        cycles += block.cycles;
+        instructions += block.ops.size();
+        for (const _MicroOp& op : block.ops)
+        {
+            _register[0] = 0;
+            pc += op.length;
+            SIM_COUNT_OPCODE(op.kind < UOP_LOAD_BYTE ? op.kind : op.kind < UOP_JMP_REGISTER ? MEM : JMP);
+            uint16_t left = _register[op.left];
+            uint16_t right = _register[op.right] + op.immediate;
+            switch (op.kind)
+            {
+            case ADD: _write_alu(op.dest, left + right); break;
+            case SUB: _write_alu(op.dest, left - right); break;
+            case LSL: _write_alu(op.dest, left << (right & 0xF)); break;
+            case LSR: _write_alu(op.dest, left >> (right & 0xF)); break;
+            case ASR: _write_alu(op.dest, _asr(left, right)); break;
+            case XOR: _write_alu(op.dest, left ^ right); break;
+            case OR:  _write_alu(op.dest, left | right); break;
+            case AND: _write_alu(op.dest, left & right); break;
+            case UOP_RESERVED: _register[op.dest] = _alu_result; break;
+            case UOP_LOAD_BYTE:
+            case UOP_LOAD_SBYTE:
+            case UOP_LOAD_WORD:
+                if (op.kind == UOP_LOAD_WORD)
+                    SIM_COUNT(LOADS_WORD);
+                else
+                    SIM_COUNT(LOADS_BYTE);
+                if (_slow_page[right >> 8]) [[unlikely]]
+                {
+                    _block_slow_access(block, op, right, cycles, instructions);
+                    return 0;
+                }
+                if (op.kind == UOP_LOAD_BYTE)
+                    _register[op.dest] = _memory[right];
+                else if (op.kind == UOP_LOAD_SBYTE)
+                    _register[op.dest] = (int8_t)_memory[right];
+                else
+                    _register[op.dest] = _read_word(right);
+                break;
+            case UOP_STORE_BYTE:
+            case UOP_STORE_WORD:
+                if (op.kind == UOP_STORE_WORD)
+                    SIM_COUNT(STORES_WORD);
+                else
+                    SIM_COUNT(STORES_BYTE);
+                if (_slow_page[right >> 8]) [[unlikely]]
+                {
+                    _block_slow_access(block, op, right, cycles, instructions);
+                    return 0;
+                }
+                _write_memory(right, _register[op.dest]);
+                if (op.kind == UOP_STORE_WORD)
+                    _write_memory(right + 1, _register[op.dest] >> 8);
+                if (!block.valid)
+                {
+                    _give_back(block, op, cycles, instructions);
+                    return 0;
+                }
+                break;
+            case UOP_BRA:
+                _halted = false;
+                if (!_branch_taken(op.dest, left, _register[op.right]))
+                    return 0;
+                _halted = (int16_t)op.immediate == -3;
+                pc += op.immediate;
+                return 1;
+            case UOP_JMP_REGISTER:
+                _register[op.dest] = pc;
+                _register[0] = 0;
+                pc = right;
+                return 0;
+            case UOP_JMP_OFFSET:
+                _register[op.dest] = pc;
+                _register[0] = 0;
+                pc = _register[op.right] + op.immediate;
+                return 0;
+            case UOP_JMP_WORD:
+                _register[op.dest] = pc;
+                _register[0] = 0;
+                pc = op.immediate;
+                return 0;
+            }
+        }
+        return 0;
+    }
+
+    // After the branch of a delay loop block was taken.
+    void _skip_delay_loop(const _Block& block, uint64_t& cycles, uint64_t& instructions)
+    {
+        const _MicroOp& body = block.ops[0];
+        _skip_delay_loop(body.dest, body.kind == ADD ? body.immediate : -body.immediate, block.cycles, cycles, instructions);
+    }
+
+    // Runs translated blocks, following the chain from each block to the next, until the CPU
+    // halts, the next block would go past _limit or a breakpoint stops it. The rest is run
+    // instruction by instruction.
+    uint16_t _run_blocks(uint16_t pc)
+    {
+        _allocate_blocks();
+        uint64_t cycles = _cycles;
+        uint64_t instructions = _instructions;
+        if (_block_at[pc])
+            SIM_COUNT(BLOCKS_FOUND);
+        _Block* block = _block_at[pc] ? _block_at[pc] : _translate(pc);
+        while (!_halted)
+        {
+            if (cycles + block->cycles > _limit)
+            {
+                if (block->cycles != _BREAKPOINT_BLOCK_CYCLES || cycles >= _limit || _breakpoint_hit(pc))
+                    break;
+                // Its condition doesn't hold, the instruction runs by itself.
+                cycles += _execute(pc, cycles);
+                ++instructions;
+                block = _block_at[pc] ? _block_at[pc] : _translate(pc);
+                continue;
+            }
+            int exit = _run_block(*block, pc, cycles, instructions);
+            if (_invalid_blocks > MEM_SIZE / 16)
+            { // Self-modifying code left a lot of garbage, nothing points into the cache at this point.
+                _flush_blocks();
+                block = _translate(pc);
+                continue;
+            }
+            if (exit == 1 && block->delay_loop)
+                _skip_delay_loop(*block, cycles, instructions);
+            _Block* next = block->exits[exit];
+            if (!next || !next->valid || next->start != pc)
+            {
+                if (_block_at[pc])
+                    SIM_COUNT(BLOCKS_FOUND);
+                next = _block_at[pc] ? _block_at[pc] : _translate(pc);
+                block->exits[exit] = next;
+            }
+            else
+            {
+                SIM_COUNT(BLOCKS_CHAINED);
+            }
+            block = next;
+        }
+        _cycles = cycles;
+        _instructions = instructions;
+        return _halted ? pc : _run_threaded(pc);
+    }
+
+#ifdef SIM_JIT
+    static X64::Mem _jit_slot(size_t offset)
+    {
+        return { X64::RSP, -1, 0, (int32_t)offset };
+    }
+
+    static X64::Mem _jit_register_slot(uint8_t reg)
+    {
+        return _jit_slot(offsetof(_JitFrame, registers) + 2 * reg);
+    }
+
+    static bool _jit_pinned(uint8_t reg)
+    {
+        return reg != 0 && reg < _JIT_PINNED_REGISTERS;
+    }
+
+    // Loads guest register reg into dest.
+    void _jit_load(X64::Reg dest, uint8_t reg)
+    {
+        X64& a = _jit->code;
+        if (reg == 0)
+            a.xor_(dest, dest);
+        else if (_jit_pinned(reg))
+            a.mov(dest, _JIT_PINNED[reg]);
+        else
+            a.movzx16(dest, _jit_register_slot(reg));
+    }
+
+    // Returns a host register holding guest register reg: its own if it has one, scratch if not.
+    X64::Reg _jit_read(X64::Reg scratch, uint8_t reg)
+    {
+        if (_jit_pinned(reg))
+            return _JIT_PINNED[reg];
+        _jit_load(scratch, reg);
+        return scratch;
+    }
+
+    // Stores src (zero extended) to guest register reg. Stores to r0 go to its slot.
+    void _jit_store(uint8_t reg, X64::Reg src)
+    {
+        if (_jit_pinned(reg))
+            _jit->code.mov(_JIT_PINNED[reg], src);
+        else
+            _jit->code.mov16(_jit_register_slot(reg), src);
+    }
+
+    void _jit_store(uint8_t reg, uint16_t value)
+    {
+        if (_jit_pinned(reg))
+            _jit->code.mov(_JIT_PINNED[reg], (uint32_t)value);
+        else
+            _jit->code.mov16(_jit_register_slot(reg), value);
+    }
+
+    // Allocates the code buffer and writes the trampoline and the epilogue to it.
+    bool _jit_start()
+    {
+        if (_jit)
+            return true;
+        if (_jit_unavailable)
+            return false;
+        _jit = std::make_unique<_Jit>();
+        if (!_jit->code.allocate(_JIT_CODE_SIZE))
+        {
+            _jit.reset();
+            _jit_unavailable = true;
+            return false;
+        }
+        _jit->entries.reset(new uint8_t*[MEM_SIZE]);
+        std::fill(&_jit->entries[0], &_jit->entries[MEM_SIZE], nullptr);
+
+        // void enter(_JitFrame* frame, const uint8_t* entry): saves the callee saved registers,
+        // copies the frame to the stack, loads the guest registers and jumps to entry.
+        X64& a = _jit->code;
+        const uint32_t frame_size = (sizeof(_JitFrame) + 15) & ~15;
+        const X64::Reg saved[] = { X64::RBX, X64::RBP, X64::R12, X64::R13, X64::R14, X64::R15 };
+        _jit->enter = reinterpret_cast<void (*)(_JitFrame*, const uint8_t*)>(a.here());
+        for (X64::Reg reg : saved)
+            a.push(reg);
+        a.sub64(X64::RSP, frame_size);
+        a.mov64(X64::RAX, X64::RSI);
+        a.mov64(X64::RSI, X64::RDI);
+        a.mov64(X64::RDI, X64::RSP);
+        a.mov(X64::RCX, (uint32_t)sizeof(_JitFrame));
+        a.rep_movsb();
+        a.mov64(X64::R15, _jit_slot(offsetof(_JitFrame, memory)));
+        for (uint8_t reg = 1; reg < _JIT_PINNED_REGISTERS; ++reg)
+            a.movzx16(_JIT_PINNED[reg], _jit_register_slot(reg));
+        a.jmp(X64::RAX);
+
+        // Every exit ends up here, with the reason and the next pc already in the frame.
+        _jit->epilogue = a.here();
+        for (uint8_t reg = 1; reg < _JIT_PINNED_REGISTERS; ++reg)
+            a.mov16(_jit_register_slot(reg), _JIT_PINNED[reg]);
+        a.mov64(X64::RDI, _jit_slot(offsetof(_JitFrame, self)));
+        a.mov64(X64::RSI, X64::RSP);
+        a.mov(X64::RCX, (uint32_t)sizeof(_JitFrame));
+        a.rep_movsb();
+        a.add64(X64::RSP, frame_size);
+        for (X64::Reg reg : saved | std::views::reverse)
+            a.pop(reg);
+        a.ret();
+
+        _jit->blocks = a.here();
+        return true;
+    }
+
+    // Writes the ALU instruction op. The result ends up in rax or in the destination's own register,
+    // which is returned.
+    X64::Reg _jit_alu(const _MicroOp& op)
+    {
+        X64& a = _jit->code;
+        bool immediate = op.right == 0;
+        uint8_t count = op.immediate & 0xF;
+        // Work in place when the instruction updates a register the JIT keeps in a host register.
+        X64::Reg result = X64::RAX;
+        if (op.dest == op.left && _jit_pinned(op.dest))
+            result = _JIT_PINNED[op.dest];
+
+        X64::Reg right = X64::RCX;
+        if (!immediate && op.kind >= LSL && op.kind <= ASR)
+        { // Shift counts go in cl, x86 would only ignore the bits above the lowest 5.
+            _jit_load(X64::RCX, op.right);
+            a.and_(X64::RCX, 0xF);
+        }
+        else if (!immediate)
+        {
+            right = _jit_read(X64::RCX, op.right);
+        }
+        if (result == X64::RAX)
+            _jit_load(X64::RAX, op.left);
+
+        switch (op.kind)
+        {
+        case ADD:
+            immediate ? a.add(result, (uint32_t)op.immediate) : a.add(result, right);
+            a.movzx16(result, result);
+            break;
+        case SUB:
+            immediate ? a.sub(result, (uint32_t)op.immediate) : a.sub(result, right);
+            a.movzx16(result, result);
+            break;
+        case LSL:
+            immediate ? a.shl(result, count) : a.shl_cl(result);
+            a.movzx16(result, result);
+            break;
+        case LSR:
+            immediate ? a.shr(result, count) : a.shr_cl(result);
+            break;
+        case ASR:
+            a.movsx16(result, result);
+            immediate ? a.sar(result, count) : a.sar_cl(result);
+            a.movzx16(result, result);
+            break;
+        case XOR:
+            immediate ? a.xor_(result, (uint32_t)op.immediate) : a.xor_(result, right);
+            break;
+        case OR:
+            immediate ? a.or_(result, (uint32_t)op.immediate) : a.or_(result, right);
+            break;
+        case AND:
+            immediate ? a.and_(result, (uint32_t)op.immediate) : a.and_(result, right);
+            break;
+        }
+        if (result == X64::RAX)
+            _jit_store(op.dest, X64::RAX);
+        return result;
+    }
+
+    // Leaves the address of the load/store op in rax.
+    void _jit_address(const _MicroOp& op)
+    {
+        _jit_load(X64::RAX, op.right);
+        if (op.immediate)
+        {
+            _jit->code.add(X64::RAX, (uint32_t)op.immediate);
+            _jit->code.movzx16(X64::RAX, X64::RAX);
+        }
+    }
+
+    // Compiles block to native code. Its exits go back to the dispatcher through stubs written
+    // after the block, until the dispatcher patches them to the blocks they lead to.
+    void _jit_compile(_Block& block)
+    {
+        SIM_COUNT(JIT_COMPILES);
+        struct Stub
+        {
+            uint8_t* rel32;
+            uint32_t reason;
+            uint16_t pc;
+            size_t op; // First instruction that didn't run, for JIT_INTERPRET.
+        };
+        std::vector<Stub> stubs;
+        X64& a = _jit->code;
+        const X64::Mem memory_at_rax = { X64::R15, X64::RAX };
+
+        block.native = a.here();
+        a.sub64(_jit_slot(offsetof(_JitFrame, budget)), block.cycles);
+        stubs.push_back({ a.jcc(X64::B), JIT_BUDGET, block.start, 0 });
+        a.add64(_jit_slot(offsetof(_JitFrame, instructions)), block.ops.size());
+
+        // The ALU result only has to reach the frame if something can look at it before the next
+        // ALU instruction: a reserved opcode, or an exit (stores may exit, and loads too once
+        // there are slow pages).
+        std::vector<bool> keep_result(block.ops.size());
+        bool needed = true;
+        for (size_t i = block.ops.size(); i-- > 0;)
+        {
+            uint8_t kind = block.ops[i].kind;
+            if (kind <= AND && kind != UOP_RESERVED)
+            {
+                keep_result[i] = needed;
+                needed = false;
+            }
+            else if (kind == UOP_RESERVED || kind == UOP_STORE_BYTE || kind == UOP_STORE_WORD)
+            {
+                needed = true;
+            }
+            else if (kind >= UOP_LOAD_BYTE && kind <= UOP_LOAD_WORD && _any_slow_page)
+            {
+                needed = true;
+            }
+        }
+
+        // Loads and stores on slow pages go through the interpreter. Blocks are compiled again
+        // when the first page becomes slow, so there's nothing to check before.
+        auto slow_check = [&](uint16_t pc, size_t i) {
+            if (!_any_slow_page)
+                return;
+            a.mov64(X64::RCX, _jit_slot(offsetof(_JitFrame, slow_page)));
+            a.mov(X64::RDX, X64::RAX);
+            a.shr(X64::RDX, 8);
+            a.cmp8({ X64::RCX, X64::RDX }, 0);
+            stubs.push_back({ a.jcc(X64::NE), JIT_INTERPRET, pc, i });
+        };
+
+        // Writes to r0 stay there until the next instruction clears it, which the previous block
+        // may have left to this one.
+        bool r0_written = true;
+        uint16_t pc = block.start;
+        for (size_t i = 0; i < block.ops.size(); ++i)
+        {
+            const _MicroOp& op = block.ops[i];
+            uint16_t next = pc + op.length;
+            bool writes_r0 = op.dest == 0 && (op.kind <= AND || (op.kind >= UOP_LOAD_BYTE && op.kind <= UOP_LOAD_WORD));
+            if (r0_written && !writes_r0)
+                a.mov16(_jit_register_slot(0), (uint16_t)0);
+            r0_written = writes_r0;
+
+            switch (op.kind)
+            {
+            case UOP_RESERVED:
+                a.movzx16(X64::RAX, _jit_slot(offsetof(_JitFrame, alu_result)));
+                _jit_store(op.dest, X64::RAX);
+                break;
+            case UOP_LOAD_BYTE:
+            case UOP_LOAD_SBYTE:
+            case UOP_LOAD_WORD:
+                _jit_address(op);
+                slow_check(pc, i);
+                if (op.kind == UOP_LOAD_BYTE)
+                {
+                    a.movzx8(X64::RCX, memory_at_rax);
+                }
+                else if (op.kind == UOP_LOAD_SBYTE)
+                {
+                    a.movsx8(X64::RCX, memory_at_rax);
+                    a.movzx16(X64::RCX, X64::RCX);
+                }
+                else
+                { // Byte by byte, the high byte of 0xFFFF is at 0.
+                    a.movzx8(X64::RCX, memory_at_rax);
+                    a.add16(X64::RAX, 1);
+                    a.movzx8(X64::RDX, memory_at_rax);
+                    a.shl(X64::RDX, 8);
+                    a.or_(X64::RCX, X64::RDX);
+                }
+                _jit_store(op.dest, X64::RCX);
+                break;
+            case UOP_STORE_BYTE:
+            case UOP_STORE_WORD:
+                _jit_address(op);
+                slow_check(pc, i);
+                a.mov64(X64::RCX, _jit_slot(offsetof(_JitFrame, code_page)));
+                for (uint8_t byte = 0; byte < (op.kind == UOP_STORE_WORD ? 2 : 1); ++byte)
+                {
+                    a.mov(X64::RDX, X64::RAX);
+                    if (byte)
+                        a.add16(X64::RDX, 1);
+                    a.shr(X64::RDX, 8);
+                    a.cmp8({ X64::RCX, X64::RDX }, 0);
+                    stubs.push_back({ a.jcc(X64::NE), JIT_INTERPRET, pc, i });
+                }
+                a.mov64(X64::RCX, _jit_slot(offsetof(_JitFrame, dirty_page)));
+                for (uint8_t byte = 0; byte < (op.kind == UOP_STORE_WORD ? 2 : 1); ++byte)
+                {
+                    a.mov(X64::RDX, X64::RAX);
+                    if (byte)
+                        a.add16(X64::RDX, 1);
+                    a.shr(X64::RDX, 8);
+                    a.mov8({ X64::RCX, X64::RDX }, (uint8_t)1);
+                }
+                _jit_load(X64::RCX, op.dest);
+                a.mov8(memory_at_rax, X64::RCX);
+                if (op.kind == UOP_STORE_WORD)
+                {
+                    a.add16(X64::RAX, 1);
+                    a.shr(X64::RCX, 8);
+                    a.mov8(memory_at_rax, X64::RCX);
+                }
+                break;
+            case UOP_BRA:
+            {
+                uint16_t target = next + op.immediate;
+                uint32_t taken = (int16_t)op.immediate == -3 ? JIT_HALT : block.delay_loop ? JIT_DELAY_LOOP : JIT_LINK;
+                if (!(op.dest & (BRA_EQ | BRA_LT)))
+                { // Always or never
+                    stubs.push_back({ a.jmp(), op.dest & BRA_NOT ? taken : JIT_LINK, op.dest & BRA_NOT ? target : next, 0 });
+                    break;
+                }
+                bool sign = (op.dest & BRA_LT) && !(op.dest & BRA_U);
+                X64::Reg left = X64::RAX;
+                X64::Reg right = X64::RCX;
+                if (sign)
+                {
+                    _jit_load(X64::RAX, op.left);
+                    _jit_load(X64::RCX, op.right);
+                    a.movsx16(X64::RAX, X64::RAX);
+                    a.movsx16(X64::RCX, X64::RCX);
+                }
+                else
+                {
+                    left = _jit_read(X64::RAX, op.left);
+                    right = _jit_read(X64::RCX, op.right);
+                }
+                a.cmp(left, right);
+                X64::Cond cond;
+                if (!(op.dest & BRA_LT))
+                    cond = X64::E;
+                else if (!(op.dest & BRA_EQ))
+                    cond = sign ? X64::L : X64::B;
+                else
+                    cond = sign ? X64::LE : X64::BE;
+                if (op.dest & BRA_NOT)
+                    cond = (X64::Cond)(cond ^ 1);
+                stubs.push_back({ a.jcc(cond), taken, target, 0 });
+                stubs.push_back({ a.jmp(), JIT_LINK, next, 0 });
+                break;
+            }
+            case UOP_JMP_WORD:
+                if (op.dest)
+                    _jit_store(op.dest, next);
+                stubs.push_back({ a.jmp(), JIT_LINK, op.immediate, 0 });
+                break;
+            case UOP_JMP_REGISTER:
+            case UOP_JMP_OFFSET:
+                if (op.kind == UOP_JMP_REGISTER)
+                    _jit_load(X64::RAX, op.right);
+                if (op.dest)
+                    _jit_store(op.dest, next);
+                if (op.kind == UOP_JMP_OFFSET)
+                { // The target register is read after the return address is written.
+                    _jit_load(X64::RAX, op.right);
+                    a.add(X64::RAX, (uint32_t)op.immediate);
+                    a.movzx16(X64::RAX, X64::RAX);
+                }
+                a.mov64(X64::RDX, _jit_slot(offsetof(_JitFrame, entries)));
+                a.mov64(X64::RDX, { X64::RDX, X64::RAX, 3 });
+                a.test64(X64::RDX, X64::RDX);
+                stubs.push_back({ a.jcc(X64::E), JIT_INDIRECT, 0, 0 });
+                a.jmp(X64::RDX);
+                break;
+            default:
+            {
+                X64::Reg result = _jit_alu(op);
+                if (keep_result[i])
+                    a.mov16(_jit_slot(offsetof(_JitFrame, alu_result)), result);
+                break;
+            }
+            }
+            pc = next;
+        }
+        if (block.ops.back().kind != UOP_BRA && block.ops.back().kind < UOP_JMP_REGISTER)
+            stubs.push_back({ a.jmp(), JIT_LINK, pc, 0 }); // Cut short at MAX_BLOCK_INSTRUCTIONS
+
+        for (const Stub& stub : stubs)
+        {
+            X64::patch(stub.rel32, a.here());
+            if (stub.reason == JIT_BUDGET)
+            {
+                a.add64(_jit_slot(offsetof(_JitFrame, budget)), block.cycles);
+            }
+            else if (stub.reason == JIT_INTERPRET)
+            { // Give back the cycles and instructions that didn't run.
+                uint32_t cycles = 0;
+                for (size_t i = stub.op; i < block.ops.size(); ++i)
+                    cycles += block.ops[i].cycles;
+                a.add64(_jit_slot(offsetof(_JitFrame, budget)), cycles);
+                a.sub64(_jit_slot(offsetof(_JitFrame, instructions)), block.ops.size() - stub.op);
+            }
+            else if (stub.reason == JIT_LINK)
+            {
+                a.mov64(X64::RAX, (uint64_t)stub.rel32);
+                a.mov64(_jit_slot(offsetof(_JitFrame, link)), X64::RAX);
+            }
+            if (stub.reason == JIT_INDIRECT)
+                a.mov32(_jit_slot(offsetof(_JitFrame, pc)), X64::RAX);
+            else
+                a.mov32(_jit_slot(offsetof(_JitFrame, pc)), (uint32_t)stub.pc);
+            a.mov32(_jit_slot(offsetof(_JitFrame, reason)), stub.reason);
+            a.jmp(_jit->epilogue);
+        }
+    }
+
+    // Native code of the block starting at pc, translating and compiling it if needed.
+    const uint8_t* _jit_entry(uint16_t pc)
+    {
+        if (_jit->entries[pc])
+            return _jit->entries[pc];
+        _Block* block = _block_at[pc] ? _block_at[pc] : _translate(pc);
+        if (!block->native && block->cycles == _BREAKPOINT_BLOCK_CYCLES)
+        { // Straight back to the dispatcher.
+            X64& a = _jit->code;
+            block->native = a.here();
+            a.mov32(_jit_slot(offsetof(_JitFrame, pc)), (uint32_t)pc);
+            a.mov32(_jit_slot(offsetof(_JitFrame, reason)), JIT_BREAKPOINT);
+            a.jmp(_jit->epilogue);
+        }
+        if (!block->native)
+            _jit_compile(*block);
+        return _jit->entries[pc] = block->native;
+    }
+#endif
+
+    // Runs compiled blocks until the CPU halts or the next block would go past _limit, then finishes
+    // like _run_blocks. Native code runs from block to block by itself and only comes back here to
+    // have a jump patched, a block compiled or a store to a code page done.
+    uint16_t _run_jit(uint16_t pc)
+    {
+#ifdef SIM_JIT
+        if (!_jit_start())
+            return _run_blocks(pc);
+
+        _allocate_blocks();
+        uint8_t* link = nullptr; // Jump to patch to the next block.
+        while (!_halted && _cycles < _limit)
+        {
+            if (_invalid_blocks > MEM_SIZE / 16 || _jit->code.remaining() < _JIT_BLOCK_SPACE)
+            {
+                _flush_blocks();
+                link = nullptr;
+            }
+            const uint8_t* entry = _jit_entry(pc);
+            if (link)
+            {
+                _block_at[pc]->links.emplace_back(link, X64::target(link));
+                X64::patch(link, entry);
+            }
+
+            _JitFrame frame;
+            frame.self = &frame;
+            frame.memory = _memory.get();
+            frame.entries = _jit->entries.get();
+            frame.code_page = _code_page.data();
+            frame.dirty_page = _dirty_page.data();
+            frame.slow_page = _slow_page.data();
+            uint64_t limit = _limit; // Only an instruction of the interpreter can lower it.
+            frame.budget = limit - _cycles;
+            frame.instructions = _instructions;
+            std::ranges::copy(_register, frame.registers);
+            frame.alu_result = _alu_result;
+            SIM_COUNT(JIT_ENTRIES);
+            _jit->enter(&frame, entry);
+            std::ranges::copy(frame.registers, _register.begin());
+            _alu_result = frame.alu_result;
+            _cycles = limit - frame.budget;
+            _instructions = frame.instructions;
+            pc = frame.pc;
+
+            link = frame.reason == JIT_LINK ? frame.link : nullptr;
+            if (frame.reason == JIT_BUDGET)
+                break;
+            if (frame.reason == JIT_HALT)
+                _halted = true;
+            if (frame.reason == JIT_DELAY_LOOP)
+                _skip_delay_loop(*_block_at[pc], _cycles, _instructions);
+            if (frame.reason == JIT_BREAKPOINT && (_cycles >= _limit || _breakpoint_hit(pc)))
+                break; // Events due there come first.
+            if (frame.reason == JIT_INTERPRET || frame.reason == JIT_BREAKPOINT)
+            {
+                _cycles += _execute(pc, _cycles);
+                ++_instructions;
+            }
+        }
+        return _halted ? pc : _run_threaded(pc);
+#else
+        return _run_blocks(pc);
+#endif
+    }
+
+    // Finishes the instruction (or reset sequence) in progress, so that the CPU is between
+    // instructions. Returns the address of the next instruction.
+    uint16_t _sync()
+    {
+        while (_cycle != 0)
+            update();
+        _address += (int8_t)_index;
+        _index = 0;
+        return _address;
+    }
+
+    // Shared by every snapshot for the pages that are all zeros.
+    static const std::shared_ptr<const Snapshot::Page>& _zero_page()
+    {
+        static const std::shared_ptr<const Snapshot::Page> page = std::make_shared<const Snapshot::Page>();
+        return page;
+    }
+
+    // Copies every field but memory between a CPU and a snapshot, which use the same names.
+    template <class From, class To>
+    static void _copy_state(const From& from, To& to)
+    {
+        to._register = from._register;
+        to._bus = from._bus;
+        to._address = from._address;
+        to._temp_pc = from._temp_pc;
+        to._alu_left = from._alu_left;
+        to._alu_right = from._alu_right;
+        to._alu_result = from._alu_result;
+        to._cycle = from._cycle;
+        to._opcode = from._opcode;
+        to._dest = from._dest;
+        to._left = from._left;
+        to._right = from._right;
+        to._index = from._index;
+        to._inc_addr = from._inc_addr;
+        to._load_imm = from._load_imm;
+        to._load_word = from._load_word;
+        to._load_high = from._load_high;
+        to._imm_to_idx = from._imm_to_idx;
+        to._take_branch = from._take_branch;
+        to._cycles = from._cycles;
+        to._instructions = from._instructions;
+        to._halted = from._halted;
+    }
+
+public:
+    CPU() : _memory(new uint8_t[MEM_SIZE])
+    {
+        std::fill(&_memory[0], &_memory[MEM_SIZE], 0);
+        _register.fill(0);
+        _dirty_page.fill(true);
+    }
+
+    // Goes back to the power-on state, keeping memory and the caches allocated so that the CPU
+    // can run another program without allocating again.
+    void reset()
+    {
+        std::fill(&_memory[0], &_memory[MEM_SIZE], 0);
+        _dirty_page.fill(true);
+        _register.fill(0);
+        if (_decoded)
+        {
+            for (size_t i = 0; i < MEM_SIZE; ++i)
+                _decoded[i].length = 0;
+        }
+        if (_block_at)
+            _flush_blocks();
+        _code_page.fill(false);
+
+        _bus = 0;
+        _address = RESET_VECTOR;
+        _temp_pc = 0;
+        _alu_left = 0;
+        _alu_right = 0;
+        _alu_result = 0;
+        _cycle = 2;
+        _opcode = JMP;
+        _dest = 0;
+        _left = 0;
+        _right = 0;
+        _index = 0;
+        _inc_addr = false;
+        _load_imm = true;
+        _load_word = true;
+        _load_high = true;
+        _imm_to_idx = false;
+        _take_branch = false;
+
+        _cycles = 0;
+        _instructions = 0;
+        _halted = false;
+        _watch_hit = false;
+        _stop = NO_STOP;
+    }
+
+    void update()
+    {
+        _register[0] = 0;
+        if (_inc_addr)
+        {
+            _address += 1;
+            _inc_addr = false;
+        }
+        else
+        {
+            _address += (int8_t)_index;
+            _index = 0;
+        }
+
+        switch (_cycle)
+        {
+            case 0: _cycle_0(); break;
+            case 1: _cycle_1(); break;
+            case 2: _cycle_2(); break;
+            case 3: _cycle_3(); break;
+            case 4: _cycle_4(); break;
+            case 5: _cycle_5(); break;
+            default: break;
+        }
+
+        ++_cycles;
+        if (_cycle == 0)
+        {
+            ++_instructions;
+            SIM_COUNT_OPCODE(_opcode);
+            if (_cycles >= _next_event && !_halted) [[unlikely]]
+            { // Like _sync(), which calls update().
+                _address = _events(_address + (int8_t)_index);
+                _index = 0;
+            }
+            uint16_t pc = _address + (int8_t)_index;
+            if (_break_page[pc >> 8] && !_halted) [[unlikely]]
+                _breakpoint_hit(pc);
+        }
+    }
+
+    // Executes one whole instruction. The resulting state and cycle count are the same as if
+    // update() had been called until the instruction finished. It runs even if there is a
+    // breakpoint on it, stop() tells if it hit a watchpoint or got to a breakpoint.
+    void step()
+    {
+        _sync();
+        _catch_up_events();
+        _stop = NO_STOP;
+        uint16_t pc = _address;
+        _cycles += _execute(pc, _cycles);
+        ++_instructions;
+        _address = pc;
+        _catch_up_events(); // Like update(), takes an interrupt at the boundary it ends on.
+        if (_break_page[_address >> 8] && !_halted)
+            _breakpoint_hit(_address);
+    }
+
+    // Runs until the CPU halts, max_cycles cycles have been executed since reset or stop() says
+    // why it stopped: before an instruction at a breakpoint (but the one it starts at) or after
+    // one that hit a watchpoint. A halted CPU that an interrupt can get out of carries on (see
+    // _idle()).
+    void run(uint64_t max_cycles, Engine engine = MICRO)
+    {
+        SIM_TIME_ENGINE(engine, _cycles);
+        _stop = NO_STOP;
+        uint64_t start = _cycles;
+        _catch_up_events();
+        if (_cycle == 0 && !_halted && !_stop && _cycles < max_cycles && _breakpoint_at(pc()))
+        {
+            do
+                update();
+            while (_cycle != 0);
+        }
+        // Engines stop while a whole instruction still fits, the rest is done cycle by cycle.
+        uint64_t end = max_cycles - std::min<uint64_t>(max_cycles, MAX_INSTRUCTION_CYCLES);
+        do
+        {
+            if (engine != MICRO)
+            {
+                while (_cycle != 0 && !_halted && _cycles < max_cycles)
+                    update();
+            }
+            while (engine != MICRO && _cycle == 0 && !_halted && !_stop && _cycles < end)
+            {
+                uint16_t pc = _sync();
+                if (_cycles >= _next_event)
+                    pc = _events(pc);
+                _address = pc;
+                if (_stop) // At a breakpoint on the interrupt handler.
+                    break;
+                _limit = std::min(end, _next_event);
+                if (engine == PREDECODED)
+                {
+                    pc = _run_predecoded(pc);
+                }
+                else if (engine == THREADED)
+                {
+                    pc = _run_threaded(pc);
+                }
+                else if (engine == BLOCKS)
+                {
+                    pc = _run_blocks(pc);
+                }
+                else if (engine == JIT)
+                {
+                    pc = _run_jit(pc);
+                }
+                else
+                {
+                    pc = _run_fast(pc);
+                }
+                _address = pc;
+            }
+
+            if (!_stop) // The events due there wait for the next run.
+                _catch_up_events();
+            if (!_stop && _cycles != start && _cycle == 0 && !_halted && _break_page[pc() >> 8]) // The engines didn't get to look.
+                _breakpoint_hit(pc());
+            while (!_halted && !_stop && _cycles < max_cycles)
+                update();
+        } while (!_stop && _idle(max_cycles));
+        flush_devices();
+    }
+
+    // Puts device on the bus in place of memory, from address (a multiple of PAGE_SIZE) for
+    // device->pages() pages. Loads and stores there go to the device, instructions are still
+    // fetched from memory. Devices aren't part of snapshots, reset() and restore() leave them be.
+    // Returns false if the pages go past the end of memory or another device is on them.
+    bool attach(std::shared_ptr<Device> device, uint16_t address)
+    {
+        size_t first = address / PAGE_SIZE;
+        size_t end = first + device->pages();
+        if (address % PAGE_SIZE || end > _mapping.size())
+            return false;
+        for (size_t page = first; page < end; ++page)
+        {
+            if (_mapping[page].device)
+                return false;
+        }
+        for (size_t page = first; page < end; ++page)
+            _mapping[page] = { device.get(), address };
+        _mark_slow_pages();
+        device->connect(_scheduler);
+        _devices.push_back(std::move(device));
+        return true;
+    }
+
+    // Makes run() stop before the instruction at address whenever condition holds, replacing
+    // any breakpoint there. Breakpoints and watchpoints stay through reset() and restore().
+    void set_breakpoint(uint16_t address, Condition condition)
+    {
+        _breakpoints[address] = condition;
+        _breakpoint_changed(address);
+    }
+
+    void set_breakpoint(uint16_t address)
+    {
+        set_breakpoint(address, Condition());
+    }
+
+    void clear_breakpoint(uint16_t address)
+    {
+        _breakpoints.erase(address);
+        _breakpoint_changed(address);
+    }
+
+    // Makes run() and step() stop after an instruction that accesses one of the length bytes from
+    // address in one of the ways of access (WATCH_ flags, 0 to stop watching them). Only loads and
+    // stores are watched, not instruction fetches.
+    void set_watchpoint(uint16_t address, uint16_t length, uint8_t access)
+    {
+        for (uint16_t i = 0; i < length; ++i)
+        {
+            uint16_t byte = address + i;
+            bool watched = _watchpoints.contains(byte);
+            if (access)
+                _watchpoints[byte] = access;
+            else
+                _watchpoints.erase(byte);
+            _watched_bytes[byte >> 8] += (bool)access - watched;
+        }
+        _mark_slow_pages();
+    }
+
+    // WATCH_ flags of the watchpoint on the byte at address, 0 if there's none.
+    uint8_t watchpoint(uint16_t address) const
+    {
+        auto watchpoint = _watchpoints.find(address);
+        return watchpoint == _watchpoints.end() ? 0 : watchpoint->second;
+    }
+
+    Stop stop() const
+    {
+        return _stop;
+    }
+
+    // The byte accessed, after a WATCHPOINT stop.
+    uint16_t watched_address() const
+    {
+        return _watched;
+    }
+
+    bool has_devices() const
+    {
+        return !_devices.empty();
+    }
+
+    // Has every device hand over what it buffers, run() does it before returning.
+    void flush_devices()
+    {
+        for (const auto& device : _devices)
+            device->flush();
+    }
+
+    uint64_t cycles() const
+    {
+        return _cycles;
+    }
+
+    uint64_t instructions() const
+    {
+        return _instructions;
+    }
+
+    bool halted() const
+    {
+        return _halted;
+    }
+
+    // Could an interrupt still get the CPU out of a halt?
+    bool can_wake() const
+    {
+        return _scheduler.can_interrupt();
+    }
+
+    const std::array<uint16_t, 16>& registers() const
+    {
+        return _register;
+    }
+
+    std::span<const uint8_t, MEM_SIZE> memory() const
+    {
+        return std::span<const uint8_t, MEM_SIZE>(&_memory[0], MEM_SIZE);
+    }
+
+    void set_register(uint8_t reg, uint16_t value)
+    {
+        _register[reg & 0xF] = value;
+    }
+
+    // Address of the next instruction. Only meaningful between instructions.
+    uint16_t pc() const
+    {
+        return _address + (int8_t)_index;
+    }
+
+    // Finishes the instruction in progress, if run() stopped in the middle of one.
+    void finish_instruction()
+    {
+        _sync();
+    }
+
+    // Captures the whole state of the CPU. Pages written since the last snapshot (or restore) are
+    // copied, the others are shared with it.
+    Snapshot snapshot()
+    {
+        Snapshot snapshot;
+        for (size_t page = 0; page < _base.size(); ++page)
+        {
+            if (_dirty_page[page])
+            {
+                snapshot._written[page] = true;
+                const uint8_t* bytes = &_memory[page * PAGE_SIZE];
+                if (std::all_of(bytes, bytes + PAGE_SIZE, [](uint8_t byte) { return byte == 0; }))
+                {
+                    _base[page] = _zero_page();
+                }
+                else
+                {
+                    auto copy = std::make_shared<Snapshot::Page>();
+                    std::copy_n(bytes, PAGE_SIZE, copy->begin());
+                    _base[page] = std::move(copy);
+                }
+                _dirty_page[page] = false;
+            }
+        }
+        snapshot._pages = _base;
+        _copy_state(*this, snapshot);
+        return snapshot;
+    }
+
+    // Goes back to the state of a snapshot, which may come from another CPU. Only the pages that
+    // differ from it are copied (and their cached decodings dropped).
+    void restore(const Snapshot& snapshot)
+    {
+        for (size_t page = 0; page < _base.size(); ++page)
+        {
+            if (_dirty_page[page] || _base[page] != snapshot._pages[page])
+            {
+                load_memory(*snapshot._pages[page], page * PAGE_SIZE);
+                _dirty_page[page] = false;
+            }
+        }
+        _base = snapshot._pages;
+        _copy_state(snapshot, *this);
+        _watch_hit = false;
+    }
+
+    // Compares everything an engine could get wrong: registers, memory, the ALU result, the
+    // position in the current instruction and the statistics.
+    bool same_state(const CPU& other) const
+    {
+        return _register == other._register
+            && std::equal(&_memory[0], &_memory[MEM_SIZE], &other._memory[0])
+            && _alu_result == other._alu_result
+            && _cycle == other._cycle
+            && (uint16_t)(_address + (int8_t)_index) == (uint16_t)(other._address + (int8_t)other._index)
+            && _cycles == other._cycles
+            && _instructions == other._instructions
+            && _halted == other._halted;
+    }
+
+    template <std::ranges::forward_range Range>
+    requires std::convertible_to<std::ranges::range_value_t<Range>, uint8_t>
+    void load_memory(const Range& data, uint16_t address)
+    {
+        if constexpr (std::ranges::contiguous_range<Range> && sizeof(std::ranges::range_value_t<Range>) == 1)
+        {
+            size_t size = std::ranges::size(data);
+            if (address + size <= MEM_SIZE)
+            { // Whole pages at a time, without wrapping around
+                std::copy_n(reinterpret_cast<const uint8_t*>(std::ranges::data(data)), size, &_memory[address]);
+                if (_decoded)
+                {
+                    for (size_t i = 0; i < size + 3; ++i)
+                        _decoded[(uint16_t)(address + i - 3)].length = 0;
+                }
+                for (size_t page = address >> 8; size && page <= (address + size - 1) >> 8; ++page)
+                {
+                    _dirty_page[page] = true;
+                    uint16_t first = std::max<size_t>(address, page << 8);
+                    uint16_t last = std::min<size_t>(address + size, (page + 1) << 8) - 1;
+                    if (_code_page[page])
+                        _invalidate_blocks(first, last - first + 1);
+                }
+                return;
+            }
+        }
+        auto end = std::ranges::end(data);
+        for (auto it = std::ranges::begin(data); it != end; ++it)
+            _write_memory(address++, *it);
+    }
+
+    // Decodes the instruction at address the way the decoder and the immediate loading cycles would.
+    static Decoded decode(const uint8_t* memory, uint16_t address)
+    {
+        auto byte = [&](uint16_t offset) { return memory[(uint16_t)(address + offset)]; };
+        uint16_t instruction = byte(0) | (uint16_t)byte(1) << 8;
+
+        Decoded decoded;
+        decoded.opcode = instruction >> 12;
+        decoded.dest = (instruction >> 8) & 0xF;
+        decoded.left = (instruction >> 4) & 0xF;
+        decoded.right = instruction & 0xF;
+        decoded.immediate = 0;
+        decoded.length = 2;
+        decoded.cycles = 5;
+
+        bool immediate = decoded.right == 0;
+        switch (decoded.opcode)
+        {
+        case ADD:
+        case LSL:
+        case LSR:
+        case ASR:
+            if (immediate)
+            {
+                decoded.immediate = (int8_t)byte(2);
+                decoded.length = 3;
+            }
+            break;
+        case SUB:
+        case XOR:
+        case OR:
+        case AND:
+            if (immediate)
+            {
+                decoded.immediate = byte(2) | (uint16_t)byte(3) << 8;
+                decoded.length = 4;
+                decoded.cycles = 6;
+            }
+            break;
+        case BRA:
+            decoded.immediate = (int8_t)byte(2);
+            decoded.length = 3;
+            decoded.cycles = 6;
+            break;
+        case JMP:
+            if (decoded.left)
+            {
+                decoded.immediate = (int8_t)byte(2);
+                decoded.length = 3;
+            }
+            else if (immediate)
+            {
+                decoded.immediate = byte(2) | (uint16_t)byte(3) << 8;
+                decoded.length = 4;
+                decoded.cycles = 6;
+            }
+            break;
+        case MEM:
+            decoded.immediate = (int8_t)byte(2);
+            decoded.length = 3;
+            if (decoded.left & MEM_WORD)
+                decoded.cycles = 6;
+            break;
+        default: // reserved, always takes a register
+            immediate = false;
+            break;
+        }
+
+        switch (decoded.opcode)
+        {
+        case ADD: decoded.handler = _alu_handler<ADD>(immediate); break;
+        case SUB: decoded.handler = _alu_handler<SUB>(immediate); break;
+        case LSL: decoded.handler = _alu_handler<LSL>(immediate); break;
+        case LSR: decoded.handler = _alu_handler<LSR>(immediate); break;
+        case ASR: decoded.handler = _alu_handler<ASR>(immediate); break;
+        case XOR: decoded.handler = _alu_handler<XOR>(immediate); break;
+        case OR:  decoded.handler = _alu_handler<OR>(immediate); break;
+        case AND: decoded.handler = _alu_handler<AND>(immediate); break;
+        case BRA: decoded.handler = &_run_bra; break;
+        case JMP:
+            if (decoded.left)
+                decoded.handler = &_run_jmp_offset;
+            else if (immediate)
+                decoded.handler = &_run_jmp_word;
+            else
+                decoded.handler = &_run_jmp_register;
+            break;
+        case MEM: decoded.handler = _mem_handler(decoded.left); break;
+        default: decoded.handler = _alu_handler<RO0>(false); break;
+        }
+        return decoded;
+    }
+
+    void debug_print()
+    {
+        std::cout << std::dec << "Cycle: " << (int)_cycle << '\n';
+        std::cout << std::hex << "Instruction: " << (_opcode << 12 | (_dest << 8) | (_left << 4) | _right) << '\n';
+        std::cout << std::hex;
+        std::cout << "Address: " << _address << '\n';
+        std::cout << "Temporary PC: " << _temp_pc << '\n';
+        std::cout << "Bus: " << _bus << '\n';
+        std::cout << "ALU Left: " << _alu_left << '\n';
+        std::cout << "ALU Right: " << _alu_right << '\n';
+        std::cout << "ALU Result: " << _alu_result << '\n';
+        std::cout << "Take branch: " << _take_branch << '\n';
+        for (int i = 0; i < 16; ++i)
+            std::cout << "r" << i << ": " << _register[i] << '\n';
+    }
+
+    // Prints the final state of a headless run. Only meaningful between instructions.
+    void print_summary()
+    {
+        std::cout << std::dec;
+        std::cout << "Cycles: " << _cycles << '\n';
+        std::cout << "Instructions: " << _instructions << '\n';
+        std::cout << "Halted: " << (_halted ? "yes" : "no") << '\n';
+        std::cout << std::hex;
+        std::cout << "PC: " << pc() << '\n';
+        for (int i = 0; i < 16; ++i)
+            std::cout << "r" << std::dec << i << ": " << std::hex << _register[i] << '\n';
+    }
+};
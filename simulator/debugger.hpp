@@ -0,0 +1,362 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "history.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <thread>
+
+// A queue of up to N items from one thread to one other, without locks: the producer only writes
+// _tail, the consumer only writes _head, and each reads the other's with acquire ordering (and only
+// when the copy it kept says the queue is full or empty).
+template <class T, size_t N>
+class SpscQueue
+{
+    static_assert(N && (N & (N - 1)) == 0, "N has to be a power of 2");
+
+    // On cache lines of their own, so that the two threads don't take the line from each other.
+    alignas(64) std::atomic<uint32_t> _head = 0; // Next item to pop.
+    uint32_t _tail_seen = 0; // The consumer's copy of _tail.
+    alignas(64) std::atomic<uint32_t> _tail = 0; // Next item to push.
+    uint32_t _head_seen = 0; // The producer's copy of _head.
+    alignas(64) std::array<T, N> _items{};
+
+public:
+    // Producer only. False if the queue is full.
+    bool push(const T& item)
+    {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head_seen == N)
+        {
+            _head_seen = _head.load(std::memory_order_acquire);
+            if (tail - _head_seen == N)
+                return false;
+        }
+        _items[tail % N] = item;
+        _tail.store(tail + 1, std::memory_order_release);
+        _tail.notify_one(); // No system call unless the consumer waits.
+        return true;
+    }
+
+    // Consumer only. False if the queue is empty.
+    bool pop(T& item)
+    {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail_seen)
+        {
+            _tail_seen = _tail.load(std::memory_order_acquire);
+            if (head == _tail_seen)
+                return false;
+        }
+        item = _items[head % N];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Blocks until there is something to pop.
+    void wait() const
+    {
+        _tail.wait(_head.load(std::memory_order_relaxed), std::memory_order_acquire);
+    }
+};
+
+// The latest value of T written by one thread, for one other to read at any time without either
+// of them waiting: the writer fills one copy and the reader reads another, and they swap those
+// with the latest one through an atomic index.
+template <class T>
+class Published
+{
+    static const uint8_t _FRESH = 4; // In _middle, it hasn't been read yet.
+
+    std::array<T, 3> _copies{};
+    alignas(64) std::atomic<uint8_t> _middle = 1;
+    alignas(64) uint8_t _back = 0; // The writer's.
+    alignas(64) uint8_t _front = 2; // The reader's.
+
+public:
+    // Writer only.
+    void publish(const T& value)
+    {
+        _copies[_back] = value;
+        _back = _middle.exchange(_back | _FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    // Reader only. The latest value published, T() before the first.
+    const T& read()
+    {
+        if (_middle.load(std::memory_order_relaxed) & _FRESH)
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) & 3;
+        return _copies[_front];
+    }
+};
+
+// Runs a CPU on a thread of its own, controlled from another thread. Commands reach it through a
+// lock-free queue, which it looks at between slices of SLICE cycles (the engines end those at
+// block boundaries, so it costs them nothing) and between the instructions it steps. After every
+// slice and command it publishes the state of the CPU, which state() reads without stopping it.
+// What it has to tell the controller (why it stopped, memory it was asked for) comes back through
+// another queue. It keeps a History of the run to go back in it. The CPU mustn't be touched by
+// anything else until the debugger is destroyed.
+class Debugger
+{
+public:
+    static const uint64_t SLICE = 1 << 16;
+    static const size_t MAX_READ = 64;
+
+    enum Action : uint8_t
+    {
+        CONTINUE,
+        PAUSE,
+        STEP, // count instructions.
+        BREAK, // Stop before the instruction at address when condition holds.
+        DELETE, // The breakpoint at address.
+        WATCH, // Stop after accesses (access, WATCH_ flags of CPU, 0 to stop watching) to count bytes from address.
+        READ, // count bytes of memory from address, up to MAX_READ.
+        STEP_BACK, // count instructions.
+        CONTINUE_BACK, // To the last breakpoint or watchpoint.
+        LAST_WRITE, // Back to right after the last write of the byte at address.
+        QUIT,
+    };
+
+    struct Command
+    {
+        Action action = PAUSE;
+        uint16_t address = 0;
+        uint64_t count = 0;
+        CPU::Condition condition{};
+        uint8_t access = 0;
+    };
+
+    enum Kind : uint8_t
+    {
+        PAUSED,
+        STEPPED,
+        BREAKPOINT,
+        WATCHPOINT,
+        HALTED,
+        LIMIT, // It got to max_cycles.
+        START, // Going back, it got to the start of the history.
+        MEMORY,
+    };
+
+    struct Reply
+    {
+        Kind kind = PAUSED;
+        uint16_t address = 0; // Where it stopped, or where the bytes of MEMORY come from.
+        uint16_t watched = 0; // The byte a WATCHPOINT stop accessed.
+        uint8_t length = 0; // Of bytes.
+        std::array<uint8_t, MAX_READ> bytes{};
+    };
+
+    struct State
+    {
+        std::array<uint16_t, 16> registers{};
+        uint16_t pc = 0;
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        bool halted = false;
+        bool running = false; // Continuing or stepping, not waiting for commands.
+    };
+
+private:
+    CPU& _cpu;
+    CPU::Engine _engine;
+    uint64_t _max_cycles;
+    SpscQueue<Command, 64> _commands;
+    SpscQueue<Reply, 64> _replies;
+    Published<State> _state;
+    History _history;
+    bool _running = false;
+    uint64_t _steps = 0; // Left to step.
+    std::thread _thread;
+
+    void _publish()
+    {
+        State state;
+        state.registers = _cpu.registers();
+        state.pc = _cpu.pc();
+        state.cycles = _cpu.cycles();
+        state.instructions = _cpu.instructions();
+        state.halted = _cpu.halted();
+        state.running = _running || _steps;
+        _state.publish(state);
+    }
+
+    void _reply(const Reply& reply)
+    {
+        while (!_replies.push(reply)) // Only if the controller stopped reading them.
+            std::this_thread::yield();
+    }
+
+    void _stop(Kind kind)
+    {
+        _running = false;
+        _steps = 0;
+        _cpu.flush_devices();
+        _reply({ kind, _cpu.pc(), _cpu.watched_address() });
+    }
+
+    void _execute(const Command& command)
+    {
+        switch (command.action)
+        {
+        case CONTINUE:
+            _running = true;
+            _steps = 0;
+            break;
+        case PAUSE:
+            if (_running || _steps)
+                _stop(PAUSED);
+            break;
+        case STEP:
+            _running = false;
+            _steps += command.count;
+            break;
+        case BREAK:
+            _cpu.set_breakpoint(command.address, command.condition);
+            break;
+        case DELETE:
+            _cpu.clear_breakpoint(command.address);
+            break;
+        case WATCH:
+            _cpu.set_watchpoint(command.address, std::min<uint64_t>(command.count, CPU::MEM_SIZE), command.access);
+            break;
+        case STEP_BACK:
+            _stop(_history.step_back(_cpu, command.count) ? STEPPED : START);
+            break;
+        case CONTINUE_BACK:
+        {
+            CPU::Stop stop = _history.continue_back(_cpu);
+            _stop(stop == CPU::BREAKPOINT ? BREAKPOINT : stop == CPU::WATCHPOINT ? WATCHPOINT : START);
+            break;
+        }
+        case LAST_WRITE:
+            _stop(_history.last_write(_cpu, command.address) ? WATCHPOINT : START);
+            break;
+        case READ:
+        {
+            Reply reply{ MEMORY, command.address, 0, (uint8_t)std::min<uint64_t>(command.count, MAX_READ) };
+            for (size_t i = 0; i < reply.length; ++i)
+                reply.bytes[i] = _cpu.memory()[(uint16_t)(command.address + i)];
+            _reply(reply);
+            break;
+        }
+        case QUIT:
+            break;
+        }
+    }
+
+    // False if the CPU stopped at a breakpoint or watchpoint or went past max_cycles.
+    bool _check_stop()
+    {
+        if (_cpu.stop() == CPU::BREAKPOINT)
+            _stop(BREAKPOINT);
+        else if (_cpu.stop() == CPU::WATCHPOINT)
+            _stop(WATCHPOINT);
+        else if (_cpu.cycles() >= _max_cycles)
+            _stop(LIMIT);
+        else
+            return true;
+        return false;
+    }
+
+    // Runs a slice of up to SLICE cycles.
+    void _run()
+    {
+        uint64_t end = _cpu.cycles() + std::min(SLICE, _max_cycles - _cpu.cycles());
+        _cpu.run(end, _engine);
+        _cpu.finish_instruction();
+        if (_check_stop() && _cpu.halted() && !_cpu.can_wake())
+            _stop(HALTED);
+    }
+
+    void _simulate()
+    {
+        _history.record(_cpu);
+        while (true)
+        {
+            Command command;
+            while (_commands.pop(command))
+            {
+                if (command.action == QUIT)
+                    return;
+                _execute(command);
+            }
+            if (!_running && !_steps)
+            {
+                _publish();
+                _commands.wait();
+                continue;
+            }
+            if (_cpu.cycles() >= _max_cycles)
+            {
+                _stop(LIMIT);
+            }
+            else if (_steps)
+            { // Up to a slice of them between looks at the queue.
+                for (uint64_t i = 0; i < SLICE && _steps; ++i)
+                {
+                    --_steps;
+                    _cpu.step();
+                    if (!_check_stop())
+                        break;
+                    if (!_steps)
+                        _stop(STEPPED);
+                }
+            }
+            else
+            {
+                _run();
+            }
+            _history.record(_cpu);
+            _publish();
+        }
+    }
+
+public:
+    // Starts the thread, paused. max_cycles counts from reset, like CPU::run(). The checkpoints of
+    // the history take up to about history_budget bytes.
+    Debugger(CPU& cpu, CPU::Engine engine, uint64_t max_cycles = std::numeric_limits<uint64_t>::max(),
+        size_t history_budget = History::DEFAULT_BUDGET) :
+        _cpu(cpu), _engine(engine), _max_cycles(max_cycles), _history(engine, history_budget)
+    {
+        _thread = std::thread([this] { _simulate(); });
+    }
+
+    Debugger(const Debugger&) = delete;
+    Debugger& operator=(const Debugger&) = delete;
+
+    ~Debugger()
+    {
+        while (!send({ QUIT }))
+            std::this_thread::yield();
+        _thread.join();
+    }
+
+    // Controller only, like the three below. False if too many commands are on their way already.
+    bool send(const Command& command)
+    {
+        return _commands.push(command);
+    }
+
+    // False if there's no reply.
+    bool receive(Reply& reply)
+    {
+        return _replies.pop(reply);
+    }
+
+    // Blocks until there is a reply to receive.
+    void wait() const
+    {
+        _replies.wait();
+    }
+
+    // The CPU as of the last slice or command.
+    const State& state()
+    {
+        return _state.read();
+    }
+};
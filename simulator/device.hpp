@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+class Scheduler;
+
+// Something on the bus in place of memory, see CPU::attach(). offset is the address of the access
+// from the start of the device, cycle is the CPU's cycle count when it happens (the same in every
+// engine: update() does the access of a byte and the low byte of a word 4 cycles into the
+// instruction, the high byte one cycle later).
+class Device
+{
+public:
+    virtual ~Device() = default;
+
+    virtual uint8_t read(uint16_t offset, uint64_t cycle) = 0;
+    virtual void write(uint16_t offset, uint8_t value, uint64_t cycle) = 0;
+
+    // Hands whatever it buffers over to the host. CPU::run() calls it before returning.
+    virtual void flush() {}
+
+    // Called when it's attached, with the scheduler of the CPU.
+    virtual void connect(Scheduler&) {}
+
+    // An event the device scheduled, at the first instruction boundary at or after cycle.
+    virtual void event(uint64_t) {}
+
+    // Number of pages of the bus it takes.
+    virtual uint16_t pages() const
+    {
+        return 1;
+    }
+};
+
+// Events of the devices of a CPU in order of their cycles, and the interrupt lines they raise.
+// The engines run straight up to the first instruction boundary at or after the next event
+// without looking at devices, run the events that are due there and take an interrupt if one is
+// pending, unmasked and enabled: the address of the next instruction is kept for the handler
+// and the CPU jumps to the word at CPU::INTERRUPT_VECTOR, with interrupts disabled.
+class Scheduler
+{
+public:
+    static const uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+private:
+    struct _Event
+    {
+        uint64_t cycle;
+        uint64_t order; // Events of the same cycle run in the order they were scheduled.
+        Device* device;
+
+        bool operator>(const _Event& other) const
+        {
+            return cycle != other.cycle ? cycle > other.cycle : order > other.order;
+        }
+    };
+
+    std::vector<_Event> _events; // A min-heap.
+    uint64_t _order = 0;
+    uint8_t _pending = 0; // Raised lines, until they are acknowledged.
+    uint8_t _mask = 0; // Lines that can interrupt.
+    bool _enabled = false;
+    bool _enabling = false; // An enable is on its way, see InterruptController.
+    uint16_t _return = 0; // Address of the instruction the last interrupt came before.
+
+public:
+    // device->event() will be called at the first instruction boundary at or after cycle.
+    void schedule(Device& device, uint64_t cycle)
+    {
+        _events.push_back({ cycle, _order++, &device });
+        std::push_heap(_events.begin(), _events.end(), std::greater<>());
+    }
+
+    // Drops every event of device.
+    void cancel(Device& device)
+    {
+        std::erase_if(_events, [&](const _Event& event) { return event.device == &device; });
+        std::make_heap(_events.begin(), _events.end(), std::greater<>());
+    }
+
+    // Cycle of the next boundary anything has to happen at: 0 if an interrupt can be taken.
+    uint64_t next() const
+    {
+        if (interrupting())
+            return 0;
+        return _events.empty() ? NEVER : _events.front().cycle;
+    }
+
+    // Runs every event due at cycle, including the ones they schedule.
+    void run(uint64_t cycle)
+    {
+        while (!_events.empty() && _events.front().cycle <= cycle)
+        {
+            std::pop_heap(_events.begin(), _events.end(), std::greater<>());
+            _Event event = _events.back();
+            _events.pop_back();
+            event.device->event(event.cycle);
+        }
+    }
+
+    bool interrupting() const
+    {
+        return _enabled && (_pending & _mask);
+    }
+
+    // Could anything ever interrupt a CPU that sits there?
+    bool can_interrupt() const
+    {
+        return (_enabled || _enabling) && _mask && (_pending & _mask || !_events.empty());
+    }
+
+    // Takes the interrupt, before the instruction at pc.
+    void enter(uint16_t pc)
+    {
+        _return = pc;
+        _enabled = false;
+    }
+
+    void raise(uint8_t line)
+    {
+        _pending |= 1 << line;
+    }
+
+    void acknowledge(uint8_t lines)
+    {
+        _pending &= ~lines;
+    }
+
+    void set_mask(uint8_t mask)
+    {
+        _mask = mask;
+    }
+
+    void set_enabled(bool enabled, bool enabling = false)
+    {
+        _enabled = enabled;
+        _enabling = enabling;
+    }
+
+    uint8_t pending() const
+    {
+        return _pending;
+    }
+
+    uint8_t mask() const
+    {
+        return _mask;
+    }
+
+    bool enabled() const
+    {
+        return _enabled;
+    }
+
+    uint16_t return_address() const
+    {
+        return _return;
+    }
+};
+
+// The guest's side of the interrupts of the scheduler. Offsets 0-1: the address the last
+// interrupt came before, where the handler returns to. Offset 2: 1 if interrupts are enabled.
+// Writing 0 disables them, writing 1 enables them after the next instruction, so that a handler
+// can end with the store and a jump back without being interrupted in between. Offset 3: the
+// mask of lines that can interrupt. Offset 4: the pending lines, writing 1s acknowledges them.
+class InterruptController : public Device
+{
+    Scheduler* _scheduler = nullptr;
+
+public:
+    void connect(Scheduler& scheduler) override
+    {
+        _scheduler = &scheduler;
+    }
+
+    uint8_t read(uint16_t offset, uint64_t) override
+    {
+        switch (offset)
+        {
+        case 0: return _scheduler->return_address();
+        case 1: return _scheduler->return_address() >> 8;
+        case 2: return _scheduler->enabled();
+        case 3: return _scheduler->mask();
+        case 4: return _scheduler->pending();
+        default: return 0;
+        }
+    }
+
+    void write(uint16_t offset, uint8_t value, uint64_t cycle) override
+    {
+        if (offset == 2)
+        {
+            _scheduler->cancel(*this);
+            _scheduler->set_enabled(false, value & 1);
+            if (value & 1) // The next instruction ends at least 6 cycles after any byte of the store.
+                _scheduler->schedule(*this, cycle + 6);
+        }
+        else if (offset == 3)
+        {
+            _scheduler->set_mask(value);
+        }
+        else if (offset == 4)
+        {
+            _scheduler->acknowledge(value);
+        }
+    }
+
+    void event(uint64_t) override
+    {
+        _scheduler->set_enabled(true);
+    }
+};
+
+// Writes every byte stored to its page to a stream. They are written in batches, not a call to
+// the host per byte. Reads give 0.
+class Console : public Device
+{
+    static const size_t _BATCH = 4096;
+
+    std::ostream& _out;
+    std::string _buffer;
+
+public:
+    explicit Console(std::ostream& out) : _out(out)
+    {
+    }
+
+    ~Console() override
+    {
+        flush();
+    }
+
+    uint8_t read(uint16_t, uint64_t) override
+    {
+        return 0;
+    }
+
+    void write(uint16_t, uint8_t value, uint64_t) override
+    {
+        _buffer += (char)value;
+        if (_buffer.size() >= _BATCH)
+            flush();
+    }
+
+    void flush() override
+    {
+        if (_buffer.empty())
+            return;
+        _out.write(_buffer.data(), _buffer.size());
+        _out.flush();
+        _buffer.clear();
+    }
+};
+
+// The cycle count, 8 bytes little endian from offset 0 (repeated over the page). Reading offset 0
+// latches the count, so a program that reads from low to high gets one consistent count.
+class CycleCounter : public Device
+{
+    uint64_t _latch = 0;
+
+public:
+    uint8_t read(uint16_t offset, uint64_t cycle) override
+    {
+        offset &= 7;
+        if (offset == 0)
+            _latch = cycle;
+        return _latch >> offset * 8;
+    }
+
+    void write(uint16_t, uint8_t, uint64_t) override
+    {
+    }
+};
+
+// A periodic timer. Offsets 0-1: the period in cycles, little endian. Writing offset 1 starts
+// it over (a period of 0 stops it). Offsets 2-3: periods elapsed since the start, wrapping
+// around. Reading offset 2 latches offset 3. It raises its interrupt line at the end of every
+// period.
+class Timer : public Device
+{
+    uint8_t _line;
+    Scheduler* _scheduler = nullptr;
+    uint16_t _period = 0;
+    uint64_t _start = 0;
+    uint16_t _latch = 0;
+
+public:
+    explicit Timer(uint8_t line = 0) : _line(line)
+    {
+    }
+
+    void connect(Scheduler& scheduler) override
+    {
+        _scheduler = &scheduler;
+    }
+
+    uint8_t read(uint16_t offset, uint64_t cycle) override
+    {
+        switch (offset & 3)
+        {
+        case 0: return _period;
+        case 1: return _period >> 8;
+        case 2: _latch = _period ? (cycle - _start) / _period : 0; return _latch;
+        default: return _latch >> 8;
+        }
+    }
+
+    void write(uint16_t offset, uint8_t value, uint64_t cycle) override
+    {
+        if ((offset & 3) == 0)
+        {
+            _period = (_period & 0xFF00) | value;
+        }
+        else if ((offset & 3) == 1)
+        {
+            _period = (_period & 0x00FF) | value << 8;
+            _start = cycle;
+            _scheduler->cancel(*this);
+            if (_period)
+                _scheduler->schedule(*this, cycle + _period);
+        }
+    }
+
+    void event(uint64_t cycle) override
+    {
+        _scheduler->raise(_line);
+        if (_period) // Offset 0 alone can stop it.
+            _scheduler->schedule(*this, cycle + _period);
+    }
+};
+
+// Block storage backed by a host file, in blocks of 256 bytes. Page 0 holds the registers:
+// offsets 0-1 the block number, offset 2 the command (writing 1 reads the block into the buffer,
+// 2 writes the buffer to the block) and offset 3 the status of the last command (0 for success).
+// Page 1 is the buffer. Blocks past the end of the file read as zeros.
+class Storage : public Device
+{
+    FILE* _file = nullptr;
+    uint16_t _block = 0;
+    uint8_t _status = 0;
+    std::array<uint8_t, 256> _buffer{};
+
+    enum _Command : uint8_t
+    {
+        READ = 1,
+        WRITE = 2,
+    };
+
+    bool _read()
+    {
+        _buffer.fill(0);
+        if (std::fseek(_file, (long)_block * 256, SEEK_SET) != 0)
+            return false;
+        std::fread(_buffer.data(), 1, _buffer.size(), _file);
+        return !std::ferror(_file);
+    }
+
+    bool _write()
+    {
+        return std::fseek(_file, (long)_block * 256, SEEK_SET) == 0
+            && std::fwrite(_buffer.data(), 1, _buffer.size(), _file) == _buffer.size();
+    }
+
+public:
+    Storage() = default;
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+    ~Storage() override
+    {
+        if (_file)
+            std::fclose(_file);
+    }
+
+    // Opens filename for reading and writing, creating it if it doesn't exist.
+    bool open(const std::string& filename)
+    {
+        _file = std::fopen(filename.c_str(), "r+b");
+        if (!_file)
+            _file = std::fopen(filename.c_str(), "w+b");
+        return _file;
+    }
+
+    uint16_t pages() const override
+    {
+        return 2;
+    }
+
+    uint8_t read(uint16_t offset, uint64_t) override
+    {
+        if (offset >= 256)
+            return _buffer[offset - 256];
+        switch (offset)
+        {
+        case 0: return _block;
+        case 1: return _block >> 8;
+        case 3: return _status;
+        default: return 0;
+        }
+    }
+
+    void write(uint16_t offset, uint8_t value, uint64_t) override
+    {
+        if (offset >= 256)
+        {
+            _buffer[offset - 256] = value;
+            return;
+        }
+        if (offset == 0)
+            _block = (_block & 0xFF00) | value;
+        else if (offset == 1)
+            _block = (_block & 0x00FF) | value << 8;
+        else if (offset == 2 && value == READ)
+            _status = !_read();
+        else if (offset == 2 && value == WRITE)
+            _status = !_write();
+    }
+
+    void flush() override
+    {
+        std::fflush(_file);
+    }
+};
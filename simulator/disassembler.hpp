@@ -0,0 +1,75 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <cstdint>
+
+// Writes instructions as text, for trace decodes and profiles. Everything writes into a caller's
+// buffer and returns the end of what it wrote: reports have a line per instruction, and this is
+// much faster than streams or printf.
+class Disassembler
+{
+public:
+    // Longest line disassemble() writes.
+    static const size_t MAX_LINE = 48;
+
+    // The address, the bytes and the instruction, e.g. "0015: 37 08        add r8 r3 r7".
+    static char* disassemble(char* out, uint16_t address, const uint8_t* code)
+    {
+        static const char* mnemonics[16] = {
+            "add ", "sub ", "ro0 ", "ro1 ", "ro2 ", "ro3 ", "ro4 ", "lsl ",
+            "lsr ", "asr ", "xor ", "or  ", "and ", "bra ", "jmp ", "mem ",
+        };
+        CPU::Decoded instruction = CPU::decode(code, 0);
+        out = text(hex(out, address, 4), ": ");
+        for (uint8_t i = 0; i < 4; ++i)
+            out = i < instruction.length ? text(hex(out, code[i], 2), " ") : text(out, "   ");
+        out = text(text(out, " "), mnemonics[instruction.opcode]);
+        out = decimal(text(out, instruction.opcode == CPU::BRA ? "0x" : "r"), instruction.dest);
+        out = decimal(text(out, instruction.opcode == CPU::MEM ? " 0x" : " r"), instruction.left);
+        out = decimal(text(out, " r"), instruction.right);
+        if (instruction.length == 3)
+            out = decimal(text(out, " "), (int16_t)instruction.immediate);
+        if (instruction.length == 4)
+            out = hex(text(out, " 0x"), instruction.immediate, 4);
+        return out;
+    }
+
+    static char* text(char* out, const char* text)
+    {
+        while (*text)
+            *out++ = *text++;
+        return out;
+    }
+
+    static char* hex(char* out, uint16_t value, int digits)
+    {
+        for (int i = digits - 1; i >= 0; --i)
+            *out++ = "0123456789abcdef"[value >> i * 4 & 0xF];
+        return out;
+    }
+
+    static char* decimal(char* out, int64_t value)
+    {
+        if (value < 0)
+        {
+            *out++ = '-';
+            value = -value;
+        }
+        char digits[20];
+        int count = 0;
+        do
+            digits[count++] = '0' + value % 10;
+        while (value /= 10);
+        while (count)
+            *out++ = digits[--count];
+        return out;
+    }
+
+    // Pads with spaces from start up to column.
+    static char* pad(char* start, char* out, size_t column)
+    {
+        while (out < start + column)
+            *out++ = ' ';
+        return out;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Checkpoints of a run, to take its CPU back to any earlier point: back to the last checkpoint
+// before it, then forward again, which ends up in the same state since nothing but the program
+// changes the CPU. That doesn't hold with devices (snapshots don't hold their state, and they
+// would see everything twice), so a CPU with devices gets no checkpoints.
+//
+// A checkpoint is a CPU::Snapshot, which only copies the pages written since the one before.
+// They are taken every interval cycles; when they take more memory than the budget, every other
+// one is dropped and the interval doubles, so they stay spread over the whole run and going back
+// never replays more than one interval (a few milliseconds, whatever the length of the run).
+class History
+{
+public:
+    static const uint64_t INTERVAL = 1 << 20; // Cycles between checkpoints to start with.
+    static const size_t DEFAULT_BUDGET = 64 << 20;
+
+private:
+    struct _Checkpoint
+    {
+        CPU::Snapshot snapshot;
+        std::bitset<CPU::MEM_SIZE / CPU::PAGE_SIZE> written{}; // Pages written since the one before.
+        size_t bytes = 0; // Memory it takes that the one before doesn't.
+    };
+
+    CPU::Engine _engine;
+    size_t _budget;
+    uint64_t _interval = INTERVAL;
+    std::vector<_Checkpoint> _checkpoints;
+    size_t _bytes = 0;
+    // Pages the newest checkpoint wrote when _thin() drops it, which the next one's written only
+    // counts from it.
+    std::bitset<CPU::MEM_SIZE / CPU::PAGE_SIZE> _dropped_written;
+
+    static size_t _cost(const _Checkpoint& checkpoint, const _Checkpoint* previous)
+    {
+        return sizeof(_Checkpoint) + checkpoint.snapshot.bytes_since(previous ? &previous->snapshot : nullptr);
+    }
+
+    // Drops every other checkpoint but the first. What they wrote goes to the one after them.
+    void _thin()
+    {
+        size_t kept = 1;
+        for (size_t i = 1; i < _checkpoints.size(); ++i)
+        {
+            if (i % 2)
+                (i + 1 < _checkpoints.size() ? _checkpoints[i + 1].written : _dropped_written) |= _checkpoints[i].written;
+            else
+                _checkpoints[kept++] = std::move(_checkpoints[i]);
+        }
+        _checkpoints.resize(kept);
+        _bytes = 0;
+        for (size_t i = 0; i < _checkpoints.size(); ++i)
+            _bytes += _checkpoints[i].bytes = _cost(_checkpoints[i], i ? &_checkpoints[i - 1] : nullptr);
+        _interval *= 2;
+    }
+
+    // Goes back to checkpoint and forward to the boundary after instructions instructions. The
+    // checkpoints after it are dropped: the next ones are taken from the new state.
+    void _replay(CPU& cpu, size_t checkpoint, uint64_t instructions)
+    {
+        while (_checkpoints.size() > checkpoint + 1)
+        {
+            _bytes -= _checkpoints.back().bytes;
+            _checkpoints.pop_back();
+        }
+        _dropped_written.reset();
+        cpu.restore(_checkpoints[checkpoint].snapshot);
+        // The checkpoint at the start is in the middle of the reset, which step() would finish
+        // and then do another instruction.
+        if (cpu.instructions() < instructions)
+            cpu.finish_instruction();
+        while (cpu.instructions() < instructions)
+        {
+            // No more than left - 1 whole instructions fit in the cycles of the run, and the one
+            // it may stop in the middle of is finished, so it can't go past.
+            uint64_t left = instructions - cpu.instructions();
+            if (left > 1 && !cpu.halted())
+                cpu.run(cpu.cycles() + (left - 1) * CPU::MIN_INSTRUCTION_CYCLES, _engine);
+            else
+                cpu.step();
+            cpu.finish_instruction();
+        }
+    }
+
+    // Goes back to the last point before the current one where run() stops (before a breakpoint,
+    // after a watchpoint) and wanted(cpu) holds there. Looks for it one interval at a time, from
+    // the last one, skipping the ones skip(checkpoint after the interval) says it can't be in.
+    // Goes back to the first checkpoint and returns NO_STOP if there is none.
+    template <class Wanted, class Skip>
+    CPU::Stop _back(CPU& cpu, Wanted wanted, Skip skip)
+    {
+        if (_checkpoints.empty())
+            return CPU::NO_STOP;
+        uint64_t cycles = cpu.cycles();
+        uint64_t instructions = cpu.instructions();
+        for (size_t checkpoint = _checkpoints.size(); checkpoint-- > 0;)
+        {
+            bool last = checkpoint + 1 == _checkpoints.size();
+            if (_checkpoints[checkpoint].snapshot.instructions() >= instructions || (!last && skip(_checkpoints[checkpoint + 1])))
+                continue;
+            uint64_t end = last ? cycles : _checkpoints[checkpoint + 1].snapshot.cycles();
+            cpu.restore(_checkpoints[checkpoint].snapshot);
+            CPU::Stop found = CPU::NO_STOP;
+            uint64_t found_at = 0;
+            do
+            {
+                cpu.run(end, _engine);
+                if (cpu.stop() != CPU::NO_STOP && cpu.instructions() < instructions && wanted(cpu))
+                {
+                    found = cpu.stop();
+                    found_at = cpu.instructions();
+                }
+            } while (cpu.stop() != CPU::NO_STOP);
+            if (found != CPU::NO_STOP)
+            {
+                _replay(cpu, checkpoint, found_at);
+                return found;
+            }
+        }
+        _replay(cpu, 0, 0);
+        return CPU::NO_STOP;
+    }
+
+public:
+    // Checkpoints replay with engine and take up to about budget bytes (0 for no checkpoints).
+    explicit History(CPU::Engine engine, size_t budget = DEFAULT_BUDGET) : _engine(engine), _budget(budget)
+    {
+    }
+
+    // Takes a checkpoint if the last one is interval cycles old. The CPU should be between
+    // instructions, or at the start.
+    void record(CPU& cpu)
+    {
+        if (!_budget || cpu.has_devices())
+            return;
+        if (!_checkpoints.empty() && cpu.cycles() < _checkpoints.back().snapshot.cycles() + _interval)
+            return;
+        _Checkpoint checkpoint{ cpu.snapshot() };
+        checkpoint.written = checkpoint.snapshot.written_pages() | _dropped_written;
+        _dropped_written.reset();
+        checkpoint.bytes = _cost(checkpoint, _checkpoints.empty() ? nullptr : &_checkpoints.back());
+        _bytes += checkpoint.bytes;
+        _checkpoints.push_back(std::move(checkpoint));
+        while (_bytes > _budget && _checkpoints.size() > 1)
+            _thin();
+    }
+
+    // Goes back count instructions, or as far as the first checkpoint if that's too far (then
+    // returns false).
+    bool step_back(CPU& cpu, uint64_t count)
+    {
+        if (_checkpoints.empty())
+            return false;
+        uint64_t instructions = cpu.instructions() - std::min(count, cpu.instructions());
+        if (instructions < _checkpoints.front().snapshot.instructions())
+        {
+            _replay(cpu, 0, 0);
+            return false;
+        }
+        size_t checkpoint = _checkpoints.size() - 1;
+        while (_checkpoints[checkpoint].snapshot.instructions() > instructions)
+            --checkpoint;
+        _replay(cpu, checkpoint, instructions);
+        return true;
+    }
+
+    // Goes back to the last breakpoint or watchpoint run() would have stopped at. NO_STOP if
+    // there is none in the history, at the first checkpoint.
+    CPU::Stop continue_back(CPU& cpu)
+    {
+        return _back(cpu, [](const CPU&) { return true; }, [](const _Checkpoint&) { return false; });
+    }
+
+    // Goes back to right after the last instruction that wrote the byte at address, false if
+    // none in the history did (at the first checkpoint). Only the intervals that wrote to its page
+    // are replayed.
+    bool last_write(CPU& cpu, uint16_t address)
+    {
+        uint8_t watched = cpu.watchpoint(address);
+        cpu.set_watchpoint(address, 1, CPU::WATCH_WRITE);
+        CPU::Stop stop = _back(cpu,
+            [&](const CPU& stopped) { return stopped.stop() == CPU::WATCHPOINT && stopped.watched_address() == address; },
+            [&](const _Checkpoint& after) { return !after.written[address / CPU::PAGE_SIZE]; });
+        cpu.set_watchpoint(address, 1, watched);
+        return stop != CPU::NO_STOP;
+    }
+
+    size_t checkpoints() const
+    {
+        return _checkpoints.size();
+    }
+
+    // Memory the checkpoints take.
+    size_t bytes() const
+    {
+        return _bytes;
+    }
+};
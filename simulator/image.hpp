@@ -0,0 +1,206 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SIM_MMAP
+#endif
+
+// A program image, mapped read only from its file and loaded into memory from the mapping.
+//
+// An image is either raw or sparse. A raw image is the bytes of memory from address 0, up to the
+// whole 64 KiB (the rest of memory stays 0, and so does the reset vector, which then jumps to 0).
+// A sparse image starts with the 4 bytes "SIM1" and is followed by segments: a 2 byte address,
+// a 2 byte length (both little endian) and that many bytes to load at the address. Segments
+// can't go past the end of memory, later segments overwrite earlier ones.
+class Image
+{
+public:
+    struct Segment
+    {
+        uint16_t address;
+        std::span<const uint8_t> bytes; // Into the mapping.
+    };
+
+    static constexpr char SPARSE_MAGIC[4] = { 'S', 'I', 'M', '1' };
+
+private:
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+    bool _mapped = false;
+    std::vector<uint8_t> _copy; // The file, where it can't be mapped.
+    std::vector<Segment> _segments;
+    std::string _error;
+
+    void _close()
+    {
+#ifdef SIM_MMAP
+        if (_mapped)
+            munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+        _data = nullptr;
+        _size = 0;
+        _mapped = false;
+        _copy.clear();
+        _segments.clear();
+    }
+
+    bool _map(const std::string& filename)
+    {
+#ifdef SIM_MMAP
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat status;
+        bool ok = fstat(fd, &status) == 0;
+        if (ok && status.st_size > 0)
+        {
+            void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = data != MAP_FAILED;
+            if (ok)
+            {
+                _data = static_cast<const uint8_t*>(data);
+                _size = status.st_size;
+                _mapped = true;
+            }
+        }
+        ::close(fd);
+        return ok;
+#else
+        std::ifstream file(filename, file.binary | file.ate);
+        if (!file)
+            return false;
+        _copy.resize(file.tellg());
+        file.seekg(file.beg);
+        file.read(reinterpret_cast<char*>(_copy.data()), _copy.size());
+        _data = _copy.data();
+        _size = _copy.size();
+        return bool(file);
+#endif
+    }
+
+    bool _parse()
+    {
+        if (_size == CPU::MEM_SIZE || _size < sizeof(SPARSE_MAGIC) || !std::equal(SPARSE_MAGIC, SPARSE_MAGIC + 4, _data))
+        { // Raw
+            if (_size > CPU::MEM_SIZE)
+            {
+                _error = "larger than memory";
+                return false;
+            }
+            if (_size)
+                _segments.push_back({ 0, { _data, _size } });
+            return true;
+        }
+
+        for (size_t offset = sizeof(SPARSE_MAGIC); offset < _size;)
+        {
+            if (_size - offset < 4)
+            {
+                _error = "truncated segment header at offset " + std::to_string(offset);
+                return false;
+            }
+            uint16_t address = _data[offset] | _data[offset + 1] << 8;
+            uint16_t length = _data[offset + 2] | _data[offset + 3] << 8;
+            offset += 4;
+            if (_size - offset < length)
+            {
+                _error = "truncated segment at offset " + std::to_string(offset);
+                return false;
+            }
+            if (address + length > CPU::MEM_SIZE)
+            {
+                _error = "segment at offset " + std::to_string(offset) + " goes past the end of memory";
+                return false;
+            }
+            _segments.push_back({ address, { _data + offset, length } });
+            offset += length;
+        }
+        return true;
+    }
+
+public:
+    Image() = default;
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    ~Image()
+    {
+        _close();
+    }
+
+    // Maps the file and reads its segments. Returns false (see error()) if it can't be read or
+    // isn't a valid image.
+    bool open(const std::string& filename)
+    {
+        _close();
+        _error.clear();
+        if (!_map(filename))
+        {
+            _error = "can't read " + filename;
+            return false;
+        }
+        return _parse();
+    }
+
+    const std::vector<Segment>& segments() const
+    {
+        return _segments;
+    }
+
+    const std::string& error() const
+    {
+        return _error;
+    }
+
+    // Copies the segments into the memory of cpu.
+    void load(CPU& cpu) const
+    {
+        for (const Segment& segment : _segments)
+            cpu.load_memory(segment.bytes, segment.address);
+    }
+
+    // Writes memory as a sparse image, with a segment for every run of non-zero bytes (runs
+    // closer than a segment header are merged). Returns false if the file can't be written.
+    static bool write_sparse(const std::string& filename, std::span<const uint8_t, CPU::MEM_SIZE> memory)
+    {
+        std::ofstream file(filename, file.binary);
+        file.write(SPARSE_MAGIC, sizeof(SPARSE_MAGIC));
+        for (size_t start = 0; start < CPU::MEM_SIZE;)
+        {
+            if (memory[start] == 0)
+            {
+                ++start;
+                continue;
+            }
+            size_t end = start + 1;
+            for (size_t zeros = 0; end + zeros < CPU::MEM_SIZE && zeros <= 4 && end + zeros - start < 0xFFFF;)
+            {
+                if (memory[end + zeros] != 0)
+                {
+                    end += zeros + 1;
+                    zeros = 0;
+                }
+                else
+                {
+                    ++zeros;
+                }
+            }
+            uint8_t header[4] = { (uint8_t)start, (uint8_t)(start >> 8), (uint8_t)(end - start), (uint8_t)((end - start) >> 8) };
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(&memory[start]), end - start);
+            start = end;
+        }
+        return bool(file);
+    }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+// The JIT only targets x86-64 Linux. Everywhere else (or with SIM_NO_JIT) the JIT engine runs on
+// the interpreter instead.
+#if defined(__linux__) && defined(__x86_64__) && !defined(SIM_NO_JIT)
+#define SIM_JIT
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+// A buffer of executable memory and just enough of an x86-64 encoder for the code the JIT emits.
+// Every instruction is written at the end of the buffer; callers make sure there's room first.
+class X64
+{
+public:
+    enum Reg : uint8_t
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    enum Cond : uint8_t
+    {
+        B = 0x2,
+        AE = 0x3,
+        E = 0x4,
+        NE = 0x5,
+        BE = 0x6,
+        A = 0x7,
+        L = 0xC,
+        GE = 0xD,
+        LE = 0xE,
+        G = 0xF,
+    };
+
+    // [base + index * 2^scale + disp]
+    struct Mem
+    {
+        Reg base;
+        int8_t index = -1;
+        uint8_t scale = 0;
+        int32_t disp = 0;
+    };
+
+private:
+    uint8_t* _begin = nullptr;
+    uint8_t* _at = nullptr;
+    size_t _size = 0;
+
+    void _byte(uint8_t value)
+    {
+        *_at++ = value;
+    }
+
+    void _dword(uint32_t value)
+    {
+        std::memcpy(_at, &value, 4);
+        _at += 4;
+    }
+
+    // REX prefix for an operand size of 64 bits (w), a ModRM reg field and the registers used by
+    // the other operand. byte_reg forces it for spl/bpl/sil/dil.
+    void _rex(bool w, uint8_t reg, uint8_t index, uint8_t base, bool byte_reg = false)
+    {
+        uint8_t rex = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+        if (rex != 0x40 || byte_reg)
+            _byte(rex);
+    }
+
+    void _modrm(uint8_t mod, uint8_t reg, uint8_t rm)
+    {
+        _byte(mod << 6 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void _mem(uint8_t reg, const Mem& mem)
+    {
+        uint8_t mod = 2;
+        if (mem.disp == 0 && (mem.base & 7) != RBP)
+            mod = 0;
+        else if (mem.disp >= -128 && mem.disp <= 127)
+            mod = 1;
+
+        if (mem.index >= 0 || (mem.base & 7) == RSP)
+        {
+            _modrm(mod, reg, RSP);
+            uint8_t index = mem.index >= 0 ? (uint8_t)mem.index : (uint8_t)RSP;
+            _byte(mem.scale << 6 | (index & 7) << 3 | (mem.base & 7));
+        }
+        else
+        {
+            _modrm(mod, reg, mem.base);
+        }
+
+        if (mod == 1)
+            _byte(mem.disp);
+        else if (mod == 2)
+            _dword(mem.disp);
+    }
+
+    // opcode with a register in the ModRM reg field and a register in the r/m field.
+    void _rr(bool w, uint32_t opcode, uint8_t reg, uint8_t rm, bool byte_reg = false)
+    {
+        _rex(w, reg, 0, rm, byte_reg && (rm & 7) >= 4);
+        _opcode(opcode);
+        _modrm(3, reg, rm);
+    }
+
+    // opcode with a register (or /digit) in the ModRM reg field and memory in the r/m field.
+    void _rm(bool w, uint32_t opcode, uint8_t reg, const Mem& mem, bool byte_reg = false)
+    {
+        _rex(w, reg, mem.index >= 0 ? mem.index : 0, mem.base, byte_reg && (reg & 7) >= 4);
+        _opcode(opcode);
+        _mem(reg, mem);
+    }
+
+    // One or two byte opcodes (0x0F xx are written as 0x0Fxx).
+    void _opcode(uint32_t opcode)
+    {
+        if (opcode > 0xFF)
+            _byte(opcode >> 8);
+        _byte(opcode);
+    }
+
+public:
+    X64() = default;
+    X64(const X64&) = delete;
+    X64& operator=(const X64&) = delete;
+
+    ~X64()
+    {
+        if (_begin)
+            munmap(_begin, _size);
+    }
+
+    // Maps size bytes of writable and executable memory. Returns false if the system refuses.
+    bool allocate(size_t size)
+    {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return false;
+        _begin = _at = static_cast<uint8_t*>(memory);
+        _size = size;
+        return true;
+    }
+
+    uint8_t* here() const
+    {
+        return _at;
+    }
+
+    size_t remaining() const
+    {
+        return _size - (_at - _begin);
+    }
+
+    // Forgets everything written after at.
+    void rewind(uint8_t* at)
+    {
+        _at = at;
+    }
+
+    // Points the rel32 at the given address to target.
+    static void patch(uint8_t* rel32, const uint8_t* target)
+    {
+        int32_t offset = target - (rel32 + 4);
+        std::memcpy(rel32, &offset, 4);
+    }
+
+    // Where the rel32 at the given address currently points.
+    static uint8_t* target(uint8_t* rel32)
+    {
+        int32_t offset;
+        std::memcpy(&offset, rel32, 4);
+        return rel32 + 4 + offset;
+    }
+
+    // 32 bit register operations. Writing a 32 bit register clears the upper half of the 64 bit one.
+    void mov(Reg dest, Reg src) { _rr(false, 0x8B, dest, src); }
+    void mov(Reg dest, uint32_t value) { _rex(false, 0, 0, dest); _byte(0xB8 | (dest & 7)); _dword(value); }
+    void add(Reg dest, Reg src) { _rr(false, 0x03, dest, src); }
+    void sub(Reg dest, Reg src) { _rr(false, 0x2B, dest, src); }
+    void xor_(Reg dest, Reg src) { _rr(false, 0x33, dest, src); }
+    void or_(Reg dest, Reg src) { _rr(false, 0x0B, dest, src); }
+    void and_(Reg dest, Reg src) { _rr(false, 0x23, dest, src); }
+    void cmp(Reg left, Reg right) { _rr(false, 0x3B, left, right); }
+    void add(Reg dest, uint32_t value) { _rr(false, 0x81, 0, dest); _dword(value); }
+    void sub(Reg dest, uint32_t value) { _rr(false, 0x81, 5, dest); _dword(value); }
+    void xor_(Reg dest, uint32_t value) { _rr(false, 0x81, 6, dest); _dword(value); }
+    void or_(Reg dest, uint32_t value) { _rr(false, 0x81, 1, dest); _dword(value); }
+    void and_(Reg dest, uint32_t value) { _rr(false, 0x81, 4, dest); _dword(value); }
+    void shl(Reg dest, uint8_t count) { _rr(false, 0xC1, 4, dest); _byte(count); }
+    void shr(Reg dest, uint8_t count) { _rr(false, 0xC1, 5, dest); _byte(count); }
+    void sar(Reg dest, uint8_t count) { _rr(false, 0xC1, 7, dest); _byte(count); }
+    void shl_cl(Reg dest) { _rr(false, 0xD3, 4, dest); }
+    void shr_cl(Reg dest) { _rr(false, 0xD3, 5, dest); }
+    void sar_cl(Reg dest) { _rr(false, 0xD3, 7, dest); }
+    void movzx16(Reg dest, Reg src) { _rr(false, 0x0FB7, dest, src); }
+    void movsx16(Reg dest, Reg src) { _rr(false, 0x0FBF, dest, src); }
+
+    // 16 bit register operation, for wrapping an address without touching the upper half.
+    void add16(Reg dest, int8_t value) { _byte(0x66); _rr(false, 0x83, 0, dest); _byte(value); }
+
+    // Loads and stores.
+    void movzx8(Reg dest, const Mem& src) { _rm(false, 0x0FB6, dest, src); }
+    void movsx8(Reg dest, const Mem& src) { _rm(false, 0x0FBE, dest, src); }
+    void movzx16(Reg dest, const Mem& src) { _rm(false, 0x0FB7, dest, src); }
+    void mov8(const Mem& dest, Reg src) { _rm(false, 0x88, src, dest, true); }
+    void mov8(const Mem& dest, uint8_t value) { _rm(false, 0xC6, 0, dest); _byte(value); }
+    void mov16(const Mem& dest, Reg src) { _byte(0x66); _rm(false, 0x89, src, dest); }
+    void mov16(const Mem& dest, uint16_t value) { _byte(0x66); _rm(false, 0xC7, 0, dest); _byte(value); _byte(value >> 8); }
+    void mov32(const Mem& dest, uint32_t value) { _rm(false, 0xC7, 0, dest); _dword(value); }
+    void mov32(const Mem& dest, Reg src) { _rm(false, 0x89, src, dest); }
+    void mov64(Reg dest, const Mem& src) { _rm(true, 0x8B, dest, src); }
+    void mov64(const Mem& dest, Reg src) { _rm(true, 0x89, src, dest); }
+    void cmp8(const Mem& left, uint8_t value) { _rm(false, 0x80, 7, left); _byte(value); }
+    void add64(const Mem& dest, uint32_t value) { _rm(true, 0x81, 0, dest); _dword(value); }
+    void sub64(const Mem& dest, uint32_t value) { _rm(true, 0x81, 5, dest); _dword(value); }
+
+    // 64 bit register operations.
+    void mov64(Reg dest, Reg src) { _rr(true, 0x8B, dest, src); }
+    void mov64(Reg dest, uint64_t value) { _rex(true, 0, 0, dest); _byte(0xB8 | (dest & 7)); _dword(value); _dword(value >> 32); }
+    void test64(Reg left, Reg right) { _rr(true, 0x85, right, left); }
+    void add64(Reg dest, uint32_t value) { _rr(true, 0x81, 0, dest); _dword(value); }
+    void sub64(Reg dest, uint32_t value) { _rr(true, 0x81, 5, dest); _dword(value); }
+    void push(Reg reg) { _rex(false, 0, 0, reg); _byte(0x50 | (reg & 7)); }
+    void pop(Reg reg) { _rex(false, 0, 0, reg); _byte(0x58 | (reg & 7)); }
+
+    // Control flow. The rel32 versions return the address of their offset, for patching later.
+    uint8_t* jmp(const uint8_t* target = nullptr)
+    {
+        _byte(0xE9);
+        uint8_t* rel32 = _at;
+        _dword(0);
+        if (target)
+            patch(rel32, target);
+        return rel32;
+    }
+
+    uint8_t* jcc(Cond cond, const uint8_t* target = nullptr)
+    {
+        _byte(0x0F);
+        _byte(0x80 | cond);
+        uint8_t* rel32 = _at;
+        _dword(0);
+        if (target)
+            patch(rel32, target);
+        return rel32;
+    }
+
+    void jmp(Reg target) { _rr(false, 0xFF, 4, target); }
+    void ret() { _byte(0xC3); }
+    void rep_movsb() { _byte(0xF3); _byte(0xA4); }
+};
+
+#endif
@@ -0,0 +1,402 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Runs many CPUs that execute the same program in lockstep. CPUs are packed LANES at a time into
+// groups that hold their registers lane by lane (structure of arrays), and every step runs one
+// instruction for all the lanes of a group that are at the same address, with the others
+// masked off. Lanes are GCC/clang vectors of uint16_t as wide as the widest registers the build
+// targets: 16 lanes with AVX2 (-mavx2 or -march=native), 8 lanes with SSE2 otherwise. Memory stays
+// in each CPU, loads and stores are done lane by lane.
+class Lockstep
+{
+public:
+#ifdef __AVX2__
+    static const size_t LANES = 16;
+#else
+    static const size_t LANES = 8;
+#endif
+
+private:
+    using Vector = uint16_t __attribute__((vector_size(2 * LANES)));
+    using Signed = int16_t __attribute__((vector_size(2 * LANES)));
+
+    // Spent cycles are added to the totals before they could overflow a lane.
+    static const uint16_t _MAX_HEADROOM = 0x7FFF;
+    static const size_t _SLICE = 1024; // Steps a group runs before the others get a turn.
+
+    struct _Group
+    {
+        Vector reg[16] = {}; // reg[register][lane]
+        Vector pc = {};
+        Vector alu_result = {};
+        Vector occupied = {}; // 0xFFFF in the lanes that hold a CPU.
+        Vector spent = {}; // Cycles since the totals were last updated.
+        Vector retired = {}; // Instructions since the totals were last updated.
+        Vector headroom = {}; // Cycles a lane can spend before the totals must be looked at.
+        std::array<uint64_t, LANES> cycles{};
+        std::array<uint64_t, LANES> instructions{};
+        std::array<CPU*, LANES> cpu{}; // nullptr if the lane is empty.
+        size_t live = 0; // Number of lanes with a CPU.
+    };
+
+    std::vector<_Group> _groups;
+    std::array<bool, CPU::MEM_SIZE / 256> _written_page{}; // Pages where lanes may disagree on code.
+    std::unique_ptr<CPU::Decoded[]> _decoded; // Instructions on the other pages, by address.
+    uint64_t _limit = 0;
+    uint64_t _steps = 0;
+    uint64_t _lane_steps = 0;
+
+    static bool _any(const Vector& v)
+    {
+        uint64_t words[sizeof(v) / 8];
+        std::memcpy(words, &v, sizeof(v));
+        uint64_t any = 0;
+        for (uint64_t word : words)
+            any |= word;
+        return any;
+    }
+
+    static Vector _select(const Vector& mask, const Vector& a, const Vector& b)
+    {
+        return (a & mask) | (b & ~mask);
+    }
+
+    // Vector with value in every lane. Broadcast as pairs of lanes, 16 bit broadcasts sometimes
+    // go through the stack.
+    static Vector _splat(uint16_t value)
+    {
+        using Pairs = uint32_t __attribute__((vector_size(2 * LANES)));
+        return (Vector)(Pairs{} + value * 0x10001u);
+    }
+
+    // Number of lanes set in mask.
+    static size_t _count(const Vector& mask)
+    {
+        uint64_t words[sizeof(mask) / 8];
+        std::memcpy(words, &mask, sizeof(mask));
+        size_t bits = 0;
+        for (uint64_t word : words)
+            bits += std::popcount(word);
+        return bits / 16;
+    }
+
+    // Lowest value in any lane.
+    static uint16_t _min(const Vector& v)
+    {
+        uint16_t min = v[0];
+        for (size_t lane = 1; lane < LANES; ++lane)
+            min = std::min<uint16_t>(min, v[lane]);
+        return min;
+    }
+
+    // Adds what the lane spent to its totals. Returns false if it can't start another instruction.
+    bool _settle(_Group& group, size_t lane)
+    {
+        group.cycles[lane] += group.spent[lane];
+        group.instructions[lane] += group.retired[lane];
+        group.spent[lane] = 0;
+        group.retired[lane] = 0;
+        if (group.cycles[lane] >= _limit)
+            return false;
+        group.headroom[lane] = std::min<uint64_t>(_limit - group.cycles[lane], _MAX_HEADROOM);
+        return true;
+    }
+
+    // Moves cpu into a free lane of group. The CPU must be between instructions, with cycles left.
+    void _enter(_Group& group, size_t lane, CPU* cpu)
+    {
+        for (size_t r = 0; r < 16; ++r)
+            group.reg[r][lane] = cpu->_register[r];
+        group.pc[lane] = cpu->_address;
+        group.alu_result[lane] = cpu->_alu_result;
+        group.cycles[lane] = cpu->_cycles;
+        group.instructions[lane] = cpu->_instructions;
+        group.occupied[lane] = 0xFFFF;
+        group.cpu[lane] = cpu;
+        _settle(group, lane);
+        ++group.live;
+    }
+
+    // Writes the lane back to its CPU and empties it.
+    void _leave(_Group& group, size_t lane, bool halted = false)
+    {
+        _settle(group, lane);
+        CPU* cpu = group.cpu[lane];
+        for (size_t r = 0; r < 16; ++r)
+            cpu->_register[r] = group.reg[r][lane];
+        cpu->_address = group.pc[lane];
+        cpu->_index = 0;
+        cpu->_alu_result = group.alu_result[lane];
+        cpu->_cycles = group.cycles[lane];
+        cpu->_instructions = group.instructions[lane];
+        cpu->_halted = halted;
+        group.occupied[lane] = 0;
+        group.cpu[lane] = nullptr;
+        --group.live;
+    }
+
+    // Packs cpus into as few groups as possible, sorted by address so that lanes that are at the
+    // same place in the program end up together.
+    void _pack(std::vector<CPU*>& cpus)
+    {
+        std::ranges::stable_sort(cpus, {}, [](const CPU* cpu) { return cpu->_address; });
+        _groups.assign((cpus.size() + LANES - 1) / LANES, _Group());
+        for (size_t i = 0; i < cpus.size(); ++i)
+            _enter(_groups[i / LANES], i % LANES, cpus[i]);
+    }
+
+    // Empties every group and packs the lanes again.
+    void _regroup()
+    {
+        std::vector<CPU*> cpus;
+        for (_Group& group : _groups)
+        {
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (group.cpu[lane])
+                {
+                    cpus.push_back(group.cpu[lane]);
+                    _leave(group, lane);
+                }
+            }
+        }
+        _pack(cpus);
+    }
+
+    // Runs one instruction in every lane of group at the lowest address any lane is at (the
+    // lanes that are behind catch up, so branches that split the group usually rejoin at the
+    // lowest common address). Returns the number of lanes that ran it.
+    size_t _step(_Group& group)
+    {
+        uint16_t pc = _min(group.pc | ~group.occupied); // Empty lanes are out of the way at 0xFFFF.
+        Vector mask = (Vector)(group.pc == _splat(pc)) & group.occupied; // 0xFFFF in the lanes that run.
+
+        // Decoded once for every lane, except where lanes may have different code: there, only the
+        // lanes with the same bytes as the first one run and the instruction is decoded each time.
+        if (_written_page[pc >> 8] || _written_page[(uint16_t)(pc + 3) >> 8])
+        {
+            size_t leader = 0;
+            while (!mask[leader])
+                ++leader;
+            const uint8_t* code = &group.cpu[leader]->_memory[0];
+            _decoded[pc] = CPU::decode(code, pc);
+            uint16_t same[LANES];
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                const uint8_t* memory = mask[lane] ? &group.cpu[lane]->_memory[0] : code;
+                same[lane] = 0xFFFF;
+                for (uint8_t i = 0; i < _decoded[pc].length; ++i)
+                {
+                    if (memory[(uint16_t)(pc + i)] != code[(uint16_t)(pc + i)])
+                        same[lane] = 0;
+                }
+            }
+            Vector keep;
+            std::memcpy(&keep, same, sizeof(keep));
+            mask &= keep;
+        }
+        else if (_decoded[pc].length == 0)
+        {
+            size_t lane = 0;
+            while (!mask[lane])
+                ++lane;
+            _decoded[pc] = CPU::decode(&group.cpu[lane]->_memory[0], pc);
+        }
+        const CPU::Decoded& instruction = _decoded[pc];
+
+        Vector* reg = group.reg;
+        uint16_t next = pc + instruction.length;
+        reg[0] &= ~mask;
+        group.spent += mask & _splat(instruction.cycles);
+        group.retired += mask & 1;
+        Vector left = reg[instruction.left];
+        Vector right = reg[instruction.right] + _splat(instruction.immediate);
+        Vector result = {}; // Of instructions that write the destination register.
+        Vector target = _splat(next); // Next address
+        bool alu = instruction.opcode <= CPU::AND && instruction.opcode != CPU::RO0;
+        bool writes = true;
+        switch (instruction.opcode)
+        {
+        case CPU::ADD: result = left + right; break;
+        case CPU::SUB: result = left - right; break;
+        case CPU::LSL: result = left << (right & 0xF); break;
+        case CPU::LSR: result = left >> (right & 0xF); break;
+        case CPU::ASR: result = (Vector)((Signed)left >> (Signed)(right & 0xF)); break;
+        case CPU::XOR: result = left ^ right; break;
+        case CPU::OR:  result = left | right; break;
+        case CPU::AND: result = left & right; break;
+        case CPU::BRA:
+        {
+            writes = false;
+            uint8_t flags = instruction.dest;
+            right = reg[instruction.right];
+            Vector taken = {};
+            if (flags & CPU::BRA_EQ)
+                taken |= (Vector)(left == right);
+            if (flags & CPU::BRA_LT)
+                taken |= flags & CPU::BRA_U ? (Vector)(left < right) : (Vector)((Signed)left < (Signed)right);
+            if (flags & CPU::BRA_NOT)
+                taken = ~taken;
+            target = _select(taken, target + _splat(instruction.immediate), target);
+            if ((int16_t)instruction.immediate == -3 && _any(taken & mask))
+            { // Halting lanes leave right away.
+                for (size_t lane = 0; lane < LANES; ++lane)
+                {
+                    if (mask[lane] & taken[lane])
+                    {
+                        group.pc[lane] = target[lane];
+                        _leave(group, lane, true);
+                    }
+                }
+                mask &= ~taken;
+            }
+            break;
+        }
+        case CPU::JMP:
+            result = _splat(next);
+            if (instruction.left && instruction.right == 0)
+                target = _splat(instruction.immediate);
+            else if (instruction.left) // The target register is read after the return address is written.
+                target = (instruction.right == instruction.dest ? result : reg[instruction.right]) + _splat(instruction.immediate);
+            else if (instruction.right)
+                target = reg[instruction.right];
+            else
+                target = _splat(instruction.immediate);
+            break;
+        case CPU::MEM:
+            writes = instruction.left & CPU::MEM_LOAD;
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (!mask[lane])
+                    continue;
+                CPU& cpu = *group.cpu[lane];
+                uint16_t address = right[lane];
+                if (instruction.left & CPU::MEM_LOAD)
+                {
+                    if (instruction.left & CPU::MEM_WORD)
+                        result[lane] = cpu._read_word(address);
+                    else if (instruction.left & CPU::MEM_SEX)
+                        result[lane] = (int8_t)cpu._memory[address];
+                    else
+                        result[lane] = cpu._memory[address];
+                    continue;
+                }
+                uint16_t value = reg[instruction.dest][lane];
+                cpu._write_memory(address, value);
+                if (instruction.left & CPU::MEM_WORD)
+                    cpu._write_memory(address + 1, value >> 8);
+                _written_page[address >> 8] = true;
+                _written_page[(uint16_t)(address + 1) >> 8] = true;
+            }
+            break;
+        default: // reserved
+            result = group.alu_result;
+            break;
+        }
+
+        if (writes)
+            reg[instruction.dest] = _select(mask, result, reg[instruction.dest]);
+        if (alu)
+            group.alu_result = _select(mask, result, group.alu_result);
+        if (instruction.opcode == CPU::JMP)
+            reg[0] &= ~mask;
+        group.pc = _select(mask, target, group.pc);
+
+        Vector out = mask & (Vector)(group.spent >= group.headroom);
+        if (_any(out))
+        {
+            for (size_t lane = 0; lane < LANES; ++lane)
+            {
+                if (out[lane] && !_settle(group, lane))
+                    _leave(group, lane);
+            }
+        }
+
+        return _count(mask);
+    }
+
+public:
+    // Runs every CPU until it halts or has run max_cycles cycles since reset, with the same
+    // result as calling run(max_cycles) on each of them.
+    void run(std::span<CPU* const> cpus, uint64_t max_cycles)
+    {
+        // Like CPU::run, stop while a whole instruction still fits and do the rest cycle by cycle.
+        _limit = max_cycles - std::min<uint64_t>(max_cycles, CPU::MAX_INSTRUCTION_CYCLES);
+        if (!_decoded)
+            _decoded.reset(new CPU::Decoded[CPU::MEM_SIZE]);
+        for (size_t i = 0; i < CPU::MEM_SIZE; ++i)
+            _decoded[i].length = 0;
+
+        // Instructions are decoded once for every lane, unless lanes start out with different code.
+        _written_page.fill(false);
+        for (CPU* cpu : cpus)
+        {
+            for (size_t page = 0; page < _written_page.size(); ++page)
+            {
+                if (!std::equal(&cpu->_memory[page << 8], &cpu->_memory[(page + 1) << 8], &cpus[0]->_memory[page << 8]))
+                    _written_page[page] = true;
+            }
+        }
+
+        std::vector<CPU*> lanes;
+        for (CPU* cpu : cpus)
+        {
+            if (cpu->_any_slow_page || !cpu->_breakpoints.empty())
+            { // Lanes keep neither the order of accesses (devices, watchpoints) nor breakpoints.
+                cpu->run(max_cycles, CPU::FAST);
+                continue;
+            }
+            while (cpu->_cycle != 0 && !cpu->_halted && cpu->_cycles < max_cycles)
+                cpu->update();
+            if (cpu->_cycle == 0 && !cpu->_halted && cpu->_cycles < _limit)
+            {
+                cpu->_sync();
+                lanes.push_back(cpu);
+            }
+        }
+        _pack(lanes);
+
+        while (!_groups.empty())
+        {
+            size_t steps = 0;
+            size_t lane_steps = 0;
+            size_t live = 0;
+            for (_Group& group : _groups)
+            {
+                for (size_t i = 0; i < _SLICE && group.live; ++i)
+                {
+                    lane_steps += _step(group);
+                    ++steps;
+                }
+                live += group.live;
+            }
+            _steps += steps;
+            _lane_steps += lane_steps;
+
+            // Regroup when lanes went separate ways (or left) and fewer than half of them do
+            // any work at each step.
+            if (live == 0)
+                _groups.clear();
+            else if (lane_steps * 2 < steps * std::min(live, LANES) || live <= (_groups.size() - 1) * LANES)
+                _regroup();
+        }
+
+        for (CPU* cpu : cpus)
+            cpu->run(max_cycles, CPU::FAST);
+    }
+
+    // Average number of lanes that ran each instruction, over every run.
+    double occupancy() const
+    {
+        return _steps ? (double)_lane_steps / _steps : 0;
+    }
+};
@@ -1,536 +1,776 @@
-#include <array>
-#include <bit>
-#include <concepts>
+#include "batch.hpp"
+#include "cpu.hpp"
+#include "debugger.hpp"
+#include "image.hpp"
+#include "lockstep.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include <chrono>
 #include <fstream>
-#include <limits>
-#include <memory>
+#include <iomanip>
 #include <iostream>
-#include <ranges>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
 #include <vector>
 
-static_assert(std::numeric_limits<unsigned char>::digits == 8, "silly platform");
+// Where check_engines() puts the devices of the programs that have them.
+const uint16_t CHECK_TIMER = 0xF000;
+const uint16_t CHECK_INTERRUPTS = 0xF100;
+const uint16_t CHECK_HANDLER = 0x8000;
 
-class CPU
+// Writes op dest left right at address, and returns the address after it.
+uint16_t put_instruction(std::vector<uint8_t>& memory, uint16_t address, uint8_t opcode, uint8_t dest, uint8_t left, uint8_t right)
 {
-public:
-    enum Opcode
-    {
-        ADD, // 0
-        SUB, // 1
-        RO0, // 2, reserved
-        RO1, // 3, reserved
-        RO2, // 4, reserved
-        RO3, // 5, reserved
-        RO4, // 6, reserved
-        LSL, // 7
-        LSR, // 8
-        ASR, // 9
-        XOR, // A
-        OR,  // B
-        AND, // C
-        BRA, // D
-        JMP, // E
-        MEM, // F
-    };
-
-    enum Register
-    {
-        ZERO, // Hard-wired zero
-        RA, // Return address
-        SP, // Stack pointer
-        RR0, // Reserved
-
-        A0, // Arguments (callee saved)
-        A1,
-        A2,
-        A3,
-
-        T0, // Temporary (caller saved)
-        T1,
-        T2,
-        T3,
-
-        S0, // Saved (callee saved)
-        S1,
-        S2,
-        S3
-    };
-
-    static const size_t MEM_SIZE = 65536;
-    static const uint16_t RESET_VECTOR = 0xFFFD;
-
-private:
-    // Data
-    std::unique_ptr<uint8_t[]> _memory;
-    std::array<uint16_t, 16> _register;
-    uint16_t _bus = 0; // Common bus, reset to 0 every time it's read.
-    uint16_t _address = RESET_VECTOR; // The current memory address reads/writes will go to.
-    uint16_t _temp_pc = 0; // Used to save the next instruction's address when performing a load/store.
-    uint16_t _alu_left = 0; // ALU current left operand.
-    uint16_t _alu_right = 0; // ALU current right operand.
-    uint16_t _alu_result = 0; // ALU result.
-
-    // Decoder stuff
-    uint8_t _cycle = 2; // The current cycle.
-    uint8_t _opcode = JMP; // Current opcode.
-    uint8_t _dest = 0; // Destination register, or branch flags.
-    uint8_t _left = 0; // Left operand register, or load/store flags.
-    uint8_t _right = 0;  // Right operand register, or 0 to signify immediate.
-    uint8_t _index = 0; // If !_inc_addr, this is added (sign extended) to the effective address and reset to 0 before the next cycle.
-    bool _inc_addr = false; // Increment address before next cycle (overrides _index, making it wait one more cycle).
-    bool _load_imm = true; // Are we loading an immediate?
-    bool _load_word = true; // If we're loading an immediate, it is a word or a byte?
-    bool _load_high = true; // If we're loading a word, do we still have to load the high byte?
-    bool _imm_to_idx = false; // Will this immediate go to _index or to _alu_right?
-    bool _take_branch = false; // Are we going to take the upcoming branch?
-
-    enum _Flags : uint8_t
-    {
-        BRA_NOT = 0x1,
-        BRA_LT = 0x2,
-        BRA_U = 0x4,
-        BRA_EQ = 0x8,
-        
-        MEM_LOAD = 0x1,
-        MEM_WORD = 0x2,
-        MEM_SEX = 0x4,
-    };
-
-    // Performs arithmetic right shift by n bits on x.
-    // The 4 highest bits of n are discarded, so the shift count is within 0-15.
-    static uint16_t _asr(uint16_t x, uint8_t n)
-    {
-        n &= 0x000F;
-        if (n == 0)
-            return x;
+    memory[address] = left << 4 | right;
+    memory[address + 1] = opcode << 4 | dest;
+    return address + 2;
+}
 
-        bool neg = x & 0x8000;
-        x >>= n;
-        if (!neg)
-            return x;
-            
-        uint16_t pad = 0xFFFF;
-        pad <<= 16 - n;
-        x |= pad;
-        return x;
-    }
+uint16_t put_word(std::vector<uint8_t>& memory, uint16_t address, uint16_t value)
+{
+    memory[address] = value;
+    memory[address + 1] = value >> 8;
+    return address + 2;
+}
 
-    // Read the word currently on the bus. This will reset the bus to 0.
-    // If sex is true, the value will be sign extended according to the low byte. The high byte is ignored.
-    uint16_t _read_bus(bool sex)
-    {
-        uint16_t value = _bus;
-        _bus = 0;
-        if (sex && value & 0x0080)
-            value |= 0xFF00;
-        return value;
+// A program that starts a timer (on line 0, with a random period) and takes its interrupts: the
+// handler acknowledges it and enables interrupts again, then jumps back. r2 and r3 keep the
+// addresses of the devices, so the random code after the start (after a delay loop, sometimes)
+// reaches them now and then. Returns where the random code starts.
+uint16_t put_interrupt_program(std::vector<uint8_t>& memory, std::mt19937& random)
+{
+    uint16_t at = 0;
+    at = put_instruction(memory, at, CPU::XOR, 2, 0, 0); // xor r2 r0 r0 CHECK_TIMER
+    at = put_word(memory, at, CHECK_TIMER);
+    at = put_instruction(memory, at, CPU::XOR, 3, 0, 0); // xor r3 r0 r0 CHECK_INTERRUPTS
+    at = put_word(memory, at, CHECK_INTERRUPTS);
+    at = put_instruction(memory, at, CPU::ADD, 1, 0, 0); // add r1 r0 r0 1
+    memory[at++] = 1;
+    at = put_instruction(memory, at, CPU::MEM, 1, 0x0, 3); // mem r1 store r3 3 (mask)
+    memory[at++] = 3;
+    at = put_instruction(memory, at, CPU::MEM, 1, 0x0, 3); // mem r1 store r3 2 (enable)
+    memory[at++] = 2;
+    at = put_instruction(memory, at, CPU::XOR, 1, 0, 0); // xor r1 r0 r0 period
+    at = put_word(memory, at, 20 + random() % 300);
+    at = put_instruction(memory, at, CPU::MEM, 1, 0x2, 2); // mem r1 store word r2 0 (starts it)
+    memory[at++] = 0;
+    if (random() % 2)
+    { // add r4 r0 r0 count, then add r4 r4 r0 -1 and bra 0x9 r4 r0 -6 (bne) until it's 0.
+        at = put_instruction(memory, at, CPU::ADD, 4, 0, 0);
+        memory[at++] = 1 + random() % 100;
+        at = put_instruction(memory, at, CPU::ADD, 4, 4, 0);
+        memory[at++] = 0xFF;
+        at = put_instruction(memory, at, CPU::BRA, 0x9, 4, 0);
+        memory[at++] = -6;
     }
 
-    // Overwrite the value on the bus.
-    void _write_bus(uint16_t value)
-    {
-        _bus = value;
-    }
+    uint16_t handler = CHECK_HANDLER;
+    handler = put_instruction(memory, handler, CPU::XOR, 14, 0, 0); // xor r14 r0 r0 CHECK_INTERRUPTS
+    handler = put_word(memory, handler, CHECK_INTERRUPTS);
+    handler = put_instruction(memory, handler, CPU::ADD, 13, 0, 0); // add r13 r0 r0 1
+    memory[handler++] = 1;
+    handler = put_instruction(memory, handler, CPU::MEM, 13, 0x0, 14); // mem r13 store r14 4 (acknowledge)
+    memory[handler++] = 4;
+    handler = put_instruction(memory, handler, CPU::MEM, 12, 0x3, 14); // mem r12 load word r14 0 (return address)
+    memory[handler++] = 0;
+    handler = put_instruction(memory, handler, CPU::MEM, 13, 0x0, 14); // mem r13 store r14 2 (enable)
+    memory[handler++] = 2;
+    put_instruction(memory, handler, CPU::JMP, 0, 0, 12); // jmp r0 r0 r12
+    put_word(memory, CPU::INTERRUPT_VECTOR, CHECK_HANDLER);
+    return at;
+}
 
-    // Overwrite the low byte of the value on the bus.
-    void _write_bus_low(uint8_t value)
+// Loads memory into cpu, with the devices of put_interrupt_program() if interrupts.
+void load_check_program(CPU& cpu, const std::vector<uint8_t>& memory, bool interrupts)
+{
+    cpu.load_memory(memory, 0);
+    if (interrupts)
     {
-        _bus &= 0xFF00;
-        _bus |= value;
+        cpu.attach(std::make_shared<Timer>(0), CHECK_TIMER);
+        cpu.attach(std::make_shared<InterruptController>(), CHECK_INTERRUPTS);
     }
+}
 
-    // Overwrite the high byte of the value on the bus.
-    void _write_bus_high(uint8_t value)
-    {
-        _bus &= 0x00FF;
-        _bus |= (uint16_t)value << 8;
-    }
+// Writes a loop that counts r5 down from outer and r4 from inner for each, and returns the
+// address after it.
+uint16_t put_delay(std::vector<uint8_t>& memory, uint16_t at, uint16_t outer, uint16_t inner)
+{
+    at = put_instruction(memory, at, CPU::XOR, 5, 0, 0); // xor r5 r0 r0 outer
+    at = put_word(memory, at, outer);
+    at = put_instruction(memory, at, CPU::XOR, 4, 0, 0); // xor r4 r0 r0 inner
+    at = put_word(memory, at, inner);
+    at = put_instruction(memory, at, CPU::ADD, 4, 4, 0); // add r4 r4 r0 -1
+    memory[at++] = 0xFF;
+    at = put_instruction(memory, at, CPU::BRA, 0x9, 4, 0); // bne r4 r0 back to the add
+    memory[at++] = -6;
+    at = put_instruction(memory, at, CPU::ADD, 5, 5, 0); // add r5 r5 r0 -1
+    memory[at++] = 0xFF;
+    at = put_instruction(memory, at, CPU::BRA, 0x9, 5, 0); // bne r5 r0 back to xor r4
+    memory[at++] = -16;
+    return at;
+}
 
-    void _decode(uint16_t instruction)
+// History::last_write() with budgets of a few checkpoints, which thin them out while the program
+// runs: it writes 0x2000 once, well into the run, so the interval that wrote it is one that
+// thinning has merged. Returns the mismatches.
+uint64_t check_last_write()
+{
+    std::vector<uint8_t> memory(CPU::MEM_SIZE);
+    uint16_t at = 0;
+    at = put_instruction(memory, at, CPU::XOR, 2, 0, 0); // xor r2 r0 r0 0x2000
+    at = put_word(memory, at, 0x2000);
+    at = put_delay(memory, at, 14, 0x4000);
+    at = put_instruction(memory, at, CPU::ADD, 1, 0, 0); // add r1 r0 r0 1
+    memory[at++] = 1;
+    at = put_instruction(memory, at, CPU::MEM, 1, 0x2, 2); // mem r1 store word r2 0
+    memory[at++] = 0;
+    at = put_delay(memory, at, 14, 0x4000);
+    put_instruction(memory, at, CPU::BRA, 0x1, 0, 0); // bra r0 r0 -3 (halts)
+    memory[at + 2] = -3;
+
+    CPU watching;
+    watching.load_memory(memory, 0);
+    watching.set_watchpoint(0x2000, 1, CPU::WATCH_WRITE);
+    watching.run(std::numeric_limits<uint64_t>::max(), CPU::MICRO);
+
+    uint64_t mismatches = 0;
+    for (size_t budget = 4 << 10; budget <= 64 << 10; budget += 1 << 10)
     {
-        _opcode = instruction >> 12;
-        _dest = (instruction >> 8) & 0xF;
-        _left = (instruction >> 4) & 0xF;
-        _right = instruction & 0xF;
-
-        _load_imm = false;
-        _load_word = false;
-        _imm_to_idx = false;
-        switch (_opcode)
+        CPU::Engine engine = (CPU::Engine)(CPU::FAST + budget / 1024 % CPU::JIT);
+        CPU cpu;
+        cpu.load_memory(memory, 0);
+        History history(engine, budget);
+        history.record(cpu);
+        while (!cpu.halted())
         {
-        case SUB:
-            _load_imm = _right == 0;
-            _load_word = true;
-            break;
-        case ADD:
-        case LSL:
-        case LSR:
-        case ASR:
-            _load_imm = _right == 0;
-            _load_word = false;
-            break;
-        case XOR:
-        case OR:
-        case AND:
-            _load_imm = _right == 0;
-            _load_word = true;
-            break;
-        case JMP:
-            _load_imm = _right == 0 || _left != 0;
-            _load_word = _left == 0;
-            _imm_to_idx = _left != 0;
-            break;
-        case BRA:
-            _load_imm = false;
-            break;
-        case MEM:
-            _load_imm = true;
-            _load_word = false;
-            _imm_to_idx = true;
-            break;
-        default:
-            break;
+            cpu.run(cpu.cycles() + (1 << 16), engine);
+            cpu.finish_instruction();
+            history.record(cpu);
         }
-        _load_high = true;
-    }
-
-    void _test_branch()
-    {
-        _take_branch = false;
-        if (_dest & BRA_EQ)
-            _take_branch = _alu_left == _alu_right;
-        if (_dest & BRA_LT)
+        if (!history.last_write(cpu, 0x2000) || cpu.instructions() != watching.instructions() || cpu.pc() != watching.pc())
         {
-            if (_dest & BRA_U)
-                _take_branch = _take_branch || _alu_left < _alu_right;
-            else
-                _take_branch = _take_branch || (int16_t)_alu_left < (int16_t)_alu_right;
+            std::cout << "Mismatch: last write, budget " << budget << ", " << history.checkpoints() << " checkpoints\n";
+            ++mismatches;
         }
-        if (_dest & BRA_NOT)
-            _take_branch = !_take_branch;
     }
+    return mismatches;
+}
 
-    void _execute_alu()
+// Runs random programs on every engine, a few hundred cycles at a time and switching engines
+// between runs, and compares the final state with running them cycle by cycle. A quarter of them
+// run with a timer interrupting them; the others are also checked with snapshots and lockstep,
+// which don't take devices.
+int check_engines(uint64_t programs)
+{
+    const char* names[] = { "micro", "fast", "predecoded", "threaded", "blocks", "jit" };
+    uint64_t mismatches = 0;
+    for (uint64_t seed = 0; seed < programs; ++seed)
     {
-        switch (_opcode)
+        std::mt19937 random(seed);
+        std::vector<uint8_t> memory(CPU::MEM_SIZE);
+        bool interrupts = random() % 4 == 0;
+        if (interrupts)
+        { // Random code after the start, and sometimes in the handler's way.
+            uint16_t start = put_interrupt_program(memory, random);
+            size_t length = random() % 64;
+            for (size_t i = 0; i < length; ++i)
+                memory[start + i] = random();
+            for (int i = 0; i < 4; ++i)
+                memory[random() % CPU::MEM_SIZE] = random();
+        }
+        else if (random() % 4 == 0)
         {
-        case ADD:
-            _alu_result = _alu_left + _alu_right;
-            break;
-        case SUB:
-            _alu_result = _alu_left - _alu_right;
-            break;
-        case LSL:
-            _alu_result = _alu_left << (_alu_right & 0xF);
-            break;
-        case LSR:
-            _alu_result = _alu_left >> (_alu_right & 0xF);
-            break;
-        case ASR:
-            _alu_result = _asr(_alu_left, _alu_right);
-            break;
-        case XOR:
-            _alu_result = _alu_left ^ _alu_right;
-            break;
-        case OR:
-            _alu_result = _alu_left | _alu_right;
-            break;
-        case AND:
-            _alu_result = _alu_left & _alu_right;
-            break;
-        case BRA:
-            _test_branch();
-            break;
-        default:
-            break;
+            for (uint8_t& byte : memory)
+                byte = random();
         }
-    }
-
-    void _load_immediate()
-    {
-        _inc_addr = true;
-        if (_load_word)
+        else
+        { // A short program at 0 (where the reset vector points) and a few stray bytes.
+            size_t length = 1 + random() % 64;
+            for (size_t i = 0; i < length; ++i)
+                memory[i] = random();
+            for (int i = 0; i < 64; ++i)
+                memory[random() % CPU::MEM_SIZE] = random();
+        }
+        memory[CPU::RESET_VECTOR] = 0;
+        memory[CPU::RESET_VECTOR + 1] = 0;
+
+        uint64_t budget = random() % (interrupts ? 20000 : 3000);
+        CPU reference;
+        load_check_program(reference, memory, interrupts);
+        reference.run(budget);
+        for (int engine = CPU::FAST; engine <= CPU::JIT; ++engine)
         {
-            if (_load_high)
+            CPU cpu;
+            load_check_program(cpu, memory, interrupts);
+            for (uint64_t cycles = 0; cycles < budget;)
             {
-                _write_bus_low(_memory[_address]);
-                _load_high = false;
+                cycles = std::min<uint64_t>(budget, cycles + 1 + random() % 500);
+                cpu.run(cycles, (CPU::Engine)(random() % 2 ? engine : random() % (CPU::JIT + 1)));
             }
-            else
+            if (!cpu.same_state(reference))
             {
-                _write_bus_high(_memory[_address]);
-                if (_imm_to_idx)
-                    _index = _read_bus(false);
-                else
-                    _alu_right = _read_bus(false);
-                ++_cycle;
+                std::cout << "Mismatch: program " << seed << ", engine " << names[engine] << (interrupts ? ", interrupts" : "") << '\n';
+                ++mismatches;
             }
         }
-        else
+        if (interrupts)
+            continue;
+
+        // Snapshots: one taken partway is restored (into the same CPU and into another one that
+        // has run something else) and run again to the end.
         {
-            _write_bus_low(_memory[_address]);
-            if (_imm_to_idx)
-                _index = _read_bus(false);
-            else
-                _alu_right = _read_bus(true);
-            ++_cycle;
+            CPU cpu;
+            cpu.load_memory(memory, 0);
+            cpu.run(random() % (budget + 1), (CPU::Engine)(random() % (CPU::JIT + 1)));
+            CPU::Snapshot snapshot = cpu.snapshot();
+            cpu.run(budget, (CPU::Engine)(random() % (CPU::JIT + 1)));
+            cpu.restore(snapshot);
+            cpu.run(budget, (CPU::Engine)(random() % (CPU::JIT + 1)));
+            CPU other;
+            other.load_memory(memory, 0);
+            other.run(budget / 2, (CPU::Engine)(random() % (CPU::JIT + 1)));
+            other.restore(snapshot);
+            other.run(budget, (CPU::Engine)(random() % (CPU::JIT + 1)));
+            if (!cpu.same_state(reference) || !other.same_state(reference))
+            {
+                std::cout << "Mismatch: program " << seed << ", snapshot\n";
+                ++mismatches;
+            }
         }
-    }
 
-    void _load()
-    {
-        if (_left & MEM_WORD)
+        // Lockstep, against a reference for each lane, with different inputs in every lane.
+        std::vector<std::array<uint16_t, 16>> inputs(Lockstep::LANES + 4);
+        std::vector<CPU> lanes(inputs.size());
+        std::vector<CPU*> pointers;
+        for (size_t i = 0; i < lanes.size(); ++i)
         {
-            if (_load_high)
+            lanes[i].load_memory(memory, 0);
+            for (uint8_t reg = 1; reg < 16; ++reg)
             {
-                _inc_addr = true;
-                _write_bus_low(_memory[_address]);
-                _load_high = false;
+                inputs[i][reg] = random() % 4 ? random() % 8 : random();
+                lanes[i].set_register(reg, inputs[i][reg]);
             }
-            else
+            pointers.push_back(&lanes[i]);
+        }
+        Lockstep().run(pointers, budget);
+        for (size_t i = 0; i < lanes.size(); ++i)
+        {
+            CPU lane;
+            lane.load_memory(memory, 0);
+            for (uint8_t reg = 1; reg < 16; ++reg)
+                lane.set_register(reg, inputs[i][reg]);
+            lane.run(budget);
+            if (!lane.same_state(lanes[i]))
             {
-                _write_bus_high(_memory[_address]);
-                _register[_dest] = _read_bus(false);
-                _address = _temp_pc;
-                _cycle = 0;
+                std::cout << "Mismatch: program " << seed << ", lockstep lane " << i << '\n';
+                ++mismatches;
             }
         }
-        else
+
+        // Breakpoints (some with conditions) and watchpoints, mostly where the program is and the
+        // bytes that small addresses reach: every engine should stop at the same points as micro.
+        std::vector<std::pair<uint16_t, CPU::Condition>> breakpoints(1 + random() % 4);
+        for (auto& [address, condition] : breakpoints)
         {
-            _write_bus_low(_memory[_address]);
-            _register[_dest] = _read_bus(_left & MEM_SEX);
-            _address = _temp_pc;
-            _cycle = 0;
+            address = random() % 4 ? random() % 64 : random() % CPU::MEM_SIZE;
+            if (random() % 2)
+                condition = { CPU::Condition::Compare(1 + random() % 6), uint8_t(random() % 16), uint16_t(random() % 4 ? random() % 8 : random()) };
         }
-    }
-
-    void _store()
-    {
-        if (_left & MEM_WORD)
+        std::vector<std::array<uint16_t, 3>> watchpoints(1 + random() % 2); // Address, length, access.
+        for (auto& watchpoint : watchpoints)
+            watchpoint = { uint16_t(random() % 4 ? random() % 16 : random()), uint16_t(1 + random() % 8), uint16_t(1 + random() % 3) };
+        auto run_stopping = [&](CPU& cpu, CPU::Engine engine, History* history)
         {
-            if (_load_high)
+            cpu.load_memory(memory, 0);
+            for (const auto& [address, condition] : breakpoints)
+                cpu.set_breakpoint(address, condition);
+            for (const auto& [address, length, access] : watchpoints)
+                cpu.set_watchpoint(address, length, access);
+            if (history)
+                history->record(cpu);
+            std::vector<std::array<uint64_t, 5>> stops; // Stop, pc, instructions, cycles, byte watched.
+            do
             {
-                _inc_addr = true;
-                _write_bus_low(_register[_dest]);
-                _memory[_address] = _read_bus(false);
-                _load_high = false;
+                cpu.run(budget, engine);
+                if (cpu.stop() != CPU::NO_STOP)
+                    stops.push_back({ cpu.stop(), cpu.pc(), cpu.instructions(), cpu.cycles(), cpu.stop() == CPU::WATCHPOINT ? cpu.watched_address() : 0u });
+            } while (cpu.stop() != CPU::NO_STOP && stops.size() < 1000);
+            return stops;
+        };
+        CPU stopping;
+        auto stops = run_stopping(stopping, CPU::MICRO, nullptr);
+        // The state after instructions instructions, stepping from the start.
+        CPU stepping;
+        auto stepped = [&](uint64_t instructions) -> const CPU&
+        {
+            stepping.reset();
+            stepping.load_memory(memory, 0);
+            if (instructions)
+                stepping.finish_instruction();
+            while (stepping.instructions() < instructions)
+                stepping.step();
+            return stepping;
+        };
+        for (int engine = CPU::FAST; engine <= CPU::JIT; ++engine)
+        {
+            CPU cpu;
+            History history((CPU::Engine)engine);
+            if (run_stopping(cpu, (CPU::Engine)engine, &history) != stops || !cpu.same_state(stopping))
+            {
+                std::cout << "Mismatch: program " << seed << ", engine " << names[engine] << ", stops\n";
+                ++mismatches;
+                continue;
             }
-            else
+            if (stops.size() == 1000)
+                continue;
+
+            // Going back to the last stop, then a few instructions more, replays to the states
+            // stepping gets to.
+            auto last = std::find_if(stops.rbegin(), stops.rend(), [&](const auto& stop) { return stop[2] < cpu.instructions(); });
+            CPU::Stop found = history.continue_back(cpu);
+            bool same = last == stops.rend() ? found == CPU::NO_STOP && cpu.instructions() == 0
+                                             : found == (CPU::Stop)(*last)[0] && cpu.instructions() == (*last)[2] && cpu.pc() == (*last)[1];
+            same = same && cpu.same_state(stepped(cpu.instructions()));
+            uint64_t back = random() % (cpu.instructions() + 1);
+            uint64_t instructions = cpu.instructions() - back;
+            same = same && history.step_back(cpu, back) && cpu.same_state(stepped(instructions));
+            if (!same)
             {
-                _write_bus_low(_register[_dest] >> 8);
-                _memory[_address] = _read_bus(false);
-                _address = _temp_pc;
-                _cycle = 0;
+                std::cout << "Mismatch: program " << seed << ", engine " << names[engine] << ", history\n";
+                ++mismatches;
             }
         }
-        else
-        {
-            _write_bus_low(_register[_dest]);
-            _memory[_address] = _read_bus(false);
-            _address = _temp_pc;
-            _cycle = 0;
-        }
     }
+    mismatches += check_last_write();
+    std::cout << programs << " programs, " << mismatches << " mismatches\n";
+    return mismatches ? 1 : 0;
+}
+
+// The whole of text as a number, 0x... for hex.
+bool parse_number(const std::string& text, uint64_t& value)
+{
+    size_t end = 0;
+    try
+    {
+        value = std::stoull(text, &end, 0);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return end == text.size();
+}
 
-    void _cycle_0()
+// Attaches a device written as KIND@ADDRESS, with :FILE after it for storage and optionally
+// :LINE (its interrupt line, 0 by default) for a timer.
+bool attach_device(CPU& cpu, const std::string& text)
+{
+    size_t at = text.find('@');
+    if (at == std::string::npos)
+        return false;
+    std::string kind = text.substr(0, at);
+    std::string address = text.substr(at + 1);
+    std::string suffix;
+    size_t colon = address.find(':');
+    if (colon != std::string::npos)
+    {
+        suffix = address.substr(colon + 1);
+        address = address.substr(0, colon);
+    }
+    if (kind == "storage" && colon == std::string::npos)
+        return false;
+    if (kind != "storage" && kind != "timer" && colon != std::string::npos)
+        return false;
+    uint8_t line = 0;
+    if (kind == "timer" && colon != std::string::npos)
     {
-        _inc_addr = true;
-        _write_bus_low(_memory[_address]);
-        ++_cycle;
+        if (suffix.size() != 1 || suffix[0] < '0' || suffix[0] > '7')
+            return false;
+        line = suffix[0] - '0';
     }
+    uint64_t value = 0;
+    if (!parse_number(address, value) || value >= CPU::MEM_SIZE)
+        return false;
+
+    std::shared_ptr<Device> device;
+    if (kind == "console")
+        device = std::make_shared<Console>(std::cout);
+    else if (kind == "counter")
+        device = std::make_shared<CycleCounter>();
+    else if (kind == "timer")
+        device = std::make_shared<Timer>(line);
+    else if (kind == "interrupts")
+        device = std::make_shared<InterruptController>();
+    else if (kind == "storage")
+    {
+        auto storage = std::make_shared<Storage>();
+        if (!storage->open(suffix))
+            return false;
+        device = storage;
+    }
+    else
+        return false;
+    return cpu.attach(device, value);
+}
 
-    void _cycle_1()
+int decode_trace(const char* filename)
+{
+    TraceReader reader;
+    if (!reader.open(filename))
+    {
+        std::cout << "Invalid trace file.\n";
+        return 2;
+    }
+    TraceRecord record;
+    while (reader.next(record))
+        TraceReader::print(record, std::cout);
+    if (reader.error())
     {
-        _inc_addr = true;
-        _write_bus_high(_memory[_address]);
-        _decode(_read_bus(false));
-        ++_cycle;
+        std::cout << "Corrupt trace file.\n";
+        return 2;
     }
+    return 0;
+}
 
-    void _cycle_2()
+void print_reply(const Debugger::Reply& reply)
+{
+    static const char* stops[] = { "Paused", "Stepped", "Breakpoint", "Watchpoint", "Halted", "Cycle limit reached",
+        "Start of the history" };
+    std::cout << std::hex << std::setfill('0');
+    if (reply.kind == Debugger::WATCHPOINT)
+        std::cout << "Watchpoint on " << std::setw(4) << reply.watched << ", at " << std::setw(4) << reply.address << ".\n";
+    else if (reply.kind != Debugger::MEMORY)
+        std::cout << stops[reply.kind] << " at " << std::setw(4) << reply.address << ".\n";
+    for (size_t i = 0; i < reply.length; ++i)
     {
-        if (_load_imm)
-        {
-            _load_immediate();
-        }
-        else
+        if (i % 16 == 0)
+            std::cout << (i ? "\n" : "") << std::setw(4) << (uint16_t)(reply.address + i) << ':';
+        std::cout << ' ' << std::setw(2) << (int)reply.bytes[i];
+    }
+    if (reply.length)
+        std::cout << '\n';
+    std::cout << std::setfill(' ') << std::dec;
+}
+
+void print_state(const Debugger::State& state)
+{
+    std::cout << (state.running ? "Running" : "Paused") << (state.halted ? ", halted" : "") << '\n';
+    std::cout << std::dec << "Cycles: " << state.cycles << '\n';
+    std::cout << "Instructions: " << state.instructions << '\n';
+    std::cout << std::hex << "PC: " << state.pc << '\n';
+    for (int i = 0; i < 16; ++i)
+        std::cout << "r" << std::dec << i << ": " << std::hex << state.registers[i] << '\n';
+    std::cout << std::dec;
+}
+
+// A breakpoint's condition written as rN OP VALUE, OP being one of == != < <= > >=.
+bool parse_condition(const std::string& reg, const std::string& compare, const std::string& value, CPU::Condition& condition)
+{
+    static const char* compares[] = { "==", "!=", "<", "<=", ">", ">=" };
+    uint64_t index = 0, number = 0;
+    if (reg.size() < 2 || reg[0] != 'r' || !parse_number(reg.substr(1), index) || index > 15)
+        return false;
+    if (!parse_number(value, number) || number > 0xFFFF)
+        return false;
+    for (int i = 0; i < 6; ++i)
+    {
+        if (compare == compares[i])
         {
-            _write_bus(_register[_right]);
-            _alu_right = _read_bus(false);
-            ++_cycle;
+            condition = { (CPU::Condition::Compare)(CPU::Condition::EQ + i), (uint8_t)index, (uint16_t)number };
+            return true;
         }
     }
+    return false;
+}
 
-    void _cycle_3()
+// Runs the CPU on a thread of its own, under commands read from stdin a line at a time. Stops
+// the CPU comes to by itself (breakpoints, halts) are printed before the next command.
+int debug(CPU& cpu, CPU::Engine engine, uint64_t max_cycles, size_t history_budget)
+{
+    Debugger debugger(cpu, engine, max_cycles, history_budget);
+    Debugger::Reply reply;
+    std::string line;
+    while (std::getline(std::cin, line))
     {
-        if (_opcode <= BRA)
-        { // arithmetic or branch
-            _write_bus(_register[_left]);
-            _alu_left = _read_bus(false);
-            ++_cycle;
+        while (debugger.receive(reply))
+            print_reply(reply);
+        std::istringstream words(line);
+        std::string name, first, second, third, fourth;
+        words >> name >> first >> second >> third >> fourth;
+        uint64_t address = 0, count = 1;
+        bool has_address = parse_number(first, address) && address < CPU::MEM_SIZE;
+        bool has_count = second.empty() || parse_number(second, count);
+        uint8_t access = third.empty() || third == "rw" ? CPU::WATCH_READ | CPU::WATCH_WRITE
+            : third == "r" ? CPU::WATCH_READ : third == "w" ? CPU::WATCH_WRITE : 0;
+        Debugger::Command command;
+        if (name.empty() || (name == "s" && (first.empty() || parse_number(first, count))))
+            command = { Debugger::STEP, 0, count };
+        else if (name == "c")
+            command = { Debugger::CONTINUE };
+        else if (name == "p")
+            command = { Debugger::PAUSE };
+        else if (name == "b" && has_address && second.empty())
+            command = { Debugger::BREAK, (uint16_t)address };
+        else if (name == "b" && has_address && parse_condition(second, third, fourth, command.condition))
+            command = { Debugger::BREAK, (uint16_t)address, 0, command.condition };
+        else if (name == "d" && has_address)
+            command = { Debugger::DELETE, (uint16_t)address };
+        else if (name == "w" && has_address && has_count && access && fourth.empty())
+            command = { Debugger::WATCH, (uint16_t)address, count, {}, access };
+        else if (name == "u" && has_address && has_count)
+            command = { Debugger::WATCH, (uint16_t)address, count, {}, 0 };
+        else if (name == "x" && has_address && has_count)
+            command = { Debugger::READ, (uint16_t)address, second.empty() ? 16 : count };
+        else if (name == "rs" && (first.empty() || parse_number(first, count)))
+            command = { Debugger::STEP_BACK, 0, count };
+        else if (name == "rc" && first.empty())
+            command = { Debugger::CONTINUE_BACK };
+        else if (name == "rw" && has_address && second.empty())
+            command = { Debugger::LAST_WRITE, (uint16_t)address };
+        else if (name == "r")
+        {
+            print_state(debugger.state());
+            continue;
         }
-        else if (_opcode == JMP)
+        else if (name == "q")
         {
-            _inc_addr = _imm_to_idx;
-            _write_bus(_address);
-            _register[_dest] = _read_bus(false);
-            ++_cycle;
+            break;
         }
-        else if (_opcode == MEM)
+        else
         {
-            _temp_pc = _address;
-            _write_bus(_register[_right]);
-            _address = _read_bus(false);
-            ++_cycle;
+            std::cout << "Commands: s [N] (or an empty line) steps N instructions, c continues, p pauses,\n"
+                         "b ADDRESS [rN OP VALUE] sets a breakpoint (stopping only if rN OP VALUE holds, OP\n"
+                         "being == != < <= > or >=, unsigned), d ADDRESS deletes it, w ADDRESS [N [r|w|rw]]\n"
+                         "watches N bytes for reads and/or writes, u ADDRESS [N] stops watching them,\n"
+                         "x ADDRESS [N] prints N bytes of memory, r prints the registers (even while running)\n"
+                         "and q quits. Going back (not with devices): rs [N] steps back N instructions, rc\n"
+                         "runs back to the last breakpoint or watchpoint and rw ADDRESS to the last write of\n"
+                         "the byte at ADDRESS.\n";
+            continue;
+        }
+        while (!debugger.send(command))
+            std::this_thread::yield();
+        if (command.action == Debugger::STEP || command.action == Debugger::READ || command.action == Debugger::STEP_BACK
+            || command.action == Debugger::CONTINUE_BACK || command.action == Debugger::LAST_WRITE)
+        { // Waits for the answer, printing any stop on the way.
+            do
+            {
+                while (!debugger.receive(reply))
+                    debugger.wait();
+                print_reply(reply);
+            } while ((reply.kind == Debugger::MEMORY) != (command.action == Debugger::READ));
         }
     }
+    return 0;
+}
+
+void usage()
+{
+    std::cout << "Usage: ./test [OPTIONS] [PROGRAM]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --run         Run without stopping until the CPU halts, then print the final state.\n";
+    std::cout << "  --cycles N    Stop a --run after N cycles.\n";
+    std::cout << "  --engine E    Execute cycle by cycle (micro, default), instruction by instruction (fast)\n"
+                 "                instruction by instruction from a predecode cache (predecoded) or the\n"
+                 "                same with threaded dispatch (threaded), whole basic blocks at a time (blocks)\n"
+                 "                or basic blocks compiled to native code (jit). The last three skip delay loops\n"
+                 "                (add rX rX r0 -1, bne rX r0) in one go.\n";
+    std::cout << "  --check N     Run N random programs on every engine and compare them with micro.\n";
+    std::cout << "  --batch FILE  Run every job of a manifest (lines of \"PROGRAM [REG=VALUE]... [cycles=N]\")\n"
+                 "                with --engine and print the results as JSON lines.\n";
+    std::cout << "  --threads N   Worker threads for --batch (default: one per core).\n";
+    std::cout << "  --sparse FILE Write PROGRAM to FILE as a sparse image (only the non-zero parts of memory).\n";
+    std::cout << "  --trace FILE  Record every instruction of a --run to FILE (instruction by instruction,\n"
+                 "                whatever the engine).\n";
+    std::cout << "  --decode FILE Print the trace in FILE as text.\n";
+    std::cout << "  --device D    Put a device on the bus in place of memory, from an address that is a multiple\n"
+                 "                of 256: console@ADDRESS (prints the bytes stored to it), counter@ADDRESS (the\n"
+                 "                cycle count), timer@ADDRESS[:LINE] (interrupts on LINE, 0 to 7, 0 by default),\n"
+                 "                interrupts@ADDRESS (the interrupt controller, the handler's address goes in\n"
+                 "                0xFFFB) or storage@ADDRESS:FILE (blocks of FILE). See device.hpp for their\n"
+                 "                registers. Can be given more than once.\n";
+    std::cout << "  --profile FILE\n"
+                 "                Count the instructions and cycles of every address and call path of a --run\n"
+                 "                or --batch (instruction by instruction, whatever the engine) and write a\n"
+                 "                report to FILE.\n";
+    std::cout << "  --report R    Report of --profile: functions, calls, loops and the hottest instructions\n"
+                 "                (flat, default), every instruction with its counts (annotated) or call paths\n"
+                 "                for flame graphs (folded).\n";
+    std::cout << "  --history N   Memory for the checkpoints the commands that go back replay from, in MiB\n"
+                 "                (64 by default, 0 for none).\n";
+#ifdef SIM_STATS
+    std::cout << "This build counts what the simulator does and prints it to stderr on exit and on SIGUSR1.\n";
+#endif
+    std::cout << "Without --run, PROGRAM runs on a thread of its own under commands read from stdin (h lists\n"
+                 "them), which can look at it while it runs.\n";
+    std::cout << "PROGRAM is a raw image (memory from address 0, up to 64 KiB) or a sparse image.\n";
+}
 
-    void _cycle_4()
+int main(int argc, char** argv)
+{
+#ifdef SIM_STATS
+    Stats::dump_on_signal(SIGUSR1);
+    Stats::dump_at_exit();
+#endif
+    const char* program = nullptr;
+    bool headless = false;
+    uint64_t max_cycles = std::numeric_limits<uint64_t>::max();
+    CPU::Engine engine = CPU::MICRO;
+    const char* manifest = nullptr;
+    const char* sparse = nullptr;
+    const char* trace = nullptr;
+    const char* profile = nullptr;
+    std::vector<std::string> devices;
+    Profiler::Report report = Profiler::FLAT;
+    unsigned threads = 0;
+    size_t history_budget = History::DEFAULT_BUDGET;
+    uint64_t value = 0;
+    for (int i = 1; i < argc; ++i)
     {
-        if (_opcode <= AND)
-        { // arithmetic
-            _execute_alu();
-            _write_bus(_alu_result);
-            _register[_dest] = _read_bus(false);
-            _cycle = 0;
-        }
-        else if (_opcode == BRA)
+        std::string arg = argv[i];
+        if (arg == "--run")
+            headless = true;
+        else if (arg == "--check" && i + 1 < argc && parse_number(argv[i + 1], value))
+            return check_engines(value);
+        else if (arg == "--batch" && i + 1 < argc)
+            manifest = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            trace = argv[++i];
+        else if (arg == "--decode" && i + 1 < argc)
+            return decode_trace(argv[i + 1]);
+        else if (arg == "--profile" && i + 1 < argc)
+            profile = argv[++i];
+        else if (arg == "--report" && i + 1 < argc && argv[i + 1] == std::string("flat"))
+            report = Profiler::FLAT, ++i;
+        else if (arg == "--report" && i + 1 < argc && argv[i + 1] == std::string("annotated"))
+            report = Profiler::ANNOTATED, ++i;
+        else if (arg == "--report" && i + 1 < argc && argv[i + 1] == std::string("folded"))
+            report = Profiler::FOLDED, ++i;
+        else if (arg == "--device" && i + 1 < argc)
+            devices.push_back(argv[++i]);
+        else if (arg == "--sparse" && i + 1 < argc)
+            sparse = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc && parse_number(argv[i + 1], value) && value <= std::numeric_limits<unsigned>::max())
+            threads = value, ++i;
+        else if (arg == "--cycles" && i + 1 < argc && parse_number(argv[i + 1], value))
+            max_cycles = value, ++i;
+        else if (arg == "--history" && i + 1 < argc && parse_number(argv[i + 1], value) && value <= std::numeric_limits<size_t>::max() >> 20)
+            history_budget = value << 20, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("micro"))
+            engine = CPU::MICRO, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("fast"))
+            engine = CPU::FAST, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("predecoded"))
+            engine = CPU::PREDECODED, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("threaded"))
+            engine = CPU::THREADED, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("blocks"))
+            engine = CPU::BLOCKS, ++i;
+        else if (arg == "--engine" && i + 1 < argc && argv[i + 1] == std::string("jit"))
+            engine = CPU::JIT, ++i;
+        else if (!program && !arg.starts_with("--"))
+            program = argv[i];
+        else
         {
-            _inc_addr = true;
-            _write_bus_low(_memory[_address]);
-            _execute_alu();
-            ++_cycle;
+            usage();
+            return 1;
         }
-        else if (_opcode == JMP)
+    }
+    if (manifest)
+    {
+        Batch batch;
+        if (!batch.load(manifest))
+            return 2;
+        auto start = std::chrono::steady_clock::now();
+        uint64_t cycles = batch.run(threads, engine, std::cout, profile);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        std::cerr << "Ran " << batch.size() << " jobs (" << cycles << " cycles) in " << seconds.count()
+                  << " s, " << cycles / seconds.count() / 1e6 << " Mcycles/s.\n";
+        if (profile)
         {
-            if (!_imm_to_idx)
-            {
-                _write_bus(_alu_right);
-                _address = _read_bus(false);
-            }
-            else
+            std::ofstream file(profile);
+            batch.report(file, report);
+            if (!file)
             {
-                _write_bus(_register[_right]);
-                _address = _read_bus(false);
+                std::cout << "Can't write " << profile << ".\n";
+                return 2;
             }
-            _cycle = 0;
-        }
-        else if (_opcode == MEM)
-        {
-            if (_left & MEM_LOAD)
-                _load();
-            else
-                _store();
         }
+        return 0;
     }
-
-    void _cycle_5()
+    if (!program)
     {
-        if (_opcode == BRA)
-        {
-            if (_take_branch)
-                _index = _read_bus(false);
-            _cycle = 0;
-        }
+        usage();
+        return 1;
     }
 
-public:
-    CPU() : _memory(new uint8_t[MEM_SIZE])
+    CPU cpu;
+    Image image;
+    if (!image.open(program))
     {
-        std::fill(&_memory[0], &_memory[MEM_SIZE], 0);
-        _register.fill(0);
+        std::cout << "Invalid input file: " << image.error() << ".\n";
+        return 2;
     }
-
-    void update()
+    image.load(cpu);
+    for (const std::string& device : devices)
     {
-        _register[0] = 0;
-        if (_inc_addr)
+        if (!attach_device(cpu, device))
         {
-            _address += 1;
-            _inc_addr = false;
+            std::cout << "Invalid device " << device << ".\n";
+            return 2;
         }
-        else
+    }
+    if (sparse)
+    {
+        if (!Image::write_sparse(sparse, cpu.memory()))
         {
-            _address += (int8_t)_index;
-            _index = 0;
+            std::cout << "Can't write " << sparse << ".\n";
+            return 2;
         }
+        return 0;
+    }
 
-        switch (_cycle)
+    if (headless && trace)
+    {
+        Tracer tracer;
+        if (!tracer.open(trace))
+        {
+            std::cout << "Can't create " << trace << ".\n";
+            return 2;
+        }
+        tracer.run(cpu, max_cycles);
+        if (!tracer.close())
         {
-            case 0: _cycle_0(); break;
-            case 1: _cycle_1(); break;
-            case 2: _cycle_2(); break;
-            case 3: _cycle_3(); break;
-            case 4: _cycle_4(); break;
-            case 5: _cycle_5(); break;
-            default: break;
+            std::cout << "Can't write " << trace << ".\n";
+            return 2;
         }
+        cpu.print_summary();
+        std::cerr << "Traced " << tracer.records() << " instructions in " << tracer.bytes() << " bytes.\n";
+        return 0;
     }
-
-    template <std::ranges::forward_range Range>
-    requires std::convertible_to<std::ranges::range_value_t<Range>, uint8_t>
-    void load_memory(const Range& data, uint16_t address)
+    if (headless && profile)
     {
-        auto end = std::ranges::end(data);
-        for (auto it = std::ranges::begin(data); it != end; ++it)
-            _memory[address++] = *it;
+        Profiler profiler;
+        profiler.run(cpu, max_cycles);
+        cpu.print_summary();
+        std::ofstream file(profile);
+        profiler.report(file, report, cpu.memory(), program);
+        if (!file)
+        {
+            std::cout << "Can't write " << profile << ".\n";
+            return 2;
+        }
+        return 0;
     }
-
-    void debug_print()
+    if (headless)
     {
-        std::cout << std::dec << "Cycle: " << (int)_cycle << '\n';
-        std::cout << std::hex << "Instruction: " << (_opcode << 12 | (_dest << 8) | (_left << 4) | _right) << '\n';
-        std::cout << std::hex;
-        std::cout << "Address: " << _address << '\n';
-        std::cout << "Temporary PC: " << _temp_pc << '\n';
-        std::cout << "Bus: " << _bus << '\n';
-        std::cout << "ALU Left: " << _alu_left << '\n';
-        std::cout << "ALU Right: " << _alu_right << '\n';
-        std::cout << "ALU Result: " << _alu_result << '\n';
-        std::cout << "Take branch: " << _take_branch << '\n';
-        for (int i = 0; i < 16; ++i)
-            std::cout << "r" << i << ": " << _register[i] << '\n';
+        cpu.run(max_cycles, engine);
+        cpu.print_summary();
+        return 0;
     }
-};
-
-std::vector<uint8_t> read_binary_file(const std::string& filename)
-{
-    std::ifstream file(filename, file.binary | file.ate);
-    std::vector<uint8_t> memory(file.tellg());
-    file.seekg(file.beg);
-    file.read(reinterpret_cast<char*>(memory.data()), memory.size());
-    return memory;
-}
 
-void clear() {
-    std::cout << "\033[2J\033[1;1H";
+    return debug(cpu, engine, max_cycles, history_budget);
 }
-
-int main(int argc, char** argv)
-{
-    if (argc != 2)
-    {
-        std::cout << "Usage: ./test [PROGRAM]\n";
-        return 1;
-    }
-
-    CPU cpu;
-    std::vector<uint8_t> memory = read_binary_file(argv[1]);
-    if (memory.size() != cpu.MEM_SIZE)
-    {
-        std::cout << "Invalid input file.\n";
-        return 2;
-    }
-    cpu.load_memory(memory, 0);
-
-    while (true)
-    {
-        clear();
-        cpu.debug_print();
-        int c = std::cin.get();
-        if (c == EOF)
-            break;
-        cpu.update();
-    }
-    clear();
-}
\ No newline at end of file
@@ -0,0 +1,412 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "disassembler.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Counts exactly where a guest spends its time: the instructions retired and the cycles taken at
+// every address, and the cycles of every function on every path of calls that reaches it. Calls
+// and returns follow the assembler's conventions: a call is a jmp that writes ra (jsr, call) and
+// a return is a jmp r0 to ra, with or without an offset (ret). Runs CPUs instruction by
+// instruction like the fast engine, whatever the engine, with a few additions and a rarely taken
+// branch per instruction.
+class Profiler
+{
+public:
+    enum Report
+    {
+        FLAT, // Functions, call edges, loops and the hottest instructions.
+        ANNOTATED, // Every instruction that ran, with its counts.
+        FOLDED, // A line per call path and its cycles, for flame graph tools.
+    };
+
+    static const uint8_t RA = 1;
+
+private:
+    static const uint32_t _MAX_DEPTH = 256;
+    static const size_t _HOT_INSTRUCTIONS = 20;
+    static const size_t _HOT_LOOPS = 10;
+
+    struct _Counts
+    {
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+        uint64_t backward = 0; // Times the instruction jumped back, for loops.
+    };
+
+    // A function, reached through the path of calls from the root to it.
+    struct _Node
+    {
+        uint16_t function; // Address of its first instruction, 0 for the root.
+        uint32_t parent;
+        uint32_t depth;
+        uint64_t calls = 0;
+        uint64_t cycles = 0; // Taken by the function itself on this path.
+    };
+
+    std::unique_ptr<_Counts[]> _counts{ new _Counts[CPU::MEM_SIZE] };
+    std::vector<_Node> _nodes{ { 0, 0, 0 } }; // Parents always come before their children.
+    std::unordered_map<uint64_t, uint32_t> _children; // parent << 16 | function
+    uint32_t _node = 0; // Where the CPU is.
+    uint32_t _excess = 0; // Calls deeper than _MAX_DEPTH, which stay in the deepest node.
+
+    void _call(uint16_t function)
+    {
+        if (_nodes[_node].depth == _MAX_DEPTH)
+        {
+            ++_excess;
+            return;
+        }
+        _node = _child(_node, function);
+        ++_nodes[_node].calls;
+    }
+
+    void _return()
+    {
+        if (_excess)
+            --_excess;
+        else
+            _node = _nodes[_node].parent; // The root is its own parent.
+    }
+
+    uint32_t _child(uint32_t parent, uint16_t function)
+    {
+        auto [child, added] = _children.try_emplace((uint64_t)parent << 16 | function, _nodes.size());
+        if (added)
+            _nodes.push_back({ function, parent, _nodes[parent].depth + 1 });
+        return child->second;
+    }
+
+    // Accounts for the instruction at address, which took cycles and went on to next. high and
+    // low are its first two bytes, as they were when it ran.
+    [[gnu::always_inline]] void _count(uint16_t address, uint8_t low, uint8_t high, uint16_t next, uint8_t cycles)
+    {
+        _Counts& counts = _counts[address];
+        ++counts.instructions;
+        counts.cycles += cycles;
+        counts.backward += next < address;
+        _nodes[_node].cycles += cycles;
+        if (high >> 4 == CPU::JMP) [[unlikely]]
+        {
+            if ((high & 0xF) == RA)
+                _call(next);
+            else if ((high & 0xF) == 0 && (low & 0xF) == RA)
+                _return();
+        }
+    }
+
+    // Cycles of each node with everything it called.
+    std::vector<uint64_t> _inclusive() const
+    {
+        std::vector<uint64_t> inclusive(_nodes.size());
+        for (size_t i = _nodes.size(); i-- > 0;)
+        {
+            inclusive[i] += _nodes[i].cycles;
+            if (i)
+                inclusive[_nodes[i].parent] += inclusive[i];
+        }
+        return inclusive;
+    }
+
+    // Whether a node's function (or, with edge, the call from its parent's function to it) is
+    // already on the path above it. Recursive calls are only counted at the outermost level.
+    bool _recursive(uint32_t node, bool edge) const
+    {
+        uint32_t parent = _nodes[node].parent;
+        for (uint32_t above = parent; above != 0; above = _nodes[above].parent)
+        {
+            if (_nodes[above].function != _nodes[node].function)
+                continue;
+            if (!edge || _key(_nodes[above].parent) == _key(parent))
+                return true;
+        }
+        return false;
+    }
+
+    // Identifies the function of a node, with the root apart from the function at 0.
+    int32_t _key(uint32_t node) const
+    {
+        return node ? _nodes[node].function : -1;
+    }
+
+    uint64_t _total_cycles() const
+    {
+        uint64_t total = 0;
+        for (const _Node& node : _nodes)
+            total += node.cycles;
+        return total;
+    }
+
+    static double _percent(uint64_t part, uint64_t total)
+    {
+        return total ? 100.0 * part / total : 0;
+    }
+
+    void _flat(std::ostream& out, std::span<const uint8_t, CPU::MEM_SIZE> memory, const std::string& root) const
+    {
+        uint64_t total = _total_cycles();
+        uint64_t instructions = 0;
+        for (size_t i = 0; i < CPU::MEM_SIZE; ++i)
+            instructions += _counts[i].instructions;
+        char line[160];
+        std::snprintf(line, sizeof(line), "%llu cycles, %llu instructions\n", (unsigned long long)total, (unsigned long long)instructions);
+        out << "Profile of " << root << ": " << line;
+
+        std::vector<uint64_t> inclusive = _inclusive();
+        struct Function
+        {
+            uint64_t self = 0, total = 0, calls = 0;
+        };
+        std::map<int32_t, Function> functions;
+        std::map<std::pair<int32_t, int32_t>, Function> edges;
+        for (uint32_t i = 0; i < _nodes.size(); ++i)
+        {
+            Function& function = functions[_key(i)];
+            function.self += _nodes[i].cycles;
+            function.calls += _nodes[i].calls;
+            if (!_recursive(i, false))
+                function.total += inclusive[i];
+            if (i == 0)
+                continue;
+            Function& edge = edges[{ _key(_nodes[i].parent), _key(i) }];
+            edge.calls += _nodes[i].calls;
+            if (!_recursive(i, true))
+                edge.total += inclusive[i];
+        }
+        auto name = [&](int32_t key) { return key < 0 ? root : _name(key); };
+
+        out << "\nFunctions:\n     self%     self cycles    total cycles           calls  function\n";
+        std::vector<std::pair<int32_t, Function>> sorted(functions.begin(), functions.end());
+        std::ranges::stable_sort(sorted, std::greater(), [](const auto& f) { return f.second.self; });
+        for (const auto& [key, function] : sorted)
+        {
+            std::snprintf(line, sizeof(line), "%9.2f%% %15llu %15llu %15llu  ", _percent(function.self, total), (unsigned long long)function.self,
+                          (unsigned long long)function.total, (unsigned long long)function.calls);
+            out << line << name(key) << '\n';
+        }
+
+        out << "\nCalls:\n           calls    total cycles  caller -> callee\n";
+        std::vector<std::pair<std::pair<int32_t, int32_t>, Function>> calls(edges.begin(), edges.end());
+        std::ranges::stable_sort(calls, std::greater(), [](const auto& e) { return e.second.total; });
+        for (const auto& [edge, function] : calls)
+        {
+            std::snprintf(line, sizeof(line), "%16llu %15llu  ", (unsigned long long)function.calls, (unsigned long long)function.total);
+            out << line << name(edge.first) << " -> " << name(edge.second) << '\n';
+        }
+
+        // A loop is a branch back, taken some number of times. Its cycles are those of the
+        // instructions between the target and the branch (not of what they call).
+        struct Loop
+        {
+            uint16_t start, end;
+            uint64_t taken, cycles;
+        };
+        std::vector<Loop> loops;
+        for (size_t address = 0; address < CPU::MEM_SIZE; ++address)
+        {
+            uint8_t code[4];
+            for (size_t i = 0; i < 4; ++i)
+                code[i] = memory[(address + i) % CPU::MEM_SIZE];
+            CPU::Decoded instruction = CPU::decode(code, 0);
+            if (!_counts[address].backward || instruction.opcode != CPU::BRA)
+                continue;
+            uint16_t start = address + 3 + instruction.immediate;
+            if (start > address)
+                continue;
+            uint64_t cycles = 0;
+            for (size_t i = start; i <= address; ++i)
+                cycles += _counts[i].cycles;
+            loops.push_back({ start, (uint16_t)address, _counts[address].backward, cycles });
+        }
+        std::ranges::stable_sort(loops, std::greater(), &Loop::cycles);
+        out << "\nLoops:\n    cycles%          cycles      jumps back  range\n";
+        for (size_t i = 0; i < std::min(loops.size(), _HOT_LOOPS); ++i)
+        {
+            std::snprintf(line, sizeof(line), "%9.2f%% %15llu %15llu  0x%04x-0x%04x\n", _percent(loops[i].cycles, total), (unsigned long long)loops[i].cycles,
+                          (unsigned long long)loops[i].taken, loops[i].start, loops[i].end);
+            out << line;
+        }
+
+        std::vector<uint16_t> hot;
+        for (size_t address = 0; address < CPU::MEM_SIZE; ++address)
+        {
+            if (_counts[address].instructions)
+                hot.push_back(address);
+        }
+        std::ranges::stable_sort(hot, std::greater(), [&](uint16_t address) { return _counts[address].cycles; });
+        hot.resize(std::min(hot.size(), _HOT_INSTRUCTIONS));
+        out << "\nInstructions:\n";
+        _header(out);
+        for (uint16_t address : hot)
+            _instruction(out, memory, address, total);
+    }
+
+    static void _header(std::ostream& out)
+    {
+        out << "    cycles%          cycles    instructions  instruction\n";
+    }
+
+    void _instruction(std::ostream& out, std::span<const uint8_t, CPU::MEM_SIZE> memory, uint16_t address, uint64_t total) const
+    {
+        const _Counts& counts = _counts[address];
+        char line[64 + Disassembler::MAX_LINE];
+        int n = std::snprintf(line, 64, "%9.2f%% %15llu %15llu  ", _percent(counts.cycles, total), (unsigned long long)counts.cycles,
+                              (unsigned long long)counts.instructions);
+        uint8_t code[4];
+        for (uint16_t i = 0; i < 4; ++i)
+            code[i] = memory[(uint16_t)(address + i)];
+        char* end = Disassembler::disassemble(line + n, address, code);
+        *end++ = '\n';
+        out.write(line, end - line);
+    }
+
+    void _annotated(std::ostream& out, std::span<const uint8_t, CPU::MEM_SIZE> memory, const std::string& root) const
+    {
+        uint64_t total = _total_cycles();
+        std::vector<bool> functions(CPU::MEM_SIZE);
+        for (uint32_t i = 1; i < _nodes.size(); ++i)
+            functions[_nodes[i].function] = true;
+        out << "Profile of " << root << ":\n";
+        _header(out);
+        uint32_t next = 0; // Right after the last instruction printed.
+        for (uint32_t address = 0; address < CPU::MEM_SIZE; ++address)
+        {
+            if (!_counts[address].instructions)
+                continue;
+            if (address != next)
+                out << "...\n";
+            if (functions[address])
+                out << _name(address) << ":\n";
+            _instruction(out, memory, address, total);
+            next = address + CPU::decode(&memory[0], address).length;
+        }
+    }
+
+    void _folded(std::ostream& out, std::string root) const
+    {
+        std::ranges::replace(root, ';', '_');
+        std::vector<std::string> paths(_nodes.size());
+        for (uint32_t i = 0; i < _nodes.size(); ++i)
+        {
+            paths[i] = i ? paths[_nodes[i].parent] + ';' + _name(_nodes[i].function) : root;
+            if (_nodes[i].cycles)
+                out << paths[i] << ' ' << _nodes[i].cycles << '\n';
+        }
+    }
+
+    static std::string _name(uint16_t function)
+    {
+        char name[8];
+        std::snprintf(name, sizeof(name), "0x%04x", function);
+        return name;
+    }
+
+public:
+    // Runs cpu like cpu.run(max_cycles) and counts every instruction it retires. An instruction
+    // that was already started (or that doesn't finish within max_cycles) isn't counted. The
+    // calls carry on from where the last run left them.
+    void run(CPU& cpu, uint64_t max_cycles)
+    {
+        cpu._catch_up_events();
+        do
+            _run(cpu, max_cycles);
+        while (cpu._idle(max_cycles));
+    }
+
+private:
+    void _run(CPU& cpu, uint64_t max_cycles)
+    {
+        while (cpu._cycle != 0 && !cpu._halted && cpu._cycles < max_cycles)
+            cpu.update();
+        if (cpu._halted || cpu._cycles >= max_cycles)
+            return;
+
+        // Like the fast engine while a whole instruction fits, then cycle by cycle.
+        uint16_t pc = cpu._sync();
+        uint64_t limit = max_cycles - std::min<uint64_t>(max_cycles, CPU::MAX_INSTRUCTION_CYCLES);
+        uint64_t cycles = cpu._cycles;
+        uint64_t instructions = cpu._instructions;
+        while (!cpu._halted && cycles < limit)
+        {
+            if (cycles >= cpu._next_event) [[unlikely]]
+            {
+                cpu._cycles = cycles;
+                pc = cpu._events(pc);
+            }
+            uint16_t address = pc;
+            uint8_t low = cpu._memory[address]; // Before a store can change them.
+            uint8_t high = cpu._memory[(uint16_t)(address + 1)];
+            uint8_t taken = cpu._execute(pc, cycles);
+            cycles += taken;
+            ++instructions;
+            _count(address, low, high, pc, taken);
+        }
+        cpu._cycles = cycles;
+        cpu._instructions = instructions;
+        cpu._address = pc;
+
+        cpu._catch_up_events();
+        while (!cpu._halted && cpu._cycles < max_cycles)
+        {
+            uint16_t address = cpu._sync();
+            uint8_t low = cpu._memory[address];
+            uint8_t high = cpu._memory[(uint16_t)(address + 1)];
+            uint64_t start = cpu._cycles;
+            do
+                cpu.update();
+            while (cpu._cycle != 0 && cpu._cycles < max_cycles);
+            if (cpu._cycle != 0)
+                break;
+            _count(address, low, high, cpu._sync(), cpu._cycles - start);
+        }
+    }
+
+public:
+    // Forgets the calls in progress, for a CPU that starts over. Counts are kept.
+    void unwind()
+    {
+        _node = 0;
+        _excess = 0;
+    }
+
+    // Adds the counts of another profile (of the same program).
+    void merge(const Profiler& other)
+    {
+        for (size_t i = 0; i < CPU::MEM_SIZE; ++i)
+        {
+            _counts[i].instructions += other._counts[i].instructions;
+            _counts[i].cycles += other._counts[i].cycles;
+            _counts[i].backward += other._counts[i].backward;
+        }
+        std::vector<uint32_t> nodes(other._nodes.size()); // Of other in this.
+        for (uint32_t i = 0; i < other._nodes.size(); ++i)
+        {
+            if (i)
+                nodes[i] = _child(nodes[other._nodes[i].parent], other._nodes[i].function);
+            _nodes[nodes[i]].calls += other._nodes[i].calls;
+            _nodes[nodes[i]].cycles += other._nodes[i].cycles;
+        }
+    }
+
+    // Writes a report. memory holds the program, to disassemble it, and root names the root of
+    // the calls (the program).
+    void report(std::ostream& out, Report kind, std::span<const uint8_t, CPU::MEM_SIZE> memory, const std::string& root) const
+    {
+        switch (kind)
+        {
+        case FLAT: _flat(out, memory, root); break;
+        case ANNOTATED: _annotated(out, memory, root); break;
+        case FOLDED: _folded(out, root); break;
+        }
+    }
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+// Counters of what the simulator itself does: instructions of each opcode, branches, memory
+// accesses, cache hits and time spent in each engine. They only exist in builds with SIM_STATS
+// defined (make stats), everywhere else the SIM_COUNT macros expand to nothing.
+
+#ifdef SIM_STATS
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+class Stats
+{
+public:
+    static const int OPCODES = 16;
+    static const int ENGINES = 6;
+
+    enum Counter
+    {
+        INSTRUCTIONS, // One per opcode, INSTRUCTIONS + opcode.
+        BRANCHES_TAKEN = INSTRUCTIONS + OPCODES,
+        BRANCHES_NOT_TAKEN,
+        LOADS_BYTE,
+        LOADS_WORD,
+        STORES_BYTE,
+        STORES_WORD,
+        DEVICE_READS, // Bytes, counted on top of the loads.
+        DEVICE_WRITES,
+        PREDECODE_HITS,
+        PREDECODE_MISSES,
+        BLOCKS_CHAINED, // Found through the exit of the previous block.
+        BLOCKS_FOUND, // Found in the translation cache.
+        BLOCKS_TRANSLATED,
+        BLOCK_FLUSHES,
+        JIT_COMPILES,
+        JIT_ENTRIES, // Times native code was entered from the interpreter.
+        ENGINE_RUNS, // One per engine, ENGINE_RUNS + engine.
+        ENGINE_NANOSECONDS = ENGINE_RUNS + ENGINES,
+        ENGINE_CYCLES = ENGINE_NANOSECONDS + ENGINES,
+        COUNTERS = ENGINE_CYCLES + ENGINES,
+    };
+
+    // Adds the time and cycles from its construction to its destruction to an engine.
+    class Timer
+    {
+        int _engine;
+        const uint64_t& _cycles;
+        uint64_t _start_cycles;
+        std::chrono::steady_clock::time_point _start;
+
+    public:
+        Timer(int engine, const uint64_t& cycles) :
+            _engine(engine), _cycles(cycles), _start_cycles(cycles), _start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~Timer()
+        {
+            std::chrono::nanoseconds time = std::chrono::steady_clock::now() - _start;
+            add((Counter)(ENGINE_RUNS + _engine));
+            add((Counter)(ENGINE_NANOSECONDS + _engine), time.count());
+            add((Counter)(ENGINE_CYCLES + _engine), _cycles - _start_cycles);
+        }
+    };
+
+private:
+    // Every thread counts into its own set, only the thread itself writes to it. They are atomic
+    // so that dump() can read them at any time, a relaxed load and store is a plain mov.
+    struct _Counters
+    {
+        std::atomic<uint64_t> values[COUNTERS] = {};
+    };
+
+    struct _Registry
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<_Counters>> threads; // Kept after their thread exits.
+    };
+
+    // Never destroyed, so that it outlives threads and exit handlers that still count or dump.
+    static _Registry& _registry()
+    {
+        static _Registry* registry = new _Registry;
+        return *registry;
+    }
+
+    static _Counters& _register()
+    {
+        _Registry& registry = _registry();
+        std::lock_guard lock(registry.mutex);
+        registry.threads.push_back(std::make_unique<_Counters>());
+        return *registry.threads.back();
+    }
+
+    static _Counters& _local()
+    {
+        thread_local _Counters& counters = _register();
+        return counters;
+    }
+
+    static double _percent(uint64_t part, uint64_t total)
+    {
+        return total ? 100.0 * part / total : 0.0;
+    }
+
+public:
+    static void add(Counter counter, uint64_t count = 1)
+    {
+        std::atomic<uint64_t>& value = _local().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+
+    // Totals of every thread so far.
+    static std::vector<uint64_t> totals()
+    {
+        std::vector<uint64_t> totals(COUNTERS);
+        _Registry& registry = _registry();
+        std::lock_guard lock(registry.mutex);
+        for (const auto& counters : registry.threads)
+        {
+            for (int i = 0; i < COUNTERS; ++i)
+                totals[i] += counters->values[i].load(std::memory_order_relaxed);
+        }
+        return totals;
+    }
+
+    static void dump(std::ostream& out)
+    {
+        static const char* opcodes[OPCODES] = {
+            "add", "sub", "ro0", "ro1", "ro2", "ro3", "ro4", "lsl",
+            "lsr", "asr", "xor", "or", "and", "bra", "jmp", "mem",
+        };
+        static const char* engines[ENGINES] = { "micro", "fast", "predecoded", "threaded", "blocks", "jit" };
+        std::vector<uint64_t> total = totals();
+        std::ios flags(nullptr);
+        flags.copyfmt(out);
+        out << std::fixed << std::setprecision(1);
+
+        uint64_t instructions = 0;
+        for (int i = 0; i < OPCODES; ++i)
+            instructions += total[INSTRUCTIONS + i];
+        out << "Instructions: " << instructions << " (not counting the JIT's native code)\n";
+        for (int i = 0; i < OPCODES; ++i)
+        {
+            if (total[INSTRUCTIONS + i])
+                out << "  " << std::left << std::setw(4) << opcodes[i] << std::right << std::setw(16)
+                    << total[INSTRUCTIONS + i] << std::setw(7) << _percent(total[INSTRUCTIONS + i], instructions) << "%\n";
+        }
+        uint64_t branches = total[BRANCHES_TAKEN] + total[BRANCHES_NOT_TAKEN];
+        out << "Branches: " << total[BRANCHES_TAKEN] << " taken (" << _percent(total[BRANCHES_TAKEN], branches)
+            << "%), " << total[BRANCHES_NOT_TAKEN] << " not taken\n";
+        out << "Loads: " << total[LOADS_BYTE] << " bytes, " << total[LOADS_WORD] << " words\n";
+        out << "Stores: " << total[STORES_BYTE] << " bytes, " << total[STORES_WORD] << " words\n";
+        out << "Devices: " << total[DEVICE_READS] << " bytes read, " << total[DEVICE_WRITES] << " bytes written\n";
+        uint64_t lookups = total[PREDECODE_HITS] + total[PREDECODE_MISSES];
+        out << "Predecode cache: " << total[PREDECODE_HITS] << " hits, " << total[PREDECODE_MISSES] << " misses ("
+            << _percent(total[PREDECODE_HITS], lookups) << "% hits)\n";
+        uint64_t blocks = total[BLOCKS_CHAINED] + total[BLOCKS_FOUND] + total[BLOCKS_TRANSLATED];
+        out << "Blocks: " << total[BLOCKS_CHAINED] << " chained, " << total[BLOCKS_FOUND] << " found, "
+            << total[BLOCKS_TRANSLATED] << " translated (" << _percent(blocks - total[BLOCKS_TRANSLATED], blocks)
+            << "% hits), " << total[BLOCK_FLUSHES] << " flushes\n";
+        out << "JIT: " << total[JIT_COMPILES] << " compiled, " << total[JIT_ENTRIES] << " entries\n";
+        for (int i = 0; i < ENGINES; ++i)
+        {
+            if (!total[ENGINE_RUNS + i])
+                continue;
+            double seconds = total[ENGINE_NANOSECONDS + i] / 1e9;
+            out << "Engine " << engines[i] << ": " << total[ENGINE_RUNS + i] << " runs, " << total[ENGINE_CYCLES + i]
+                << " cycles in " << std::setprecision(6) << seconds << " s, " << std::setprecision(1)
+                << (seconds > 0 ? total[ENGINE_CYCLES + i] / seconds / 1e6 : 0.0) << " Mcycles/s\n";
+        }
+        out.copyfmt(flags);
+    }
+
+    // Dumps to stderr when the process exits normally.
+    static void dump_at_exit()
+    {
+        _registry();
+        std::atexit([] { dump(std::cerr); });
+    }
+
+    // Dumps to stderr every time signal arrives, from a thread waiting for it. Has to be called
+    // before any other thread starts, so that they all inherit the signal blocked.
+    static void dump_on_signal(int signal)
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, signal);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        std::thread([set] {
+            int received;
+            while (sigwait(&set, &received) == 0)
+                dump(std::cerr);
+        }).detach();
+    }
+};
+
+#define SIM_COUNT(counter) Stats::add(Stats::counter)
+#define SIM_COUNT_OPCODE(opcode) Stats::add((Stats::Counter)(Stats::INSTRUCTIONS + ((opcode) & 0xF)))
+#define SIM_TIME_ENGINE(engine, cycles) Stats::Timer sim_engine_timer(engine, cycles)
+
+#else
+
+#define SIM_COUNT(counter) ((void)0)
+#define SIM_COUNT_OPCODE(opcode) ((void)0)
+#define SIM_TIME_ENGINE(engine, cycles) ((void)0)
+
+#endif
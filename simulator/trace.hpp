@@ -0,0 +1,540 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "disassembler.hpp"
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Trace files record every instruction a CPU retires: its address, its bytes, the register it
+// wrote and the memory it stored to. After an 8 byte header ("SIMTRACE"), each instruction is a
+// flags byte followed by the fields the flags call for:
+//
+//   TRACE_JUMP        The address, as a varint of the (zigzag) difference with the address
+//                     right after the previous instruction. Without it, the instruction follows
+//                     the previous one.
+//   TRACE_CODE        The bytes of the instruction (2 to 4). Without it, they're the same as the
+//                     last time an instruction at this address was recorded.
+//   TRACE_REGISTER    The value written to the destination register, as a varint of the
+//                     (zigzag) difference with the last value recorded for that register.
+//   TRACE_STORE_BYTE  The address (a varint of the zigzag difference with the address of the
+//   TRACE_STORE_WORD  previous store) and the 1 or 2 bytes stored.
+//
+// In a loop, most instructions are a single flags byte and a register delta.
+struct TraceRecord
+{
+    uint16_t pc;
+    uint8_t code[4]; // The bytes of the instruction, only the first length are meaningful.
+    uint8_t length;
+    uint8_t flags; // TRACE_REGISTER, TRACE_STORE_BYTE or TRACE_STORE_WORD.
+    uint16_t value; // Written to the destination register.
+    uint16_t address; // Of the store.
+    uint16_t stored; // Value of the store (only the low byte for TRACE_STORE_BYTE).
+};
+
+enum TraceFlags : uint8_t
+{
+    TRACE_JUMP = 0x1,
+    TRACE_CODE = 0x2,
+    TRACE_REGISTER = 0x4,
+    TRACE_STORE_BYTE = 0x8,
+    TRACE_STORE_WORD = 0x10,
+};
+
+static constexpr char TRACE_MAGIC[8] = { 'S', 'I', 'M', 'T', 'R', 'A', 'C', 'E' };
+
+// State that the encoder and the decoder keep the same way, so that records can be written as
+// differences with it.
+struct TraceContext
+{
+    uint16_t next = 0; // Address right after the previous instruction.
+    uint16_t store = 0; // Address of the previous store.
+    std::array<uint16_t, 16> registers{}; // Last value recorded for each register.
+
+    static uint16_t zigzag(uint16_t delta)
+    {
+        return (uint16_t)(delta << 1) ^ (uint16_t)((int16_t)delta >> 15);
+    }
+
+    static uint16_t unzigzag(uint16_t value)
+    {
+        return (value >> 1) ^ (uint16_t)-(value & 1);
+    }
+};
+
+// Runs CPUs instruction by instruction (like the fast engine) and writes a trace of everything
+// they retire. The traced thread only logs the address of each instruction and the value of its
+// destination register afterwards, 4 bytes at a time into large buffers. A background thread
+// encodes them and writes them to the file: it keeps its own copy of memory and registers, from
+// which it finds the bytes of every instruction and the address and value of every store. The
+// CPU never waits for it unless it gets ahead by more than every buffer.
+class Tracer
+{
+    static const size_t _ENTRIES = 1 << 18;
+    static const size_t _BUFFERS = 4;
+    static const size_t _OUTPUT_SIZE = 1 << 20;
+    static const size_t _MAX_RECORD_SIZE = 16;
+
+    struct _State
+    {
+        std::array<uint8_t, CPU::MEM_SIZE> memory;
+        std::array<uint16_t, 16> registers;
+    };
+
+    struct _Chunk
+    {
+        std::vector<uint32_t> entries; // pc | value << 16 for each instruction.
+        size_t size = 0;
+        std::unique_ptr<_State> start; // If the entries start a run, the state it starts from.
+    };
+
+    std::FILE* _file = nullptr;
+    _Chunk _chunk; // Being filled.
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::deque<_Chunk> _full;
+    std::vector<_Chunk> _free;
+    bool _closing = false;
+    std::thread _writer;
+    uint64_t _records = 0;
+
+    // Only used by the writer.
+    _State _state;
+    TraceContext _context;
+    // Length and record flags of the instruction at each address, as recorded last time, or 0 if
+    // its bytes have to be recorded again (they were stored to since).
+    std::unique_ptr<uint16_t[]> _known{ new uint16_t[CPU::MEM_SIZE] };
+    std::vector<uint8_t> _output;
+    bool _failed = false;
+    uint64_t _bytes = 0;
+
+    void _write()
+    {
+        std::unique_lock lock(_mutex);
+        uint8_t* out = _output.data();
+        std::memcpy(out, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        out += sizeof(TRACE_MAGIC);
+        while (true)
+        {
+            _changed.wait(lock, [&] { return !_full.empty() || _closing; });
+            if (_full.empty())
+                break;
+            _Chunk chunk = std::move(_full.front());
+            _full.pop_front();
+            lock.unlock();
+            out = _encode(out, chunk);
+            lock.lock();
+            chunk.size = 0;
+            chunk.start.reset();
+            _free.push_back(std::move(chunk));
+            _changed.notify_all();
+        }
+        _output_bytes(out);
+    }
+
+    // Writes the encoded bytes up to end to the file.
+    void _output_bytes(uint8_t* end)
+    {
+        size_t size = end - _output.data();
+        _failed |= std::fwrite(_output.data(), 1, size, _file) != size;
+        _bytes += size;
+    }
+
+    uint8_t* _encode(uint8_t* out, const _Chunk& chunk)
+    {
+        if (chunk.start)
+        { // Memory may have changed since the last run.
+            _state = *chunk.start;
+            std::fill(&_known[0], &_known[CPU::MEM_SIZE], 0);
+        }
+        uint8_t* end = &_output[_OUTPUT_SIZE - _MAX_RECORD_SIZE];
+        TraceContext context = _context;
+        TraceRecord record;
+        for (size_t i = 0; i < chunk.size; ++i)
+        {
+            if (out > end)
+            {
+                _output_bytes(out);
+                out = _output.data();
+            }
+            bool code_changed = _replay(chunk.entries[i], record);
+            out = _record(out, context, record, code_changed);
+        }
+        _context = context;
+        return out;
+    }
+
+    // Builds the record of an entry and applies it to the writer's state. Returns whether the
+    // bytes of the instruction have to be recorded.
+    bool _replay(uint32_t entry, TraceRecord& record)
+    {
+        uint16_t pc = entry;
+        std::array<uint8_t, CPU::MEM_SIZE>& memory = _state.memory;
+        std::array<uint16_t, 16>& registers = _state.registers;
+        registers[0] = 0; // As the instruction saw it.
+        uint32_t code = memory[pc] | memory[(uint16_t)(pc + 1)] << 8 | memory[(uint16_t)(pc + 2)] << 16 | (uint32_t)memory[(uint16_t)(pc + 3)] << 24;
+        std::memcpy(record.code, &code, 4);
+        record.pc = pc;
+        record.value = entry >> 16;
+        uint16_t known = _known[pc];
+        bool code_changed = known == 0;
+        if (code_changed)
+        {
+            CPU::Decoded instruction = CPU::decode(record.code, 0);
+            uint8_t flags = instruction.opcode == CPU::BRA ? 0 : TRACE_REGISTER;
+            if (instruction.opcode == CPU::MEM && !(instruction.left & CPU::MEM_LOAD))
+                flags = instruction.left & CPU::MEM_WORD ? TRACE_STORE_WORD : TRACE_STORE_BYTE;
+            known = instruction.length | flags << 8;
+            _known[pc] = known;
+        }
+        record.length = known;
+        record.flags = known >> 8;
+        uint8_t dest = record.code[1] & 0xF;
+        if (record.flags & TRACE_REGISTER)
+            registers[dest] = record.value;
+        if (record.flags & (TRACE_STORE_BYTE | TRACE_STORE_WORD))
+        {
+            record.address = registers[record.code[0] & 0xF] + (int8_t)record.code[2];
+            record.stored = registers[dest];
+            memory[record.address] = record.stored;
+            if (record.flags & TRACE_STORE_WORD)
+                memory[(uint16_t)(record.address + 1)] = record.stored >> 8;
+            for (uint16_t i = 0; i < 5; ++i) // Instructions that overlap the stored bytes
+                _known[(uint16_t)(record.address + 1 - i)] = 0;
+        }
+        return code_changed;
+    }
+
+    static uint8_t* _varint(uint8_t* out, uint16_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = value | 0x80;
+            value >>= 7;
+        }
+        *out++ = value;
+        return out;
+    }
+
+    // Encodes record at out, with its bytes if code_changed. Returns where the next record goes.
+    static uint8_t* _record(uint8_t* out, TraceContext& context, const TraceRecord& record, bool code_changed)
+    {
+        uint8_t* start = out++;
+        uint8_t flags = record.flags;
+        if (record.pc != context.next)
+        {
+            flags |= TRACE_JUMP;
+            out = _varint(out, TraceContext::zigzag(record.pc - context.next));
+        }
+        if (code_changed)
+        {
+            flags |= TRACE_CODE;
+            std::memcpy(out, record.code, record.length);
+            out += record.length;
+        }
+        if (flags & TRACE_REGISTER)
+        {
+            uint8_t dest = record.code[1] & 0xF;
+            out = _varint(out, TraceContext::zigzag(record.value - context.registers[dest]));
+            context.registers[dest] = record.value;
+        }
+        if (flags & (TRACE_STORE_BYTE | TRACE_STORE_WORD))
+        {
+            out = _varint(out, TraceContext::zigzag(record.address - context.store));
+            context.store = record.address;
+            *out++ = record.stored;
+            if (flags & TRACE_STORE_WORD)
+                *out++ = record.stored >> 8;
+        }
+        *start = flags;
+        context.next = record.pc + record.length;
+        return out;
+    }
+
+    // Hands the chunk to the writer and takes an empty one.
+    void _flush()
+    {
+        std::unique_lock lock(_mutex);
+        _full.push_back(std::move(_chunk));
+        _changed.notify_all();
+        _changed.wait(lock, [&] { return !_free.empty(); });
+        _chunk = std::move(_free.back());
+        _free.pop_back();
+    }
+
+public:
+    Tracer() = default;
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    ~Tracer()
+    {
+        close();
+    }
+
+    // Starts a trace file. Returns false if it can't be created.
+    bool open(const std::string& filename)
+    {
+        close();
+        _file = std::fopen(filename.c_str(), "wb");
+        if (!_file)
+            return false;
+        _chunk.entries.resize(_ENTRIES);
+        _chunk.size = 0;
+        _free.resize(_BUFFERS - 1);
+        for (_Chunk& chunk : _free)
+            chunk.entries.resize(_ENTRIES);
+        _closing = false;
+        _records = 0;
+        _context = TraceContext();
+        _output.resize(_OUTPUT_SIZE);
+        _failed = false;
+        _bytes = 0;
+        _writer = std::thread(&Tracer::_write, this);
+        return true;
+    }
+
+    // Writes what's left and closes the file. Returns false if anything couldn't be written.
+    bool close()
+    {
+        if (!_file)
+            return true;
+        _flush();
+        {
+            std::lock_guard lock(_mutex);
+            _closing = true;
+            _changed.notify_all();
+        }
+        _writer.join();
+        bool ok = !_failed && std::fclose(_file) == 0;
+        _file = nullptr;
+        _chunk = {};
+        _full.clear();
+        _free.clear();
+        _output = {};
+        return ok;
+    }
+
+    // Runs cpu like cpu.run(max_cycles), recording every instruction it retires. An instruction
+    // that was already started (or that doesn't finish within max_cycles) isn't recorded.
+    void run(CPU& cpu, uint64_t max_cycles)
+    {
+        cpu._catch_up_events();
+        do
+            _run(cpu, max_cycles);
+        while (cpu._idle(max_cycles));
+    }
+
+private:
+    void _run(CPU& cpu, uint64_t max_cycles)
+    {
+        while (cpu._cycle != 0 && !cpu._halted && cpu._cycles < max_cycles)
+            cpu.update();
+        if (cpu._halted || cpu._cycles >= max_cycles)
+            return;
+
+        uint16_t pc = cpu._sync();
+        if (_chunk.size)
+            _flush();
+        _chunk.start = std::make_unique<_State>();
+        std::copy(&cpu._memory[0], &cpu._memory[CPU::MEM_SIZE], _chunk.start->memory.begin());
+        _chunk.start->registers = cpu._register;
+
+        // Like the fast engine while a whole instruction fits, then cycle by cycle.
+        uint64_t limit = max_cycles - std::min<uint64_t>(max_cycles, CPU::MAX_INSTRUCTION_CYCLES);
+        uint32_t* out = &_chunk.entries[0];
+        uint32_t* end = out + _ENTRIES;
+        uint64_t cycles = cpu._cycles;
+        uint64_t instructions = cpu._instructions;
+        while (!cpu._halted && cycles < limit)
+        {
+            if (cycles >= cpu._next_event) [[unlikely]]
+            {
+                cpu._cycles = cycles;
+                pc = cpu._events(pc);
+            }
+            uint16_t at = pc;
+            uint8_t dest = cpu._memory[(uint16_t)(at + 1)] & 0xF; // Before a store can change it.
+            cycles += cpu._execute(pc, cycles);
+            ++instructions;
+            *out++ = at | (uint32_t)cpu._register[dest] << 16;
+            if (out == end)
+            {
+                _chunk.size = _ENTRIES;
+                _flush();
+                out = &_chunk.entries[0];
+                end = out + _ENTRIES;
+            }
+        }
+        _records += instructions - cpu._instructions;
+        cpu._cycles = cycles;
+        cpu._instructions = instructions;
+        cpu._address = pc;
+
+        cpu._catch_up_events();
+        while (!cpu._halted && cpu._cycles < max_cycles)
+        {
+            uint16_t at = cpu._sync();
+            uint8_t dest = cpu._memory[(uint16_t)(at + 1)] & 0xF;
+            do
+                cpu.update();
+            while (cpu._cycle != 0 && cpu._cycles < max_cycles);
+            if (cpu._cycle != 0)
+                break;
+            *out++ = at | (uint32_t)cpu._register[dest] << 16;
+            ++_records;
+            if (out == end)
+            {
+                _chunk.size = _ENTRIES;
+                _flush();
+                out = &_chunk.entries[0];
+                end = out + _ENTRIES;
+            }
+        }
+        _chunk.size = out - &_chunk.entries[0];
+    }
+
+public:
+    uint64_t records() const
+    {
+        return _records;
+    }
+
+    // Bytes written to the file, once it's closed.
+    uint64_t bytes() const
+    {
+        return _bytes;
+    }
+};
+
+// Reads a trace file back, one record at a time.
+class TraceReader
+{
+    std::vector<uint8_t> _data;
+    size_t _offset = 0;
+    TraceContext _context;
+    std::unique_ptr<uint32_t[]> _code{ new uint32_t[CPU::MEM_SIZE]() }; // Last bytes recorded at each address.
+    std::unique_ptr<uint8_t[]> _length{ new uint8_t[CPU::MEM_SIZE]() }; // 0 if nothing was recorded there.
+
+    bool _varint(uint16_t& value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 21; shift += 7)
+        {
+            if (_offset == _data.size())
+                return false;
+            uint8_t byte = _data[_offset++];
+            value |= (byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+public:
+    // Returns false if the file can't be read or isn't a trace.
+    bool open(const std::string& filename)
+    {
+        std::ifstream file(filename, file.binary | file.ate);
+        if (!file)
+            return false;
+        _data.resize(file.tellg());
+        file.seekg(file.beg);
+        file.read(reinterpret_cast<char*>(_data.data()), _data.size());
+        _offset = sizeof(TRACE_MAGIC);
+        _context = TraceContext();
+        std::fill(&_length[0], &_length[CPU::MEM_SIZE], 0);
+        return file && _data.size() >= sizeof(TRACE_MAGIC) && std::equal(TRACE_MAGIC, TRACE_MAGIC + 8, _data.begin());
+    }
+
+    // Reads the next record. Returns false at the end of the trace, or if the rest is corrupt
+    // (then error() is true).
+    bool next(TraceRecord& record)
+    {
+        if (_offset >= _data.size())
+            return false;
+        uint8_t flags = _data[_offset++];
+        uint16_t delta = 0;
+        if (flags & TRACE_JUMP && !_varint(delta))
+            return _corrupt();
+        record.pc = _context.next + TraceContext::unzigzag(delta);
+        if (flags & TRACE_CODE)
+        {
+            if (_data.size() - _offset < 2)
+                return _corrupt();
+            uint8_t bytes[4] = { _data[_offset], _data[_offset + 1], 0, 0 };
+            uint8_t length = CPU::decode(bytes, 0).length;
+            if (_data.size() - _offset < length)
+                return _corrupt();
+            std::memcpy(bytes, &_data[_offset], length);
+            _offset += length;
+            std::memcpy(&_code[record.pc], bytes, 4);
+            _length[record.pc] = length;
+        }
+        else if (_length[record.pc] == 0)
+        {
+            return _corrupt();
+        }
+        std::memcpy(record.code, &_code[record.pc], 4);
+        record.length = _length[record.pc];
+        record.flags = flags & (TRACE_REGISTER | TRACE_STORE_BYTE | TRACE_STORE_WORD);
+        if (flags & TRACE_REGISTER)
+        {
+            uint8_t dest = record.code[1] & 0xF;
+            if (!_varint(delta))
+                return _corrupt();
+            record.value = _context.registers[dest] += TraceContext::unzigzag(delta);
+        }
+        if (flags & (TRACE_STORE_BYTE | TRACE_STORE_WORD))
+        {
+            size_t size = flags & TRACE_STORE_WORD ? 2 : 1;
+            if (!_varint(delta) || _data.size() - _offset < size)
+                return _corrupt();
+            record.address = _context.store += TraceContext::unzigzag(delta);
+            record.stored = _data[_offset++];
+            if (size == 2)
+                record.stored |= _data[_offset++] << 8;
+        }
+        _context.next = record.pc + record.length;
+        return true;
+    }
+
+    bool error() const
+    {
+        return _offset > _data.size();
+    }
+
+    // Writes a record as a line of text: the address, the bytes, the instruction and its effects.
+    static void print(const TraceRecord& record, std::ostream& out)
+    {
+        char line[Disassembler::MAX_LINE + 32];
+        char* end = Disassembler::disassemble(line, record.pc, record.code);
+        uint8_t dest = record.code[1] & 0xF;
+        if (record.flags & TRACE_REGISTER)
+            end = Disassembler::hex(Disassembler::text(Disassembler::decimal(Disassembler::text(end, "  r"), dest), " = "), record.value, 4);
+        if (record.flags & (TRACE_STORE_BYTE | TRACE_STORE_WORD))
+        {
+            end = Disassembler::text(Disassembler::hex(Disassembler::text(end, "  ["), record.address, 4), "] = ");
+            end = record.flags & TRACE_STORE_WORD ? Disassembler::hex(end, record.stored, 4) : Disassembler::hex(end, record.stored & 0xFF, 2);
+        }
+        *end++ = '\n';
+        out.write(line, end - line);
+    }
+
+private:
+    bool _corrupt()
+    {
+        _offset = _data.size() + 1;
+        return false;
+    }
+};